@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  CPU affinity for the server's threads.
+ *
+ *  Libevent threads can be pinned one per cpu of a worker set, storage
+ *  threads float over the whole worker set, and the db maintenance threads
+ *  go to a set of housekeeping cpus (or anywhere the process may run, if
+ *  none are given). With the default first-touch policy, the memory a
+ *  pinned thread allocates for its conns and buffers then stays on its
+ *  node.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#endif
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SCHED_SETAFFINITY
+
+static cpu_set_t process_cpus;      /* where we could run at startup */
+static cpu_set_t worker_cpus;
+static cpu_set_t housekeeping_cpus;
+static int worker_list[CPU_SETSIZE]; /* worker_cpus, in the order given */
+static int nworker_cpus = 0;
+static bool has_housekeeping = false;
+
+/*
+ * Parses a cpu list such as "0-3,8,10-11" into *set*, and the cpus in the
+ * order given into *list*, if not NULL. Returns the number of cpus, or -1
+ * if the list doesn't parse.
+ */
+static int affinity_parse(const char *spec, cpu_set_t *set, int *list) {
+    const char *p = spec;
+    char *end;
+    long lo, hi;
+    int n = 0;
+
+    CPU_ZERO(set);
+    while (*p != '\0') {
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo >= CPU_SETSIZE)
+            return -1;
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo || hi >= CPU_SETSIZE)
+                return -1;
+            p = end;
+        }
+        for (; lo <= hi; lo++) {
+            if (CPU_ISSET(lo, set))
+                continue;
+            CPU_SET(lo, set);
+            if (list != NULL)
+                list[n] = lo;
+            n++;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+    return n > 0 ? n : -1;
+}
+
+/* the cpus the process may run on, before any thread got pinned */
+void affinity_init(void) {
+    if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0) {
+        perror("sched_getaffinity()");
+        CPU_ZERO(&process_cpus);
+    }
+}
+
+int affinity_set_workers(const char *spec) {
+    nworker_cpus = affinity_parse(spec, &worker_cpus, worker_list);
+    if (nworker_cpus < 0) {
+        nworker_cpus = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_set_housekeeping(const char *spec) {
+    has_housekeeping = affinity_parse(spec, &housekeeping_cpus, NULL) > 0;
+    return has_housekeeping ? 0 : -1;
+}
+
+bool affinity_workers_pinned(void) {
+    return nworker_cpus > 0;
+}
+
+static void affinity_apply(cpu_set_t *set, const char *what) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), set) != 0 && settings.verbose > 0)
+        fprintf(stderr, "failed to set the cpu affinity of a %s thread: %s\n",
+                what, strerror(errno));
+}
+
+/* pins the calling libevent thread, the *n*th one, to its worker cpu */
+void affinity_worker(int n) {
+    cpu_set_t set;
+
+    if (nworker_cpus == 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(worker_list[n % nworker_cpus], &set);
+    affinity_apply(&set, "worker");
+}
+
+/* lets the calling storage thread run on any worker cpu */
+void affinity_storage(void) {
+    if (nworker_cpus == 0)
+        return;
+    affinity_apply(&worker_cpus, "storage");
+}
+
+/*
+ * Moves the calling maintenance thread to the housekeeping cpus. It might
+ * otherwise have inherited a worker's pinning from the thread that made it.
+ */
+void affinity_housekeeping(void) {
+    if (has_housekeeping)
+        affinity_apply(&housekeeping_cpus, "housekeeping");
+    else if (nworker_cpus > 0 && CPU_COUNT(&process_cpus) > 0)
+        affinity_apply(&process_cpus, "housekeeping");
+}
+
+#else /* !HAVE_SCHED_SETAFFINITY */
+
+void affinity_init(void) {
+}
+
+int affinity_set_workers(const char *spec) {
+    fprintf(stderr, "cpu affinity is not supported on this platform\n");
+    return -1;
+}
+
+int affinity_set_housekeeping(const char *spec) {
+    fprintf(stderr, "cpu affinity is not supported on this platform\n");
+    return -1;
+}
+
+bool affinity_workers_pinned(void) {
+    return false;
+}
+
+void affinity_worker(int n) {
+}
+
+void affinity_storage(void) {
+}
+
+void affinity_housekeeping(void) {
+}
+
+#endif /* !HAVE_SCHED_SETAFFINITY */
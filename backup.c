@@ -0,0 +1,472 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Hot backup, streamed as a tar archive to a file or a socket.
+ *
+ *  This is BerkeleyDB's hot backup sequence: the data files are copied
+ *  first, then every log file, while the server goes on taking writes.
+ *  Pages may be caught mid-write, but the write ahead log has everything
+ *  to fix them, so catastrophic recovery (db_recover -c) over the unpacked
+ *  archive gives a consistent snapshot as of the end of the backup. Logs
+ *  are not removed while it runs.
+ *
+ *  The copy runs in a thread of its own, with plain reads, and can be
+ *  limited to a number of kbytes a second. The archive goes to a host:port,
+ *  or to a new file in the --backup-dir directory, which is never under
+ *  the env home.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <db.h>
+
+#define BACKUP_CHUNK (64 * 1024)   /* a multiple of any page size */
+#define TAR_BLOCK 512
+
+enum backup_state { BACKUP_IDLE, BACKUP_RUNNING, BACKUP_CANCELLING,
+                    BACKUP_CANCELLED, BACKUP_DONE, BACKUP_FAILED };
+
+static const char *backup_state_names[] = {
+    "idle", "running", "cancelling", "cancelled", "done", "failed"
+};
+
+static struct {
+    enum backup_state state;
+    char dest[256];
+    int rate;               /* kbytes a second, 0 for no limit */
+    int fd;
+    int files;              /* copied so far */
+    char file[NAME_MAX + 1];/* being copied now */
+    u_int64_t bytes;
+    struct timeval started;
+    time_t finished;
+    char error[128];
+    bool auto_remove;       /* log auto removal to turn back on after */
+} backup;
+
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t backup_tid;
+static bool backup_started = false;     /* backup_tid is there to join */
+
+/* whether *dest* names a host:port rather than a file */
+static bool backup_is_remote(const char *dest) {
+    return strchr(dest, ':') != NULL;
+}
+
+/*
+ * Opens *dest*: connects to a host:port, or creates the file of that name
+ * in the backup dir, which must not be there yet. Returns -1 with errno
+ * set if it can't.
+ */
+static int backup_open(const char *dest) {
+    struct addrinfo hints, *ai, *next;
+    char host[256], path[PATH_MAX], *port;
+    int fd = -1, err;
+
+    if (!backup_is_remote(dest)) {
+        if (bdb_export_dir(bdb_settings.backup_dir, path) != 0)
+            return -1;
+        if (strlen(path) + strlen(dest) + 2 > sizeof(path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcat(path, "/");
+        strcat(path, dest);
+        return open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    }
+
+    port = strrchr(dest, ':');
+    snprintf(host, sizeof(host), "%.*s", (int)(port - dest), dest);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port + 1, &hints, &ai) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    err = ECONNREFUSED;
+    for (next = ai; next != NULL; next = next->ai_next) {
+        if ((fd = socket(next->ai_family, next->ai_socktype, next->ai_protocol)) == -1) {
+            err = errno;
+            continue;
+        }
+        if (connect(fd, next->ai_addr, next->ai_addrlen) == 0)
+            break;
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    if (fd == -1)
+        errno = err;
+    return fd;
+}
+
+/*
+ * Writes *len* bytes to the archive, then sleeps for as long as it is
+ * ahead of the rate. Returns -1 on a write error, or if cancelled.
+ */
+static int backup_write(const char *buf, size_t len) {
+    struct timeval now, t;
+    ssize_t res;
+    u_int64_t due, spent;
+
+    while (len > 0) {
+        if ((res = write(backup.fd, buf, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+        pthread_mutex_lock(&backup_lock);
+        backup.bytes += res;
+        pthread_mutex_unlock(&backup_lock);
+    }
+
+    if (backup.rate > 0) {
+        gettimeofday(&now, NULL);
+        due = backup.bytes * 1000000 / ((u_int64_t)backup.rate * 1024);
+        spent = (now.tv_sec - backup.started.tv_sec) * 1000000LL +
+                (now.tv_usec - backup.started.tv_usec);
+        if (due > spent) {
+            t.tv_sec = (due - spent) / 1000000;
+            t.tv_usec = (due - spent) % 1000000;
+            (void)select(0, NULL, NULL, NULL, &t);
+        }
+    }
+    if (backup.state != BACKUP_RUNNING) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+/* a ustar header for a regular file, the size base-256 if it needs to be */
+static void tar_header(char *hdr, const char *name, u_int64_t size, time_t mtime) {
+    unsigned int sum = 0;
+    int i;
+
+    memset(hdr, 0, TAR_BLOCK);
+    snprintf(hdr, 100, "%s", name);
+    memcpy(hdr + 100, "0000600", 7);
+    memcpy(hdr + 108, "0000000", 7);
+    memcpy(hdr + 116, "0000000", 7);
+    if (size < 077777777777ULL) {
+        snprintf(hdr + 124, 12, "%011llo", (unsigned long long)size);
+    } else {
+        hdr[124] = (char)0x80;
+        for (i = 11; i > 0; i--, size >>= 8)
+            hdr[124 + i] = (char)(size & 0xff);
+    }
+    snprintf(hdr + 136, 12, "%011lo", (unsigned long)mtime);
+    hdr[156] = '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    memset(hdr + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    hdr[155] = ' ';
+}
+
+/*
+ * Adds the file at *path* to the archive, as much of it as there was when
+ * it is opened. A log file goes on growing, but what is past that is in
+ * no page copied before it.
+ */
+static int backup_file(const char *path, char *buf) {
+    struct stat st;
+    const char *name;
+    u_int64_t left;
+    size_t n;
+    ssize_t res;
+    int fd;
+
+    name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    pthread_mutex_lock(&backup_lock);
+    snprintf(backup.file, sizeof(backup.file), "%s", name);
+    pthread_mutex_unlock(&backup_lock);
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    tar_header(buf, name, st.st_size, st.st_mtime);
+    if (backup_write(buf, TAR_BLOCK) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    for (left = st.st_size; left > 0; left -= n) {
+        n = left > BACKUP_CHUNK ? BACKUP_CHUNK : left;
+        if ((res = read(fd, buf, n)) == -1) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        /* can't be shorter than the header says, pad it */
+        if ((size_t)res < n)
+            memset(buf + res, 0, n - res);
+        if (backup_write(buf, n) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    n = st.st_size % TAR_BLOCK;
+    if (n > 0) {
+        memset(buf, 0, TAR_BLOCK - n);
+        if (backup_write(buf, TAR_BLOCK - n) != 0)
+            return -1;
+    }
+    pthread_mutex_lock(&backup_lock);
+    backup.files++;
+    pthread_mutex_unlock(&backup_lock);
+    return 0;
+}
+
+/* adds every file log_archive() lists with *flags*, 0 or a db error */
+static int backup_files(u_int32_t flags, char *buf) {
+    char **list, **p;
+    int ret;
+
+    if ((ret = env->log_archive(env, &list, flags | DB_ARCH_ABS)) != 0)
+        return ret;
+    if (list == NULL)
+        return 0;
+    for (p = list; *p != NULL; p++) {
+        if (backup_file(*p, buf) != 0) {
+            ret = errno;
+            break;
+        }
+    }
+    free(list);
+    return ret;
+}
+
+/*
+ * Adds the data files. log_archive() leaves out those not written to in
+ * the logs that are left, so every keyspace file and the dictionaries
+ * are added too, if it did. Returns 0 or a db error.
+ */
+static int backup_data(char *buf) {
+    char **list, **p, name[PATH_MAX], path[PATH_MAX];
+    int ret, i;
+    bool listed;
+
+    if ((ret = env->log_archive(env, &list, DB_ARCH_DATA)) != 0)
+        return ret;
+    for (p = list; p != NULL && *p != NULL; p++) {
+        snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, *p);
+        if (backup_file(path, buf) != 0) {
+            ret = errno;
+            break;
+        }
+    }
+
+    /* bdb_ns[bdb_nns] stands for the dictionaries */
+    for (i = 0; ret == 0 && i <= bdb_nns; i++) {
+        if (i < bdb_nns)
+            snprintf(name, sizeof(name), "%s", bdb_ns[i].db_file);
+        else
+            dict_db_name(name, sizeof(name));
+        for (listed = false, p = list; p != NULL && *p != NULL && !listed; p++)
+            listed = strcmp(*p, name) == 0;
+        snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, name);
+        if (listed || access(path, F_OK) != 0)
+            continue;
+        if (backup_file(path, buf) != 0)
+            ret = errno;
+    }
+    free(list);
+    return ret;
+}
+
+static void *backup_thread(void *arg) {
+    char *buf = NULL;
+    int ret, fd;
+
+    affinity_housekeeping();
+    if ((fd = backup_open(backup.dest)) == -1) {
+        ret = errno;
+        pthread_mutex_lock(&backup_lock);
+        snprintf(backup.file, sizeof(backup.file), "%s", backup.dest);
+        pthread_mutex_unlock(&backup_lock);
+    } else {
+        backup.fd = fd;
+        /* logs must stay until they are copied */
+        if (!bdb_settings.is_replicated && bdb_settings.log_auto_remove) {
+            env->log_set_config(env, DB_LOG_AUTO_REMOVE, 0);
+            backup.auto_remove = true;
+        }
+        if ((buf = malloc(BACKUP_CHUNK)) == NULL) {
+            ret = ENOMEM;
+        } else if ((ret = backup_data(buf)) == 0 &&
+                   (ret = backup_files(DB_ARCH_LOG, buf)) == 0) {
+            /* the end of the archive */
+            memset(buf, 0, TAR_BLOCK * 2);
+            if (backup_write(buf, TAR_BLOCK * 2) != 0)
+                ret = errno;
+        }
+        free(buf);
+        close(fd);
+        if (backup.auto_remove)
+            env->log_set_config(env, DB_LOG_AUTO_REMOVE, 1);
+    }
+
+    pthread_mutex_lock(&backup_lock);
+    if (ret == 0) {
+        backup.state = BACKUP_DONE;
+    } else if (backup.state == BACKUP_CANCELLING) {
+        backup.state = BACKUP_CANCELLED;
+    } else {
+        backup.state = BACKUP_FAILED;
+        snprintf(backup.error, sizeof(backup.error), "%s: %s", backup.file, db_strerror(ret));
+    }
+    backup.finished = time(NULL);
+    pthread_mutex_unlock(&backup_lock);
+
+    if (backup.state == BACKUP_FAILED) {
+        fprintf(stderr, "backup to %s failed, %s\n", backup.dest, backup.error);
+    } else if (settings.verbose > 0) {
+        fprintf(stderr, "backup to %s %s, %d files, %llu bytes\n", backup.dest,
+                backup_state_names[backup.state], backup.files,
+                (unsigned long long)backup.bytes);
+    }
+    return NULL;
+}
+
+/*
+ * Starts a backup to *dest*, a host:port or a file name in the backup
+ * dir, at most *rate* kbytes a second, 0 for no limit. Connecting or
+ * creating the file is up to the backup thread, which fails the run in
+ * "stats backup" if it can't. Returns -1 with errno set if it can't
+ * start: EBUSY if one is going, EINVAL for a name that isn't a plain file
+ * name, EACCES if there is no backup dir.
+ */
+int backup_start(const char *dest, int rate) {
+    if (!backup_is_remote(dest)) {
+        if (bdb_settings.backup_dir == NULL) {
+            errno = EACCES;
+            return -1;
+        }
+        if (*dest == '\0' || strchr(dest, '/') != NULL ||
+            strcmp(dest, ".") == 0 || strcmp(dest, "..") == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (strlen(dest) >= sizeof(backup.dest)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    pthread_mutex_lock(&backup_lock);
+    if (backup.state == BACKUP_RUNNING || backup.state == BACKUP_CANCELLING) {
+        pthread_mutex_unlock(&backup_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    /* the last run is over, its thread only has a message left to log */
+    if (backup_started) {
+        pthread_join(backup_tid, NULL);
+        backup_started = false;
+    }
+    memset(&backup, 0, sizeof(backup));
+    backup.state = BACKUP_RUNNING;
+    snprintf(backup.dest, sizeof(backup.dest), "%s", dest);
+    backup.rate = rate;
+    backup.fd = -1;
+    gettimeofday(&backup.started, NULL);
+
+    if ((errno = pthread_create(&backup_tid, NULL, backup_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning backup thread: %s\n", strerror(errno));
+        backup.state = BACKUP_FAILED;
+        snprintf(backup.error, sizeof(backup.error), "%s", strerror(errno));
+        pthread_mutex_unlock(&backup_lock);
+        return -1;
+    }
+    backup_started = true;
+    pthread_mutex_unlock(&backup_lock);
+    return 0;
+}
+
+int backup_cancel(void) {
+    int ret = -1;
+
+    pthread_mutex_lock(&backup_lock);
+    if (backup.state == BACKUP_RUNNING) {
+        backup.state = BACKUP_CANCELLING;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&backup_lock);
+    return ret;
+}
+
+/* Cancels a run, and waits for its thread to be gone; before the env closes. */
+void backup_close(void) {
+    bool started;
+
+    backup_cancel();
+    pthread_mutex_lock(&backup_lock);
+    started = backup_started;
+    backup_started = false;
+    pthread_mutex_unlock(&backup_lock);
+    if (started)
+        pthread_join(backup_tid, NULL);
+}
+
+/* log files must not be removed while this is true */
+bool backup_running(void) {
+    bool running;
+
+    pthread_mutex_lock(&backup_lock);
+    running = backup.state == BACKUP_RUNNING || backup.state == BACKUP_CANCELLING;
+    pthread_mutex_unlock(&backup_lock);
+    return running;
+}
+
+void stats_backup(char *temp) {
+    char *pos = temp;
+    time_t until;
+
+    pthread_mutex_lock(&backup_lock);
+    pos += sprintf(pos, "STAT backup_state %s\r\n", backup_state_names[backup.state]);
+    if (backup.state != BACKUP_IDLE) {
+        until = backup.finished != 0 ? backup.finished : time(NULL);
+        pos += sprintf(pos, "STAT backup_dest %s\r\n", backup.dest);
+        pos += sprintf(pos, "STAT backup_rate %d\r\n", backup.rate);
+        pos += sprintf(pos, "STAT backup_file %s\r\n", backup.file);
+        pos += sprintf(pos, "STAT backup_files %d\r\n", backup.files);
+        pos += sprintf(pos, "STAT backup_bytes %llu\r\n", (unsigned long long)backup.bytes);
+        pos += sprintf(pos, "STAT backup_elapsed %ld\r\n", (long)(until - backup.started.tv_sec));
+    }
+    if (backup.state == BACKUP_FAILED)
+        pos += sprintf(pos, "STAT backup_error %s\r\n", backup.error);
+    pos += sprintf(pos, "END");
+    pthread_mutex_unlock(&backup_lock);
+}
@@ -17,39 +17,76 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/time.h>
 #include <db.h>
 
+#define CHKPOINT_TICK 1 /* seconds between looks at the log and the cache */
+#define CHKPOINT_KBYTE_DEFAULT (64 * 1024) /* 64MB of log */
+#define CHKPOINT_DIRTY_DEFAULT 50
+#define TRICKLE_TICK 1  /* seconds between looks at the cache */
+#define REP_ROLE_WAIT 30 /* most seconds to wait for an election or a master at startup */
+#define TRICKLE_STEP_UP 10   /* percent more to keep clean on a dirty eviction */
+#define TRICKLE_STEP_DOWN 5  /* percent less after a quiet memp_trickle_val */
+#define TRICKLE_MAX_PERCENT 95
+#define DEADLOCK_RETRIES 5   /* times a deadlock victim is run again */
+#define DEADLOCK_BACKOFF 100 /* microseconds before the first retry, doubling after */
+
 static void *bdb_chkpoint_thread __P((void *));
 static void *bdb_memp_trickle_thread __P((void *));
 static void *bdb_dl_detect_thread __P((void *));
+static u_int32_t bdb_chkpoint_write_ahead __P((DB_ENV *, u_int32_t, u_int32_t));
 static void bdb_event_callback __P((DB_ENV *, u_int32_t, void *));
 static void bdb_err_callback(const DB_ENV *dbenv, const char *errpfx, const char *msg);
 static void bdb_msg_callback(const DB_ENV *dbenv, const char *msg);
+static int bdb_db_open_one(struct bdb_ns *ns, DB **dbpp, DB_TXN *txn, const char *name, DBTYPE type, u_int32_t flags);
+static int bdb_shards_open(struct bdb_ns *ns);
 
 
 static pthread_t chk_ptid;
 static pthread_t mtri_ptid;
 static pthread_t dld_ptid;
+static bool chk_started, mtri_started, dld_started;  /* there to join */
+
+struct chkpoint_stats chkpoint_stats = { 0, "none", 0, 0, 0, 0, 0, 0, 0 };
+struct trickle_stats trickle_stats;
+
+/* the default keyspace is bdb_ns[0], -W adds the rest */
+struct bdb_ns bdb_ns[MAX_NAMESPACES];
+int bdb_nns = 1;
 
 void bdb_settings_init(void)
 {
     bdb_settings.db_file = DBFILE;
     bdb_settings.env_home = DBHOME;
     bdb_settings.log_home = NULL;
+    bdb_settings.backup_dir = NULL;
+    bdb_settings.dump_dir = NULL;
     bdb_settings.cache_size = 256 * 1024 * 1024; /* default is 256MB */ 
     bdb_settings.txn_lg_bsize = 4 * 1024 * 1024; /* default is 4MB */ 
     bdb_settings.page_size = 4096;  /* default is 4K */
     bdb_settings.db_type = DB_BTREE;
     bdb_settings.txn_nosync = 0; /* default DB_TXN_NOSYNC is off */
     bdb_settings.log_auto_remove = 0; /* default DB_LOG_AUTO_REMOVE is off */
-    bdb_settings.dldetect_val = 100 * 1000; /* default is 100 millisecond */
+    bdb_settings.dldetect_val = 0; /* default is to detect on conflict only */
     bdb_settings.chkpoint_val = 60 * 5;
+    bdb_settings.chkpoint_kbyte = -1; /* default is 64MB of log, see start_chkpoint_thread() */
+    bdb_settings.chkpoint_dirty_percent = -1; /* default is 50% */
+    bdb_settings.chkpoint_rate = 0; /* default is no limit */
     bdb_settings.memp_trickle_val = 30;
     bdb_settings.memp_trickle_percent = 60; 
+    bdb_settings.dict_min_size = 0; /* default dictionary compression is off */
+    bdb_settings.db_nshards = 1; /* default is a single database */
+    bdb_settings.bloom_fp_rate = 0; /* default key filter is off */
+    bdb_settings.negcache_size = 0; /* default negative cache is off */
+    bdb_settings.hotkeys_val = 0; /* default warm-up is off */
+    bdb_settings.warmup_wait = 0;
+    bdb_settings.bulk_load = 0;
     bdb_settings.db_flags = DB_CREATE | DB_AUTO_COMMIT;
     bdb_settings.env_flags = DB_CREATE
                           | DB_INIT_LOCK 
@@ -159,6 +196,12 @@ void bdb_env_init(void){
     env->set_lk_max_locks(env, 20000);
     env->set_lk_max_objects(env, 20000);
 
+    /* run the deadlock detector whenever a lock request has to wait */
+    if ((ret = env->set_lk_detect(env, DB_LOCK_YOUNGEST)) != 0) {
+        fprintf(stderr, "env->set_lk_detect: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
     /* at least max active transactions */
   	env->set_tx_max(env, 10000);
 
@@ -258,10 +301,14 @@ void bdb_env_init(void){
         }
     }
 
+    /* recovery reports how far it is, see startup.c */
+    env->set_feedback(env, startup_feedback);
+    startup_recovery_begin();
     if ((ret = env->open(env, bdb_settings.env_home, bdb_settings.env_flags, 0)) != 0) {
         fprintf(stderr, "db_env_open: %s\n", db_strerror(ret));
         exit(EXIT_FAILURE);
     }
+    startup_recovery_end(env);
 
     if(bdb_settings.is_replicated) {
         /* repmgr_start must run after daemon !!!*/
@@ -269,18 +316,48 @@ void bdb_env_init(void){
             fprintf(stderr, "env->repmgr_start: %s\n", db_strerror(ret));
             exit(EXIT_FAILURE);
         }
-        /* sleep 5 second for electing or client startup */
+        /* wait for the election or the master to tell us what we are */
         if (bdb_settings.rep_start_policy == DB_REP_ELECTION ||
             bdb_settings.rep_start_policy == DB_REP_CLIENT) {
-            sleep(5);
+            startup_set_phase(STARTUP_ELECTING);
+            if (!startup_wait_role(REP_ROLE_WAIT)) {
+                fprintf(stderr, "no replication role after %d seconds, opening the db anyway\n",
+                        REP_ROLE_WAIT);
+            }
         }
     }
 }
 
 
 void bdb_db_open(void){
-    int ret;
+    int ret, i;
     int db_open = 0;
+
+    /* the default keyspace takes the global settings, and so does
+       whatever -W left out for the others */
+    strcpy(bdb_ns[0].name, "default");
+    bdb_ns[0].db_file = bdb_settings.db_file;
+    bdb_ns[0].db_type = bdb_settings.db_type;
+    bdb_ns[0].page_size = bdb_settings.page_size;
+    bdb_ns[0].dict_min_size = bdb_settings.dict_min_size;
+    bdb_ns[0].priority = DB_PRIORITY_DEFAULT;
+    for (i = 1; i < bdb_nns; i++){
+        /* -f can come after -W, so this is the first we know of both */
+        if (strcmp(bdb_ns[i].db_file, bdb_settings.db_file) == 0){
+            fprintf(stderr, "namespace '%s': its file %s is the default database's, pick another name.\n",
+                    bdb_ns[i].name, bdb_ns[i].db_file);
+            exit(EXIT_FAILURE);
+        }
+        if (bdb_ns[i].db_type == DB_UNKNOWN)
+            bdb_ns[i].db_type = bdb_settings.db_type;
+        if (bdb_ns[i].page_size == 0)
+            bdb_ns[i].page_size = bdb_settings.page_size;
+        if (bdb_ns[i].dict_min_size < 0)
+            bdb_ns[i].dict_min_size = bdb_settings.dict_min_size;
+    }
+
+    startup_set_phase(STARTUP_OPENING);
+
     /* for replicas to get a full master copy, then open db */
     while(!db_open) {
         /* if replica, just scratch the db file from a master */
@@ -296,18 +373,10 @@ void bdb_db_open(void){
 
         bdb_db_close();
 
-        if ((ret = db_create(&dbp, env, 0)) != 0) {
-            fprintf(stderr, "db_create: %s\n", db_strerror(ret));
-            exit(EXIT_FAILURE);
-        }
-        /* set page size */
-        if((ret = dbp->set_pagesize(dbp, bdb_settings.page_size)) != 0){
-            fprintf(stderr, "dbp->set_pagesize: %s\n", db_strerror(ret));
-            exit(EXIT_FAILURE);
+        /* try to open db, every keyspace of it */
+        for (i = 0, ret = 0; i < bdb_nns && ret == 0; i++){
+            ret = bdb_shards_open(&bdb_ns[i]);
         }
-
-        /* try to open db*/
-        ret = dbp->open(dbp, NULL, bdb_settings.db_file, NULL, bdb_settings.db_type, bdb_settings.db_flags, 0664);         
         switch (ret){
         case 0:
             db_open = 1;
@@ -316,7 +385,9 @@ void bdb_db_open(void){
         case DB_LOCK_DEADLOCK:
         case DB_REP_LOCKOUT:
             fprintf(stderr, "db_open: %s\n", db_strerror(ret));
-            sleep(3);
+            /* try again on the next replication event, a new role or the
+               client's sync being done, or in 3 seconds */
+            startup_wait_event(3);
             break;
         default:
             fprintf(stderr, "db_open: %s\n", db_strerror(ret));
@@ -326,8 +397,220 @@ void bdb_db_open(void){
 
 }
 
+/* open a database in the keyspace's file, *name* is NULL for an unsharded one */
+static int bdb_db_open_one(struct bdb_ns *ns, DB **dbpp, DB_TXN *txn, const char *name, DBTYPE type, u_int32_t flags){
+    DB *db;
+    int ret;
+
+    *dbpp = NULL;
+    if ((ret = db_create(&db, env, 0)) != 0) {
+        fprintf(stderr, "db_create: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    /* set page size */
+    if((ret = db->set_pagesize(db, ns->page_size)) != 0){
+        fprintf(stderr, "dbp->set_pagesize: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    /* a bulk load is synced at the end instead of logged */
+    if (bdb_settings.bulk_load && (ret = db->set_flags(db, DB_TXN_NOT_DURABLE)) != 0){
+        fprintf(stderr, "dbp->set_flags: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    if ((ret = db->open(db, txn, ns->db_file, name, type, flags, 0664)) != 0){
+        db->close(db, 0);
+        return ret;
+    }
+    /* set cache priority */
+    if((ret = db->set_priority(db, ns->priority)) != 0){
+        fprintf(stderr, "dbp->set_priority: %s\n", db_strerror(ret));
+    }
+    *dbpp = db;
+    return 0;
+}
+
+/* A sharded database file holds "shard.NNN" sub-databases, an unsharded one
+   is a plain database as before. The shard count is fixed when the file is
+   created; later we just count what is there, whatever -k says. */
+static int bdb_shards_open(struct bdb_ns *ns){
+    DB *db;
+    DB_TXN *txn = NULL;
+    char name[16];
+    int ret, i, multiple = 0;
+    int nshards = bdb_settings.db_nshards;
+
+    /* peek at the file, if any */
+    if ((ret = bdb_db_open_one(ns, &db, NULL, NULL, DB_UNKNOWN, bdb_settings.db_flags & ~DB_CREATE)) == 0){
+        multiple = db->get_multiple(db);
+        db->close(db, 0);
+    }
+
+    if (ret == 0 && !multiple){
+        if (nshards > 1){
+            fprintf(stderr, "db_open: %s is not sharded, ignoring -k %d\n", ns->db_file, nshards);
+        }
+        ns->nshards = 1;
+        return bdb_db_open_one(ns, &ns->dbps[0], NULL, NULL, ns->db_type, bdb_settings.db_flags);
+    }
+
+    if (ret == 0){
+        for (i = 0; i < MAX_DB_SHARDS; i++){
+            snprintf(name, sizeof(name), "shard.%03d", i);
+            ret = bdb_db_open_one(ns, &ns->dbps[i], NULL, name, ns->db_type, bdb_settings.db_flags & ~DB_CREATE);
+            if (ret == ENOENT){
+                break;
+            }
+            if (ret != 0){
+                return ret;
+            }
+        }
+        /* shards are created in one txn, so none means not there yet */
+        if (i == 0){
+            return ENOENT;
+        }
+        if (nshards != i){
+            fprintf(stderr, "db_open: %s has %d shards, ignoring -k %d\n", ns->db_file, i, nshards);
+        }
+        ns->nshards = i;
+        return 0;
+    }
+
+    /* a new file; replicas wait for the master to create it */
+    if (ret != ENOENT || !(bdb_settings.db_flags & DB_CREATE) || nshards == 1){
+        ns->nshards = 1;
+        return bdb_db_open_one(ns, &ns->dbps[0], NULL, NULL, ns->db_type, bdb_settings.db_flags);
+    }
+
+    if ((ret = env->txn_begin(env, NULL, &txn, 0)) != 0){
+        return ret;
+    }
+    for (i = 0; i < nshards; i++){
+        snprintf(name, sizeof(name), "shard.%03d", i);
+        ret = bdb_db_open_one(ns, &ns->dbps[i], txn, name, ns->db_type, bdb_settings.db_flags & ~DB_AUTO_COMMIT);
+        if (ret != 0){
+            txn->abort(txn);
+            while (i-- > 0){
+                ns->dbps[i]->close(ns->dbps[i], 0);
+                ns->dbps[i] = NULL;
+            }
+            return ret;
+        }
+    }
+    ns->nshards = nshards;
+    return txn->commit(txn, 0);
+}
+
+/* which shard a key lives in; FNV-1a, so the mapping never changes under a database */
+int bdb_shard(struct bdb_ns *ns, const char *key, size_t nkey){
+    uint32_t hash = 2166136261U;
+
+    if (ns->nshards <= 1){
+        return 0;
+    }
+    while (nkey-- > 0){
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619U;
+    }
+    return hash % ns->nshards;
+}
+
+/* -W name[:btree|hash[:pagesize[:dict_min_size[:priority]]]], left out
+   fields fall back to the global settings when the db is opened */
+int bdb_ns_add(char *spec){
+    static const char *priorities[] = {"verylow", "low", "default", "high", "veryhigh"};
+    static const DB_CACHE_PRIORITY priority_vals[] = {DB_PRIORITY_VERY_LOW, DB_PRIORITY_LOW,
+        DB_PRIORITY_DEFAULT, DB_PRIORITY_HIGH, DB_PRIORITY_VERY_HIGH};
+    struct bdb_ns *ns;
+    char *name, *field;
+    size_t i;
+
+    if (bdb_nns >= MAX_NAMESPACES){
+        fprintf(stderr, "too many namespaces, at most %d.\n", MAX_NAMESPACES - 1);
+        return -1;
+    }
+    name = strsep(&spec, ":");
+    if (strlen(name) == 0 || strlen(name) > NS_NAME_LENGTH ||
+        strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != strlen(name)){
+        fprintf(stderr, "namespace name should be 1 ~ %d letters, digits, '_' or '-'.\n", NS_NAME_LENGTH);
+        return -1;
+    }
+    if (bdb_ns_find(name, strlen(name)) != NULL || strcmp(name, "default") == 0){
+        fprintf(stderr, "namespace '%s' is given twice.\n", name);
+        return -1;
+    }
+
+    ns = &bdb_ns[bdb_nns];
+    memset(ns, 0, sizeof(struct bdb_ns));
+    strcpy(ns->name, name);
+    ns->db_type = DB_UNKNOWN;
+    ns->dict_min_size = -1;
+    ns->priority = DB_PRIORITY_DEFAULT;
+    if ((ns->db_file = malloc(strlen(name) + 4)) == NULL){
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    sprintf(ns->db_file, "%s.db", name);
+
+    if ((field = strsep(&spec, ":")) != NULL && *field != '\0'){
+        if (strcmp(field, "btree") == 0){
+            ns->db_type = DB_BTREE;
+        }else if (strcmp(field, "hash") == 0){
+            ns->db_type = DB_HASH;
+        }else{
+            fprintf(stderr, "namespace '%s': db_type should be 'btree' or 'hash'.\n", name);
+            return -1;
+        }
+    }
+    if ((field = strsep(&spec, ":")) != NULL && *field != '\0'){
+        ns->page_size = atoi(field);
+        if (ns->page_size < 512 || ns->page_size > 65536 || (ns->page_size & (ns->page_size - 1)) != 0){
+            fprintf(stderr, "namespace '%s': page size should be 512B ~ 64KB and a power of two.\n", name);
+            return -1;
+        }
+    }
+    if ((field = strsep(&spec, ":")) != NULL && *field != '\0'){
+        ns->dict_min_size = atoi(field);
+        if (ns->dict_min_size < 0){
+            fprintf(stderr, "namespace '%s': dictionary compression size should be >= 0.\n", name);
+            return -1;
+        }
+    }
+    if ((field = strsep(&spec, ":")) != NULL && *field != '\0'){
+        for (i = 0; i < sizeof(priorities) / sizeof(priorities[0]); i++){
+            if (strcmp(field, priorities[i]) == 0)
+                break;
+        }
+        if (i == sizeof(priorities) / sizeof(priorities[0])){
+            fprintf(stderr, "namespace '%s': priority should be verylow, low, default, high or veryhigh.\n", name);
+            return -1;
+        }
+        ns->priority = priority_vals[i];
+    }
+
+    bdb_nns++;
+    return 0;
+}
+
+struct bdb_ns *bdb_ns_find(const char *name, size_t nname){
+    int i;
+
+    for (i = 0; i < bdb_nns; i++){
+        if (strlen(bdb_ns[i].name) == nname && memcmp(bdb_ns[i].name, name, nname) == 0){
+            return &bdb_ns[i];
+        }
+    }
+    return NULL;
+}
+
 void start_chkpoint_thread(void){
-    if (bdb_settings.chkpoint_val > 0){
+    /* -K and -Q left out follow -C, so -C 0 alone still turns checkpoints off */
+    if (bdb_settings.chkpoint_kbyte < 0)
+        bdb_settings.chkpoint_kbyte = bdb_settings.chkpoint_val > 0 ? CHKPOINT_KBYTE_DEFAULT : 0;
+    if (bdb_settings.chkpoint_dirty_percent < 0)
+        bdb_settings.chkpoint_dirty_percent = bdb_settings.chkpoint_val > 0 ? CHKPOINT_DIRTY_DEFAULT : 0;
+
+    if (bdb_settings.chkpoint_val > 0 || bdb_settings.chkpoint_kbyte > 0 ||
+        bdb_settings.chkpoint_dirty_percent > 0){
         /* Start a checkpoint thread. */
         if ((errno = pthread_create(
             &chk_ptid, NULL, bdb_chkpoint_thread, (void *)env)) != 0) {
@@ -336,6 +619,7 @@ void start_chkpoint_thread(void){
                 strerror(errno));
             exit(EXIT_FAILURE);
         }
+        chk_started = true;
     }
 }
 
@@ -349,6 +633,7 @@ void start_memp_trickle_thread(void){
                 strerror(errno));
             exit(EXIT_FAILURE);
         }
+        mtri_started = true;
     }
 }
 
@@ -362,42 +647,260 @@ void start_dl_detect_thread(void){
                 strerror(errno));
             exit(EXIT_FAILURE);
         }
+        dld_started = true;
+    }
+}
+
+/*
+ * Stops the checkpoint, memp_trickle and deadlock threads, and waits for
+ * them to be gone, a checkpoint going on included; before the env closes.
+ */
+void bdb_threads_close(void){
+    daemon_quit = 1;
+    if (chk_started){
+        pthread_join(chk_ptid, NULL);
+        chk_started = false;
+    }
+    if (mtri_started){
+        pthread_join(mtri_ptid, NULL);
+        mtri_started = false;
+    }
+    if (dld_started){
+        pthread_join(dld_ptid, NULL);
+        dld_started = false;
+    }
+}
+
+/*
+ * Percent of the cache that is dirty. The cache is counted by its size in
+ * pages of the default size: over the pages in use only, a cache still
+ * mostly empty would be mostly dirty after a few writes.
+ */
+static u_int32_t bdb_dirty_percent(const DB_MPOOL_STAT *msp)
+{
+    u_int64_t pages, used;
+
+    pages = ((u_int64_t)msp->st_gbytes * 1024 * 1024 * 1024 + msp->st_bytes) / bdb_settings.page_size;
+    used = (u_int64_t)msp->st_page_dirty + msp->st_page_clean;
+    if (pages < used)
+        pages = used;
+    return pages > 0 ? (u_int64_t)msp->st_page_dirty * 100 / pages : 0;
+}
+
+/*
+ * Writes the dirty pages out ahead of a checkpoint, a second's worth of
+ * chkpoint_rate at a time, so that the checkpoint itself finds little left
+ * to write. Returns the number of pages written.
+ */
+static u_int32_t bdb_chkpoint_write_ahead(DB_ENV *dbenv, u_int32_t dirty, u_int32_t pages)
+{
+    struct timeval t;
+    u_int64_t usecs;
+    u_int32_t step, written = 0;
+    int percent, step_percent, nwrote, ret;
+
+    step = (u_int64_t)bdb_settings.chkpoint_rate * 1024 / bdb_settings.page_size;
+    if (step == 0)
+        step = 1;
+    step_percent = (u_int64_t)step * 100 / pages;
+    if (step_percent == 0)
+        step_percent = 1;
+
+    percent = 100 - (u_int64_t)dirty * 100 / pages;
+    while (percent < 100 && !daemon_quit) {
+        percent += step_percent;
+        if (percent > 100)
+            percent = 100;
+        nwrote = 0;
+        if ((ret = dbenv->memp_trickle(dbenv, percent, &nwrote)) != 0) {
+            dbenv->err(dbenv, ret, "checkpoint thread: memp_trickle");
+            break;
+        }
+        if (nwrote <= 0)
+            continue;
+        written += nwrote;
+        usecs = (u_int64_t)nwrote * bdb_settings.page_size * 1000000 /
+                ((u_int64_t)bdb_settings.chkpoint_rate * 1024);
+        t.tv_sec = usecs / 1000000;
+        t.tv_usec = usecs % 1000000;
+        (void)select(0, NULL, NULL, NULL, &t);
     }
+    return written;
 }
 
+/*
+ * Checkpoints once enough log is written, once enough of the cache is
+ * dirty, or at the latest every chkpoint_val seconds, rather than on a fixed
+ * beat whatever the load.
+ */
 static void *bdb_chkpoint_thread(void *arg)
 {
     DB_ENV *dbenv;
+    DB_LOG_STAT *lsp;
+    DB_MPOOL_STAT *msp;
+    struct timeval start, end;
+    time_t last, now;
+    u_int32_t log_kbyte, dirty, pages, written;
+    const char *reason;
     int ret;
     dbenv = arg;
+    affinity_housekeeping();
     if (settings.verbose > 1) {
-        dbenv->errx(dbenv, "checkpoint thread created: %lu, every %d seconds", 
-                           (u_long)pthread_self(), bdb_settings.chkpoint_val);
+        dbenv->errx(dbenv, "checkpoint thread created: %lu, every %d seconds, %d kbytes of log or %d%% dirty pages",
+                           (u_long)pthread_self(), bdb_settings.chkpoint_val,
+                           bdb_settings.chkpoint_kbyte, bdb_settings.chkpoint_dirty_percent);
     }
-    for (;; sleep(bdb_settings.chkpoint_val)) {
+    last = time(NULL);
+    while (!daemon_quit) {
+        sleep(CHKPOINT_TICK);
+
+        log_kbyte = 0;
+        if ((ret = dbenv->log_stat(dbenv, &lsp, 0)) == 0) {
+            log_kbyte = lsp->st_wc_mbytes * 1024 + lsp->st_wc_bytes / 1024;
+            free(lsp);
+        }
+        dirty = pages = 0;
+        chkpoint_stats.dirty_percent = 0;
+        if ((ret = dbenv->memp_stat(dbenv, &msp, NULL, 0)) == 0) {
+            dirty = msp->st_page_dirty;
+            pages = msp->st_page_dirty + msp->st_page_clean;
+            chkpoint_stats.dirty_percent = bdb_dirty_percent(msp);
+            free(msp);
+        }
+        chkpoint_stats.log_kbyte = log_kbyte;
+
+        now = time(NULL);
+        if (bdb_settings.chkpoint_kbyte > 0 && log_kbyte >= bdb_settings.chkpoint_kbyte) {
+            reason = "log";
+        } else if (bdb_settings.chkpoint_dirty_percent > 0 &&
+                   chkpoint_stats.dirty_percent >= bdb_settings.chkpoint_dirty_percent) {
+            reason = "dirty";
+        } else if (bdb_settings.chkpoint_val > 0 && now - last >= bdb_settings.chkpoint_val) {
+            reason = "interval";
+        } else {
+            continue;
+        }
+
+        gettimeofday(&start, NULL);
+        written = 0;
+        if (bdb_settings.chkpoint_rate > 0 && dirty > 0)
+            written = bdb_chkpoint_write_ahead(dbenv, dirty, pages);
+        /* no log since the last one makes this a no-op */
         if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0)) != 0) {
             dbenv->err(dbenv, ret, "checkpoint thread");
         }
-        dbenv->errx(dbenv, "checkpoint thread: a txn_checkpoint is done");
+        gettimeofday(&end, NULL);
+        last = time(NULL);
+
+        chkpoint_stats.count++;
+        chkpoint_stats.last_reason = reason;
+        chkpoint_stats.last_time = last;
+        chkpoint_stats.last_msecs = (end.tv_sec - start.tv_sec) * 1000 +
+                                    (end.tv_usec - start.tv_usec) / 1000;
+        chkpoint_stats.last_log_kbyte = log_kbyte;
+        chkpoint_stats.last_dirty_percent = chkpoint_stats.dirty_percent;
+        chkpoint_stats.pages_written += written;
+        if (settings.verbose > 0) {
+            dbenv->errx(dbenv, "checkpoint thread: a txn_checkpoint is done, on %s, %u kbytes of log, %u%% dirty, %u pages written ahead, %u ms",
+                               reason, log_kbyte, chkpoint_stats.last_dirty_percent,
+                               written, chkpoint_stats.last_msecs);
+        }
     }
     return (NULL);
 }
 
+/*
+ * Keeps enough of the cache clean that readers don't have to write dirty
+ * pages out to make room. The clean percent aimed at starts at
+ * memp_trickle_percent and trickles are memp_trickle_val apart; each second
+ * that readers had to write dirty pages raises the aim and trickles at
+ * once, and each quiet memp_trickle_val eases both back.
+ */
 static void *bdb_memp_trickle_thread(void *arg)
 {
     DB_ENV *dbenv;
-    int ret, nwrotep;
+    DB_MPOOL_STAT *msp;
+    u_int32_t evict, hit, miss;
+    u_int32_t prev_evict = 0, prev_hit = 0, prev_miss = 0;
+    int ret, nwrotep, percent, max_percent, interval, since, quiet;
+    bool first = true;
     dbenv = arg;
+    affinity_housekeeping();
     if (settings.verbose > 1) {
         dbenv->errx(dbenv, "memp_trickle thread created: %lu, every %d seconds, %d%% pages should be clean.", 
                            (u_long)pthread_self(), bdb_settings.memp_trickle_val,
                            bdb_settings.memp_trickle_percent);
     }
-    for (;; sleep(bdb_settings.memp_trickle_val)) {
-        if ((ret = dbenv->memp_trickle(dbenv, bdb_settings.memp_trickle_percent, &nwrotep)) != 0) {
+    percent = bdb_settings.memp_trickle_percent;
+    max_percent = percent > TRICKLE_MAX_PERCENT ? percent : TRICKLE_MAX_PERCENT;
+    interval = bdb_settings.memp_trickle_val;
+    since = quiet = 0;
+    trickle_stats.percent = percent;
+    trickle_stats.interval = interval;
+
+    while (!daemon_quit) {
+        sleep(TRICKLE_TICK);
+        since += TRICKLE_TICK;
+
+        if ((ret = dbenv->memp_stat(dbenv, &msp, NULL, 0)) != 0) {
+            dbenv->err(dbenv, ret, "memp_trickle thread: memp_stat");
+            continue;
+        }
+        evict = msp->st_rw_evict;
+        hit = msp->st_cache_hit;
+        miss = msp->st_cache_miss;
+        trickle_stats.dirty_percent = bdb_dirty_percent(msp);
+        free(msp);
+        if (first) {
+            prev_evict = evict;
+            prev_hit = hit;
+            prev_miss = miss;
+            first = false;
+        }
+
+        /* the counters are 32 bits and may wrap, unsigned differences still hold */
+        trickle_stats.last_dirty_evictions = evict - prev_evict;
+        trickle_stats.dirty_evictions += evict - prev_evict;
+        trickle_stats.hit_percent = hit - prev_hit + miss - prev_miss > 0 ?
+            (u_int64_t)(hit - prev_hit) * 100 / (hit - prev_hit + miss - prev_miss) : 100;
+        prev_evict = evict;
+        prev_hit = hit;
+        prev_miss = miss;
+
+        if (trickle_stats.last_dirty_evictions > 0) {
+            /* readers are writing, clean more and sooner */
+            percent += TRICKLE_STEP_UP;
+            if (percent > max_percent)
+                percent = max_percent;
+            interval = interval / 2 > TRICKLE_TICK ? interval / 2 : TRICKLE_TICK;
+            since = interval;
+            quiet = 0;
+        } else if ((quiet += TRICKLE_TICK) >= bdb_settings.memp_trickle_val) {
+            /* quiet for a while, back off */
+            percent -= TRICKLE_STEP_DOWN;
+            if (percent < bdb_settings.memp_trickle_percent)
+                percent = bdb_settings.memp_trickle_percent;
+            interval *= 2;
+            if (interval > bdb_settings.memp_trickle_val)
+                interval = bdb_settings.memp_trickle_val;
+            quiet = 0;
+        }
+        trickle_stats.percent = percent;
+        trickle_stats.interval = interval;
+
+        if (since < interval && 100 - (int)trickle_stats.dirty_percent >= percent)
+            continue;
+        since = 0;
+        nwrotep = 0;
+        if ((ret = dbenv->memp_trickle(dbenv, percent, &nwrotep)) != 0) {
             dbenv->err(dbenv, ret, "memp_trickle thread");
+            continue;
+        }
+        trickle_stats.runs++;
+        trickle_stats.pages_written += nwrotep;
+        if (settings.verbose > 1) {
+            dbenv->errx(dbenv, "memp_trickle thread: writing %d dirty pages, %d%% should be clean", nwrotep, percent);
         }
-        dbenv->errx(dbenv, "memp_trickle thread: writing %d dirty pages", nwrotep);
     }
     return (NULL);
 }
@@ -407,6 +910,7 @@ static void *bdb_dl_detect_thread(void *arg)
     DB_ENV *dbenv;
     struct timeval t;
     dbenv = arg;
+    affinity_housekeeping();
     if (settings.verbose > 1) {
         dbenv->errx(dbenv, "deadlock detecting thread created: %lu, every %d millisecond",
                            (u_long)pthread_self(), bdb_settings.dldetect_val);
@@ -464,6 +968,8 @@ static void bdb_event_callback(DB_ENV *env, u_int32_t which, void *info)
     default:
         env->errx(env, "ignoring event %d", which);
     }
+    /* wakes up the startup waiting on it */
+    startup_rep_event(which);
 }
 
 static void bdb_err_callback(const DB_ENV *dbenv, const char *errpfx, const char *msg){
@@ -483,14 +989,20 @@ static void bdb_msg_callback(const DB_ENV *dbenv, const char *msg){
 /* for atexit cleanup */
 void bdb_db_close(void){
     int ret = 0;
+    int i, n;
 
-    if (dbp != NULL) {
-        ret = dbp->close(dbp, 0);
-        if (0 != ret){
-            fprintf(stderr, "dbp->close: %s\n", db_strerror(ret));
-        }else{
-            dbp = NULL;
-            fprintf(stderr, "dbp->close: OK\n");
+    for (n = 0; n < bdb_nns; n++) {
+        for (i = MAX_DB_SHARDS - 1; i >= 0; i--) {
+            if (bdb_ns[n].dbps[i] == NULL) {
+                continue;
+            }
+            ret = bdb_ns[n].dbps[i]->close(bdb_ns[n].dbps[i], 0);
+            if (0 != ret){
+                fprintf(stderr, "dbp->close: %s\n", db_strerror(ret));
+            }else{
+                bdb_ns[n].dbps[i] = NULL;
+                fprintf(stderr, "dbp->close: OK\n");
+            }
         }
     }
 }
@@ -523,6 +1035,105 @@ void bdb_chkpoint(void)
     }
 }
 
+/* whether the resolved *path* is *dir* or under it */
+static bool bdb_path_inside(const char *path, const char *dir) {
+    char rdir[PATH_MAX];
+    size_t n;
+
+    if (dir == NULL || realpath(dir, rdir) == NULL)
+        return false;
+    n = strlen(rdir);
+    return strncmp(path, rdir, n) == 0 && (path[n] == '\0' || path[n] == '/' || n == 1);
+}
+
+/*
+ * Resolves the directory *dir* into *path*, PATH_MAX long, for the files a
+ * client has the server write. Returns -1 with errno set if it can't be
+ * resolved, or EACCES if it is in the env or log home.
+ */
+int bdb_export_dir(const char *dir, char *path) {
+    if (dir == NULL) {
+        errno = EACCES;
+        return -1;
+    }
+    if (realpath(dir, path) == NULL)
+        return -1;
+    if (bdb_path_inside(path, bdb_settings.env_home) || bdb_path_inside(path, bdb_settings.log_home)) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+static pthread_key_t bdb_defer_key;
+static pthread_once_t bdb_defer_once = PTHREAD_ONCE_INIT;
+
+static void bdb_defer_key_create(void) {
+    pthread_key_create(&bdb_defer_key, NULL);
+}
+
+/*
+ * Makes deadlock victims on this thread not be retried in place, but
+ * flagged in *deadlocked* instead, until called again with NULL. For a
+ * caller holding a lock around a whole operation: it unlocks, backs off
+ * with bdb_backoff() and runs the operation again from the start.
+ */
+void bdb_retry_defer(bool *deadlocked)
+{
+    pthread_once(&bdb_defer_once, bdb_defer_key_create);
+    pthread_setspecific(bdb_defer_key, deadlocked);
+}
+
+/*
+ * Whether a deadlock victim should be run again, having been so fewer
+ * than DEADLOCK_RETRIES times, counted in *attempt*. Backs off, with some
+ * jitter, before saying so.
+ */
+bool bdb_backoff(int *attempt)
+{
+    struct timeval t;
+    long usecs;
+
+    STATS_LOCK();
+    if (*attempt == 0)
+        stats.deadlocks++;
+    if (*attempt >= DEADLOCK_RETRIES) {
+        stats.deadlock_failures++;
+        STATS_UNLOCK();
+        return false;
+    }
+    stats.deadlock_retries++;
+    STATS_UNLOCK();
+
+    usecs = (long)DEADLOCK_BACKOFF << *attempt;
+    usecs += random() % usecs;
+    (*attempt)++;
+    t.tv_sec = 0;
+    t.tv_usec = usecs;
+    (void)select(0, NULL, NULL, NULL, &t);
+    return true;
+}
+
+/*
+ * Whether a db call that failed with *ret* should be run again: it was
+ * picked as a deadlock victim, see bdb_backoff(). Under bdb_retry_defer()
+ * it only flags that, and says no.
+ */
+bool bdb_retry(int ret, int *attempt)
+{
+    bool *deadlocked;
+
+    if (ret != DB_LOCK_DEADLOCK && ret != DB_LOCK_NOTGRANTED)
+        return false;
+
+    pthread_once(&bdb_defer_once, bdb_defer_key_create);
+    if ((deadlocked = pthread_getspecific(bdb_defer_key)) != NULL) {
+        *deadlocked = true;
+        return false;
+    }
+    return bdb_backoff(attempt);
+}
+
 /*
  *  BDB default comparison routine.
  */
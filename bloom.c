@@ -0,0 +1,580 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Bloom filter over the keys of every keyspace.
+ *
+ *  A get or add of a key that was never stored costs a full tree descent,
+ *  and a disk seek when the pages are cold. The filter answers "definitely
+ *  absent" for most of those without touching storage. Keys go in once
+ *  their put is in the db, before the put is answered; deletes don't take
+ *  them out, a rebuild does. A present key always passes.
+ *
+ *  Filters are built by a thread of their own, which scans the keyspace
+ *  and counts its keys as it goes; until a filter is built, every key may
+ *  be there, and the server doesn't wait for it. Once more keys went in
+ *  than a filter was sized for, it is built again for twice as many; the
+ *  old one answers meanwhile, and gets the new keys as well.
+ *
+ *  A clean shutdown saves the filters next to the databases
+ *  ("<db_file>.bloom") once they are closed, with the db file's identity
+ *  and times. The next start loads a filter only if the db file is still
+ *  the same, and removes the copy as soon as it is read; a start without
+ *  filters removes them too.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define BLOOM_MAGIC 0x424c4d32  /* "BLM2" */
+#define BLOOM_MIN_KEYS (1024 * 1024)  /* size for at least this many keys */
+#define BLOOM_MAX_HASHES 16
+#define BLOOM_KEY_BUF 1024
+#define BLOOM_BATCH 1024        /* keys hashed by the scan a write lock */
+
+/* one bit array and its sizing */
+struct bloom_bits {
+    uint64_t    nbits;
+    uint32_t    nhashes;
+    uint64_t    capacity;   /* keys it was sized for at the fp rate */
+    uint64_t    nkeys;      /* adds that set a bit, about the keys in it */
+    unsigned char *bits;    /* NULL if none */
+};
+
+struct bloom {
+    pthread_rwlock_t lock;  /* readers check, writers add and swap */
+    struct bloom_bits cur;  /* answers checks once built */
+    struct bloom_bits next; /* being built, gets adds too */
+    bool        ready;      /* cur is built */
+    bool        building;   /* a build is queued or going */
+    uint64_t    grow_at;    /* build again past this many keys */
+    bool        queued;     /* under bloom_build_lock */
+};
+
+/* the db file a filter was saved with, it is trusted only with the same */
+struct bloom_print {
+    uint64_t    dev;
+    uint64_t    ino;
+    uint64_t    size;
+    int64_t     mtime;
+    int64_t     ctime;
+};
+
+/* as saved on disk, followed by the bits */
+struct bloom_header {
+    uint32_t    magic;
+    uint32_t    nhashes;
+    uint64_t    nbits;
+    uint64_t    capacity;
+    uint64_t    nkeys;
+    struct bloom_print print;
+};
+
+/* bumped with atomic adds, the fast path takes no lock for them */
+struct bloom_stats {
+    uint64_t    checks;     /* lookups asked of a filter */
+    uint64_t    negatives;  /* lookups it answered without storage */
+    uint64_t    builds;     /* scans done, the first ones included */
+};
+
+static struct bloom_stats bloom_stats;
+
+static pthread_mutex_t bloom_build_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bloom_build_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t bloom_tid;
+static bool bloom_started = false;  /* bloom_tid is there to join */
+static bool bloom_quit = false;
+
+static void bloom_path(char *buf, size_t len, struct bdb_ns *ns) {
+    snprintf(buf, len, "%s/%s.bloom", bdb_settings.env_home, ns->db_file);
+}
+
+static int bloom_fingerprint(struct bdb_ns *ns, struct bloom_print *print) {
+    char path[1024];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, ns->db_file);
+    if (stat(path, &st) != 0)
+        return -1;
+    memset(print, 0, sizeof(*print));
+    print->dev = st.st_dev;
+    print->ino = st.st_ino;
+    print->size = st.st_size;
+    print->mtime = st.st_mtime;
+    print->ctime = st.st_ctime;
+    return 0;
+}
+
+/* FNV-1a, finished with a 64-bit mixer so short keys spread too */
+static void bloom_hash(const char *key, size_t nkey, uint64_t *h1, uint64_t *h2) {
+    uint64_t h = 14695981039346656037ULL;
+
+    while (nkey-- > 0) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    *h1 = h & 0xffffffffULL;
+    *h2 = (h >> 32) | 1;
+}
+
+/* sizes *bb* for *capacity* keys, without the bits */
+static void bloom_size(struct bloom_bits *bb, uint64_t capacity) {
+    double m;
+
+    if (capacity < BLOOM_MIN_KEYS)
+        capacity = BLOOM_MIN_KEYS;
+
+    /* the textbook optimum: m = -n ln p / (ln 2)^2, k = m / n ln 2 */
+    m = -(double)capacity * log(bdb_settings.bloom_fp_rate) / (M_LN2 * M_LN2);
+    memset(bb, 0, sizeof(*bb));
+    bb->nbits = ((uint64_t)m + 8) & ~7ULL;
+    bb->nhashes = (uint32_t)(m / capacity * M_LN2 + 0.5);
+    if (bb->nhashes < 1)
+        bb->nhashes = 1;
+    if (bb->nhashes > BLOOM_MAX_HASHES)
+        bb->nhashes = BLOOM_MAX_HASHES;
+    bb->capacity = capacity;
+}
+
+static void bloom_bits_add(struct bloom_bits *bb, uint64_t h1, uint64_t h2) {
+    uint64_t i;
+    uint32_t k;
+    bool set = false;
+
+    if (bb->bits == NULL)
+        return;
+    for (k = 0; k < bb->nhashes; k++) {
+        i = (h1 + k * h2) % bb->nbits;
+        if (!(bb->bits[i >> 3] & (1 << (i & 7)))) {
+            bb->bits[i >> 3] |= 1 << (i & 7);
+            set = true;
+        }
+    }
+    if (set)
+        bb->nkeys++;
+}
+
+static struct bloom *bloom_new(void) {
+    struct bloom *b;
+
+    if ((b = calloc(1, sizeof(struct bloom))) == NULL)
+        return NULL;
+    pthread_rwlock_init(&b->lock, NULL);
+    return b;
+}
+
+static struct bloom *bloom_load(struct bdb_ns *ns) {
+    char path[1024];
+    struct bloom_header hdr;
+    struct bloom_bits bb;
+    struct bloom_print print;
+    struct bloom *b = NULL;
+    FILE *fp;
+    int fd;
+
+    bloom_path(path, sizeof(path), ns);
+    if ((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+    /* whatever happens next, the copy must not outlive this start */
+    if (unlink(path) != 0 || (fd = open(bdb_settings.env_home, O_RDONLY)) == -1) {
+        fprintf(stderr, "failed to remove %s: %s\n", path, strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+    fsync(fd);
+    close(fd);
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != BLOOM_MAGIC) {
+        fprintf(stderr, "ignoring bloom filter %s: bad header\n", path);
+        goto out;
+    }
+    /* written to since, or other files restored under the env home? */
+    if (bloom_fingerprint(ns, &print) != 0 || memcmp(&print, &hdr.print, sizeof(print)) != 0) {
+        fprintf(stderr, "ignoring bloom filter %s: %s changed since it was saved\n",
+                path, ns->db_file);
+        goto out;
+    }
+    /* sized for another fp rate? then build a new one */
+    bloom_size(&bb, hdr.capacity);
+    if (bb.nbits != hdr.nbits || bb.nhashes != hdr.nhashes)
+        goto out;
+    if ((bb.bits = malloc(bb.nbits / 8)) == NULL)
+        goto out;
+    if (fread(bb.bits, bb.nbits / 8, 1, fp) != 1) {
+        fprintf(stderr, "ignoring bloom filter %s: short read\n", path);
+        free(bb.bits);
+        goto out;
+    }
+    bb.nkeys = hdr.nkeys;
+    if ((b = bloom_new()) == NULL) {
+        free(bb.bits);
+        goto out;
+    }
+    b->cur = bb;
+    b->ready = true;
+    b->grow_at = bb.capacity;
+out:
+    fclose(fp);
+    return b;
+}
+
+static int bloom_write(struct bdb_ns *ns, struct bloom *b) {
+    char path[1024], tmp[1024 + 8];
+    struct bloom_header hdr;
+    FILE *fp;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (bloom_fingerprint(ns, &hdr.print) != 0) {
+        fprintf(stderr, "failed to stat %s: %s\n", ns->db_file, strerror(errno));
+        return -1;
+    }
+    bloom_path(path, sizeof(path), ns);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "wb")) == NULL) {
+        fprintf(stderr, "failed to create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    hdr.magic = BLOOM_MAGIC;
+    hdr.nhashes = b->cur.nhashes;
+    hdr.nbits = b->cur.nbits;
+    hdr.capacity = b->cur.capacity;
+    hdr.nkeys = b->cur.nkeys;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(b->cur.bits, b->cur.nbits / 8, 1, fp) != 1 ||
+        fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* hands *b* to the build thread */
+static void bloom_queue(struct bloom *b) {
+    pthread_mutex_lock(&bloom_build_lock);
+    b->queued = true;
+    pthread_cond_signal(&bloom_build_cond);
+    pthread_mutex_unlock(&bloom_build_lock);
+}
+
+/* adds the *n* hashed keys at *h* to the filter being built */
+static void bloom_scan_flush(struct bloom *b, uint64_t (*h)[2], int n) {
+    int i;
+
+    pthread_rwlock_wrlock(&b->lock);
+    for (i = 0; i < n; i++)
+        bloom_bits_add(&b->next, h[i][0], h[i][1]);
+    pthread_rwlock_unlock(&b->lock);
+}
+
+/*
+ * Adds the keys of every shard of *ns* to its filter being built. After a
+ * deadlock a btree shard goes on from the last key read, a hash one from
+ * its start again; adding a key twice changes nothing. Returns 0, -1 if
+ * a shard could not be read through, or 1 if asked to quit.
+ */
+static int bloom_scan(struct bdb_ns *ns) {
+    struct bloom *b = ns->bloom;
+    uint64_t h[BLOOM_BATCH][2];
+    char buf[BLOOM_KEY_BUF];
+    DBC *cursorp;
+    DBT dbkey, dbdata;
+    u_int32_t flags, nlast;
+    int i, n, ret, attempt;
+
+    for (i = 0; i < ns->nshards; i++) {
+        attempt = 0;
+        nlast = 0;
+        do {
+            if ((ret = ns->dbps[i]->cursor(ns->dbps[i], NULL, &cursorp, 0)) != 0)
+                continue;
+            BDB_CLEANUP_DBT();
+            dbkey.data = buf;
+            dbkey.ulen = sizeof(buf);
+            dbkey.flags = DB_DBT_USERMEM;
+            /* keys only */
+            dbdata.flags = DB_DBT_PARTIAL;
+            /* buf still holds the last key read */
+            dbkey.size = nlast;
+            flags = nlast > 0 && ns->db_type == DB_BTREE ? DB_SET_RANGE : DB_FIRST;
+            n = 0;
+            while ((ret = cursorp->get(cursorp, &dbkey, &dbdata, flags)) == 0) {
+                flags = DB_NEXT;
+                nlast = dbkey.size;
+                bloom_hash(dbkey.data, dbkey.size, &h[n][0], &h[n][1]);
+                if (++n < BLOOM_BATCH)
+                    continue;
+                bloom_scan_flush(b, h, n);
+                n = 0;
+                if (__atomic_load_n(&bloom_quit, __ATOMIC_RELAXED)) {
+                    cursorp->close(cursorp);
+                    return 1;
+                }
+            }
+            bloom_scan_flush(b, h, n);
+            cursorp->close(cursorp);
+        } while (bdb_retry(ret, &attempt));
+        if (ret != DB_NOTFOUND) {
+            fprintf(stderr, "bloom filter of %s: cursorp->get: %s\n", ns->name, db_strerror(ret));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builds the filter of *ns* anew: for twice the keys it has, which the
+ * scan counts. The old one, if any, answers until the new one is done.
+ */
+static void bloom_build(struct bdb_ns *ns) {
+    struct bloom *b = ns->bloom;
+    struct bloom_bits bb;
+    uint64_t nkeys;
+    bool again;
+    int ret;
+
+    pthread_rwlock_rdlock(&b->lock);
+    nkeys = b->cur.nkeys;
+    pthread_rwlock_unlock(&b->lock);
+
+    bloom_size(&bb, nkeys * 2);
+    if ((bb.bits = calloc(bb.nbits / 8, 1)) == NULL) {
+        fprintf(stderr, "bloom filter of %s: no memory for %"PRIu64" keys\n", ns->name, bb.capacity);
+        pthread_rwlock_wrlock(&b->lock);
+        b->grow_at = nkeys * 2;
+        b->building = false;
+        pthread_rwlock_unlock(&b->lock);
+        return;
+    }
+    /* puts add once they are in the db, so from here on none is missed */
+    pthread_rwlock_wrlock(&b->lock);
+    b->next = bb;
+    pthread_rwlock_unlock(&b->lock);
+
+    ret = bloom_scan(ns);
+    __atomic_fetch_add(&bloom_stats.builds, 1, __ATOMIC_RELAXED);
+
+    pthread_rwlock_wrlock(&b->lock);
+    if (ret == 0) {
+        free(b->cur.bits);
+        b->cur = b->next;
+        b->ready = true;
+        b->grow_at = b->cur.capacity;
+    } else {
+        free(b->next.bits);
+    }
+    memset(&b->next, 0, sizeof(b->next));
+    nkeys = b->cur.nkeys;
+    /* more keys than it was sized for, build it again for them */
+    again = b->building = ret == 0 && nkeys > b->grow_at;
+    pthread_rwlock_unlock(&b->lock);
+
+    if (ret == 0 && (settings.verbose > 0 || again))
+        fprintf(stderr, "bloom filter of %s: built, %"PRIu64" keys for a capacity of %"PRIu64"\n",
+                ns->name, nkeys, bb.capacity);
+    else if (ret < 0)
+        fprintf(stderr, "bloom filter of %s: not built, every key may be there\n", ns->name);
+    if (again)
+        bloom_queue(b);
+}
+
+static void *bloom_thread(void *arg) {
+    struct bloom *b;
+    int i;
+
+    affinity_housekeeping();
+    pthread_mutex_lock(&bloom_build_lock);
+    while (!bloom_quit) {
+        for (i = 0; i < bdb_nns; i++) {
+            if ((b = bdb_ns[i].bloom) != NULL && b->queued)
+                break;
+        }
+        if (i == bdb_nns) {
+            pthread_cond_wait(&bloom_build_cond, &bloom_build_lock);
+            continue;
+        }
+        b->queued = false;
+        pthread_mutex_unlock(&bloom_build_lock);
+        bloom_build(&bdb_ns[i]);
+        pthread_mutex_lock(&bloom_build_lock);
+    }
+    pthread_mutex_unlock(&bloom_build_lock);
+    return NULL;
+}
+
+/*
+ * Loads the filter of every keyspace, or queues it to be built, and
+ * starts the build thread. Replicas don't get one: replicated writes
+ * bypass item_put(), so their filter would go stale. Without filters, the
+ * saved ones are removed, as the writes of this run won't be in them.
+ */
+void bloom_init(void) {
+    struct bdb_ns *ns;
+    char path[1024];
+    bool build = false;
+    int i;
+
+    if (bdb_settings.bloom_fp_rate <= 0 || bdb_settings.is_replicated) {
+        for (i = 0; i < bdb_nns; i++) {
+            bloom_path(path, sizeof(path), &bdb_ns[i]);
+            if (unlink(path) != 0 && errno != ENOENT)
+                fprintf(stderr, "failed to remove %s: %s\n", path, strerror(errno));
+        }
+        return;
+    }
+
+    for (i = 0; i < bdb_nns; i++) {
+        ns = &bdb_ns[i];
+        if ((ns->bloom = bloom_load(ns)) != NULL) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "bloom filter of %s: loaded, %"PRIu64" keys\n",
+                        ns->name, ns->bloom->cur.nkeys);
+            continue;
+        }
+        if ((ns->bloom = bloom_new()) == NULL) {
+            fprintf(stderr, "bloom filter of %s: disabled\n", ns->name);
+            continue;
+        }
+        ns->bloom->building = ns->bloom->queued = true;
+        build = true;
+    }
+
+    if ((errno = pthread_create(&bloom_tid, NULL, bloom_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning bloom filter thread: %s\n", strerror(errno));
+        if (build)
+            fprintf(stderr, "bloom filters not loaded are disabled\n");
+        return;
+    }
+    bloom_started = true;
+}
+
+/* Stops the build thread; before the db closes. */
+void bloom_close(void) {
+    pthread_mutex_lock(&bloom_build_lock);
+    __atomic_store_n(&bloom_quit, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&bloom_build_cond);
+    pthread_mutex_unlock(&bloom_build_lock);
+    if (bloom_started) {
+        pthread_join(bloom_tid, NULL);
+        bloom_started = false;
+    }
+}
+
+/*
+ * Saves every built filter, after the db is closed for a clean shutdown,
+ * so the db file it is saved with is the one the next start opens.
+ */
+void bloom_save(void) {
+    struct bloom *b;
+    int i;
+
+    for (i = 0; i < bdb_nns; i++) {
+        if ((b = bdb_ns[i].bloom) == NULL || !b->ready)
+            continue;
+        if (bloom_write(&bdb_ns[i], b) == 0)
+            fprintf(stderr, "bloom filter of %s: saved\n", bdb_ns[i].name);
+    }
+}
+
+/*
+ * Returns false if *key* is surely not in *ns*, true if it may be, or if
+ * the keyspace has no filter built.
+ */
+bool bloom_check(struct bdb_ns *ns, const char *key, size_t nkey) {
+    struct bloom *b = ns->bloom;
+    uint64_t h1, h2, i;
+    uint32_t k;
+    bool found = true;
+
+    if (b == NULL)
+        return true;
+
+    bloom_hash(key, nkey, &h1, &h2);
+    pthread_rwlock_rdlock(&b->lock);
+    if (!b->ready) {
+        pthread_rwlock_unlock(&b->lock);
+        return true;
+    }
+    for (k = 0; k < b->cur.nhashes; k++) {
+        i = (h1 + k * h2) % b->cur.nbits;
+        if (!(b->cur.bits[i >> 3] & (1 << (i & 7)))) {
+            found = false;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&b->lock);
+
+    __atomic_fetch_add(&bloom_stats.checks, 1, __ATOMIC_RELAXED);
+    if (!found)
+        __atomic_fetch_add(&bloom_stats.negatives, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+/* call once the key is written, before the write is answered */
+void bloom_add(struct bdb_ns *ns, const char *key, size_t nkey) {
+    struct bloom *b = ns->bloom;
+    uint64_t h1, h2;
+    bool grow = false;
+
+    if (b == NULL)
+        return;
+    bloom_hash(key, nkey, &h1, &h2);
+    pthread_rwlock_wrlock(&b->lock);
+    bloom_bits_add(&b->cur, h1, h2);
+    bloom_bits_add(&b->next, h1, h2);
+    if (b->ready && !b->building && b->cur.nkeys > b->grow_at)
+        grow = b->building = true;
+    pthread_rwlock_unlock(&b->lock);
+    if (grow)
+        bloom_queue(b);
+}
+
+void stats_bloom(char *temp) {
+    char *pos = temp;
+    struct bloom *b;
+    int i;
+
+    pos += sprintf(pos, "STAT bloom_fp_rate %g\r\n", bdb_settings.bloom_fp_rate);
+    pos += sprintf(pos, "STAT bloom_checks %"PRIu64"\r\n",
+                   __atomic_load_n(&bloom_stats.checks, __ATOMIC_RELAXED));
+    pos += sprintf(pos, "STAT bloom_negatives %"PRIu64"\r\n",
+                   __atomic_load_n(&bloom_stats.negatives, __ATOMIC_RELAXED));
+    pos += sprintf(pos, "STAT bloom_builds %"PRIu64"\r\n",
+                   __atomic_load_n(&bloom_stats.builds, __ATOMIC_RELAXED));
+
+    /* keys/capacity/bits/hashes of every filter, "building" until it answers */
+    for (i = 0; i < bdb_nns; i++) {
+        if ((b = bdb_ns[i].bloom) == NULL)
+            continue;
+        pthread_rwlock_rdlock(&b->lock);
+        if (b->ready)
+            pos += sprintf(pos, "STAT bloom-%s %"PRIu64"/%"PRIu64"/%"PRIu64"/%u\r\n", bdb_ns[i].name,
+                           b->cur.nkeys, b->cur.capacity, b->cur.nbits, b->cur.nhashes);
+        else
+            pos += sprintf(pos, "STAT bloom-%s building\r\n", bdb_ns[i].name);
+        pthread_rwlock_unlock(&b->lock);
+    }
+    pos += sprintf(pos, "END");
+}
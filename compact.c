@@ -0,0 +1,388 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Online compaction, in the background.
+ *
+ *  A run goes through every shard of every keyspace. Each step compacts
+ *  chunks of COMPACT_KEYS keys, one DB->compact() call each, up to a
+ *  budget of pages freed or COMPACT_STEP_MSECS of time, and keeps the key
+ *  it stopped at; the next step starts from there. Between steps the
+ *  thread sleeps, so the foreground keeps the locks and the disk most of
+ *  the time. A run can be paused, resumed and cancelled between steps.
+ *  Only btrees compact: the shards of hash keyspaces are skipped, and
+ *  reported in the stats.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <db.h>
+
+#define COMPACT_PAGES 64    /* default pages to free a step */
+#define COMPACT_MSECS 100   /* default pause between steps */
+#define COMPACT_KEYS 1000   /* keys in a chunk */
+#define COMPACT_STEP_MSECS 50 /* time a step may take, checked between chunks */
+
+enum compact_state { COMPACT_IDLE, COMPACT_RUNNING, COMPACT_PAUSED,
+                     COMPACT_CANCELLING, COMPACT_CANCELLED, COMPACT_DONE,
+                     COMPACT_FAILED };
+
+static const char *compact_state_names[] = {
+    "idle", "running", "paused", "cancelling", "cancelled", "done", "failed"
+};
+
+static struct {
+    enum compact_state state;
+    int pages;              /* budget of a step */
+    int msecs;              /* pause between steps */
+    int ns;                 /* where the run is */
+    int shard;
+    int shards_done;
+    int shards_total;
+    int shards_skipped;     /* of keyspaces that aren't btrees */
+    bool skipped[MAX_NAMESPACES];
+    time_t started;
+    time_t finished;
+    u_int64_t steps;
+    u_int64_t pages_examined;
+    u_int64_t pages_freed;
+    u_int64_t pages_truncated;
+    u_int64_t deadlocks;
+    int error;              /* of the step that failed the run */
+} compact;
+
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t compact_tid;
+static bool compact_started = false;    /* compact_tid is there to join */
+
+static void compact_deadlock(int ret) {
+    if (ret == DB_LOCK_DEADLOCK || ret == DB_LOCK_NOTGRANTED) {
+        pthread_mutex_lock(&compact_lock);
+        compact.deadlocks++;
+        pthread_mutex_unlock(&compact_lock);
+    }
+}
+
+/*
+ * Sets *stop* to a malloc'd copy of the key COMPACT_KEYS past *start* in
+ * *db*. Returns DB_NOTFOUND, with *stop* empty, if the shard ends before.
+ */
+static int compact_chunk_end(DB *db, DBT *start, DBT *stop) {
+    DBC *cursorp;
+    DBT key, data;
+    int ret, n;
+
+    memset(stop, 0, sizeof(*stop));
+    if ((ret = db->cursor(db, NULL, &cursorp, 0)) != 0)
+        return ret;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    data.flags = DB_DBT_PARTIAL;    /* only the keys are wanted */
+    if (start->size > 0) {
+        key.data = start->data;
+        key.size = start->size;
+        ret = cursorp->get(cursorp, &key, &data, DB_SET_RANGE);
+    } else {
+        ret = cursorp->get(cursorp, &key, &data, DB_FIRST);
+    }
+    for (n = 0; ret == 0 && n < COMPACT_KEYS; n++)
+        ret = cursorp->get(cursorp, &key, &data, DB_NEXT);
+    if (ret == 0) {
+        if ((stop->data = malloc(key.size)) == NULL) {
+            ret = ENOMEM;
+        } else {
+            memcpy(stop->data, key.data, key.size);
+            stop->size = key.size;
+        }
+    }
+    cursorp->close(cursorp);
+    return ret;
+}
+
+/*
+ * One step on *db* from *start*, which is replaced by where it stopped.
+ * Returns 1 once the shard is done, 0 if there is more, or a db error.
+ */
+static int compact_step(DB *db, DBT *start, int pages) {
+    DB_COMPACT c_data;
+    DBT stop, end;
+    struct timeval began, now;
+    int ret, attempt, freed = 0;
+    bool last;
+
+    gettimeofday(&began, NULL);
+    for (;;) {
+        attempt = 0;
+        do {
+            ret = compact_chunk_end(db, start, &stop);
+            compact_deadlock(ret);
+        } while (bdb_retry(ret, &attempt));
+        if (ret != 0 && ret != DB_NOTFOUND)
+            return ret;
+        last = ret == DB_NOTFOUND;
+
+        attempt = 0;
+        do {
+            memset(&c_data, 0, sizeof(c_data));
+            memset(&end, 0, sizeof(end));
+            end.flags = DB_DBT_MALLOC;
+            c_data.compact_pages = pages - freed;
+            ret = db->compact(db, NULL, start->size > 0 ? start : NULL,
+                              last ? NULL : &stop, &c_data, DB_FREE_SPACE, &end);
+            compact_deadlock(ret);
+        } while (bdb_retry(ret, &attempt));
+        if (ret != 0) {
+            if (end.data != NULL)
+                free(end.data);
+            if (stop.data != NULL)
+                free(stop.data);
+            return ret;
+        }
+
+        pthread_mutex_lock(&compact_lock);
+        compact.steps++;
+        compact.pages_examined += c_data.compact_pages_examine;
+        compact.pages_freed += c_data.compact_pages_free;
+        compact.pages_truncated += c_data.compact_pages_truncated;
+        pthread_mutex_unlock(&compact_lock);
+        freed += c_data.compact_pages_free;
+
+        /* go on from where the call stopped, or else past the chunk */
+        if (start->data != NULL)
+            free(start->data);
+        if (end.size > 0) {
+            *start = end;
+            if (stop.data != NULL)
+                free(stop.data);
+        } else {
+            if (end.data != NULL)
+                free(end.data);
+            *start = stop;
+            if (last)
+                return 1;
+        }
+        start->flags = 0;
+
+        if (freed >= pages)
+            return 0;
+        gettimeofday(&now, NULL);
+        if ((now.tv_sec - began.tv_sec) * 1000 + (now.tv_usec - began.tv_usec) / 1000 >= COMPACT_STEP_MSECS)
+            return 0;
+    }
+}
+
+/*
+ * Waits out the pause between steps, and any pause asked for. Returns
+ * false if the run is cancelled.
+ */
+static bool compact_wait(void) {
+    struct timeval now;
+    struct timespec until;
+    bool go;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + compact.msecs / 1000;
+    until.tv_nsec = now.tv_usec * 1000 + (compact.msecs % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&compact_lock);
+    while (compact.state == COMPACT_RUNNING && !daemon_quit &&
+           pthread_cond_timedwait(&compact_cond, &compact_lock, &until) != ETIMEDOUT)
+        ;
+    while (compact.state == COMPACT_PAUSED && !daemon_quit)
+        pthread_cond_wait(&compact_cond, &compact_lock);
+    go = compact.state == COMPACT_RUNNING && !daemon_quit;
+    pthread_mutex_unlock(&compact_lock);
+    return go;
+}
+
+static void *compact_thread(void *arg) {
+    DBT start;
+    DBTYPE type;
+    int n, s, ret = 0;
+    enum compact_state last;
+
+    affinity_housekeeping();
+    memset(&start, 0, sizeof(start));
+
+    for (n = 0; n < bdb_nns && ret == 0; n++) {
+        for (s = 0; s < bdb_ns[n].nshards && ret == 0; s++) {
+            pthread_mutex_lock(&compact_lock);
+            compact.ns = n;
+            compact.shard = s;
+            pthread_mutex_unlock(&compact_lock);
+
+            /* DB->compact and DB_SET_RANGE are for btrees only */
+            if ((ret = bdb_ns[n].dbps[s]->get_type(bdb_ns[n].dbps[s], &type)) != 0)
+                break;
+            if (type != DB_BTREE) {
+                pthread_mutex_lock(&compact_lock);
+                compact.skipped[n] = true;
+                compact.shards_skipped++;
+                pthread_mutex_unlock(&compact_lock);
+                continue;
+            }
+
+            do {
+                if (!compact_wait()) {
+                    ret = -1;
+                    break;
+                }
+                ret = compact_step(bdb_ns[n].dbps[s], &start, compact.pages);
+            } while (ret == 0);
+
+            if (start.data != NULL)
+                free(start.data);
+            memset(&start, 0, sizeof(start));
+            if (ret != 1)
+                break;
+            ret = 0;
+            pthread_mutex_lock(&compact_lock);
+            compact.shards_done++;
+            pthread_mutex_unlock(&compact_lock);
+        }
+    }
+
+    pthread_mutex_lock(&compact_lock);
+    if (ret == 0) {
+        last = COMPACT_DONE;
+    } else if (ret == -1) {
+        last = COMPACT_CANCELLED;
+    } else {
+        last = COMPACT_FAILED;
+        compact.error = ret;
+    }
+    compact.state = last;
+    compact.finished = time(NULL);
+    pthread_mutex_unlock(&compact_lock);
+
+    if (last == COMPACT_FAILED) {
+        fprintf(stderr, "dbp->compact: %s\n", db_strerror(ret));
+    } else if (settings.verbose > 0) {
+        fprintf(stderr, "compaction %s, %llu pages freed\n", compact_state_names[last],
+                (unsigned long long)compact.pages_freed);
+    }
+    return NULL;
+}
+
+/*
+ * Starts a background run, freeing at most *pages* a step, *msecs* apart;
+ * 0 for the defaults. Returns -1 if one is already going.
+ */
+int compact_start(int pages, int msecs) {
+    int n;
+
+    pthread_mutex_lock(&compact_lock);
+    if (compact.state == COMPACT_RUNNING || compact.state == COMPACT_PAUSED ||
+        compact.state == COMPACT_CANCELLING) {
+        pthread_mutex_unlock(&compact_lock);
+        return -1;
+    }
+    /* the last run is over, its thread only has a message left to log */
+    if (compact_started) {
+        pthread_join(compact_tid, NULL);
+        compact_started = false;
+    }
+    memset(&compact, 0, sizeof(compact));
+    compact.state = COMPACT_RUNNING;
+    compact.pages = pages > 0 ? pages : COMPACT_PAGES;
+    compact.msecs = msecs > 0 ? msecs : COMPACT_MSECS;
+    for (n = 0; n < bdb_nns; n++)
+        compact.shards_total += bdb_ns[n].nshards;
+    compact.started = time(NULL);
+    if ((errno = pthread_create(&compact_tid, NULL, compact_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning compaction thread: %s\n", strerror(errno));
+        compact.state = COMPACT_FAILED;
+        compact.error = errno;
+        pthread_mutex_unlock(&compact_lock);
+        return -1;
+    }
+    compact_started = true;
+    pthread_mutex_unlock(&compact_lock);
+    return 0;
+}
+
+/* moves a run from *from* to *to*, returns -1 if it isn't in *from* */
+static int compact_move(enum compact_state from, enum compact_state to) {
+    int ret = -1;
+
+    pthread_mutex_lock(&compact_lock);
+    if (compact.state == from) {
+        compact.state = to;
+        pthread_cond_signal(&compact_cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return ret;
+}
+
+int compact_pause(void) {
+    return compact_move(COMPACT_RUNNING, COMPACT_PAUSED);
+}
+
+int compact_resume(void) {
+    return compact_move(COMPACT_PAUSED, COMPACT_RUNNING);
+}
+
+int compact_cancel(void) {
+    if (compact_move(COMPACT_RUNNING, COMPACT_CANCELLING) == 0)
+        return 0;
+    return compact_move(COMPACT_PAUSED, COMPACT_CANCELLING);
+}
+
+/* Cancels a run, and waits for its thread to be gone; before the db closes. */
+void compact_close(void) {
+    bool started;
+
+    compact_cancel();
+    pthread_mutex_lock(&compact_lock);
+    started = compact_started;
+    compact_started = false;
+    pthread_mutex_unlock(&compact_lock);
+    if (started)
+        pthread_join(compact_tid, NULL);
+}
+
+void stats_compact(char *temp) {
+    char *pos = temp;
+    time_t until;
+    int i;
+
+    pthread_mutex_lock(&compact_lock);
+    until = compact.finished != 0 ? compact.finished : time(NULL);
+    pos += sprintf(pos, "STAT compact_state %s\r\n", compact_state_names[compact.state]);
+    pos += sprintf(pos, "STAT compact_step_pages %d\r\n", compact.pages);
+    pos += sprintf(pos, "STAT compact_step_msecs %d\r\n", compact.msecs);
+    if (compact.state != COMPACT_IDLE) {
+        pos += sprintf(pos, "STAT compact_ns %s\r\n", bdb_ns[compact.ns].name);
+        pos += sprintf(pos, "STAT compact_shard %d\r\n", compact.shard);
+        pos += sprintf(pos, "STAT compact_elapsed %ld\r\n", (long)(until - compact.started));
+    }
+    pos += sprintf(pos, "STAT compact_shards_done %d/%d\r\n", compact.shards_done, compact.shards_total);
+    pos += sprintf(pos, "STAT compact_shards_skipped %d\r\n", compact.shards_skipped);
+    for (i = 0; i < bdb_nns; i++) {
+        if (compact.skipped[i])
+            pos += sprintf(pos, "STAT compact_skipped %s\r\n", bdb_ns[i].name);
+    }
+    pos += sprintf(pos, "STAT compact_steps %llu\r\n", (unsigned long long)compact.steps);
+    pos += sprintf(pos, "STAT compact_pages_examined %llu\r\n", (unsigned long long)compact.pages_examined);
+    pos += sprintf(pos, "STAT compact_pages_freed %llu\r\n", (unsigned long long)compact.pages_freed);
+    pos += sprintf(pos, "STAT compact_pages_truncated %llu\r\n", (unsigned long long)compact.pages_truncated);
+    pos += sprintf(pos, "STAT compact_deadlocks %llu\r\n", (unsigned long long)compact.deadlocks);
+    if (compact.state == COMPACT_FAILED)
+        pos += sprintf(pos, "STAT compact_error %s\r\n", db_strerror(compact.error));
+    pos += sprintf(pos, "END");
+    pthread_mutex_unlock(&compact_lock);
+}
@@ -0,0 +1,686 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Dictionary compression of stored values, against a shared dictionary
+ *  trained from a sample of them.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+/* zlib never looks further back than its 32KB window */
+#define DICT_MAX_SIZE (32 * 1024)
+#define DICT_MAX_VERSIONS 255
+
+/* training parameters */
+#define DICT_SCAN_ITEMS 100000   /* records visited while sampling */
+#define DICT_SAMPLE_ITEMS 4096   /* records kept as the training sample */
+#define DICT_KMER 8              /* length of the substrings we count */
+#define DICT_SEGMENT 32          /* length of the pieces copied into a dictionary */
+#define DICT_HASH_BITS 20
+
+/*
+ * Header of a record deflated against a dictionary. The magic sits where
+ * a plain item keeps nbytes, which is never negative, so both kinds of
+ * records can live in the same database.
+ */
+typedef struct _zitem {
+    int             magic;
+    uint32_t        dict_id;
+    uint32_t        ntotal;     /* size of the item once inflated */
+    unsigned char   data[];
+} zitem;
+
+#define ZITEM_MAGIC (-0x7a64)
+
+struct dict_stats {
+    uint64_t    deflated;       /* records stored compressed */
+    uint64_t    inflated;       /* records read back */
+    uint64_t    bytes_in;       /* item bytes handed to deflate */
+    uint64_t    bytes_out;      /* bytes actually stored for them */
+    uint64_t    errors;
+};
+
+/*
+ * Small values gain little from per-record deflate, since every record
+ * starts with an empty window, so a dictionary is preset into zlib before
+ * each record is deflated or inflated. Every trained dictionary is a
+ * record of its own database ("<db_file>.dict", keyed by id) and is never
+ * rewritten, so records written under an older dictionary stay readable.
+ * Being in the env, dictionaries replicate and are backed up with the
+ * records that need them; a replica loads one the first time a record
+ * asks for it. Training scans the database, so it runs on a thread of
+ * its own.
+ *
+ * Dictionaries are loaded once and never freed, only the current id
+ * moves. A slot is filled once, its size before its pointer, so deflate
+ * and inflate read them without dict_lock; the lock only serializes
+ * loading and training. The counters are atomics.
+ */
+static unsigned char *dicts[DICT_MAX_VERSIONS + 1];
+static uInt dict_sizes[DICT_MAX_VERSIONS + 1];
+static uint32_t dict_curr = 0;
+static int dict_versions = 0;
+static struct dict_stats dict_stats;
+static pthread_mutex_t dict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* where the dictionaries are kept, opened once the file is there */
+static DB *dict_dbp = NULL;
+
+/* the training thread, if one was started */
+static pthread_t dict_train_tid;
+static bool dict_training = false;
+static bool dict_train_started = false;
+static int dict_train_result = 0;   /* id of the last dictionary trained, -1 if that failed */
+
+/* per-thread zlib streams, so we don't pay deflateInit for every record */
+static pthread_key_t dict_stream_key;
+static pthread_once_t dict_stream_once = PTHREAD_ONCE_INIT;
+
+struct dict_streams {
+    z_stream    def;
+    z_stream    inf;
+    int         def_ready;
+    int         inf_ready;
+};
+
+static void dict_streams_free(void *arg) {
+    struct dict_streams *zs = arg;
+    if (zs->def_ready)
+        deflateEnd(&zs->def);
+    if (zs->inf_ready)
+        inflateEnd(&zs->inf);
+    free(zs);
+}
+
+static void dict_stream_key_init(void) {
+    pthread_key_create(&dict_stream_key, dict_streams_free);
+}
+
+static struct dict_streams *dict_streams_get(void) {
+    struct dict_streams *zs;
+
+    pthread_once(&dict_stream_once, dict_stream_key_init);
+    zs = pthread_getspecific(dict_stream_key);
+    if (zs == NULL) {
+        zs = calloc(1, sizeof(struct dict_streams));
+        if (zs == NULL)
+            return NULL;
+        pthread_setspecific(dict_stream_key, zs);
+    }
+    return zs;
+}
+
+/* the dictionary database, in the env home */
+void dict_db_name(char *buf, size_t len) {
+    snprintf(buf, len, "%s.dict", bdb_settings.db_file);
+}
+
+/* dictionaries of older versions, one file each next to the database */
+static void dict_file_path(char *buf, size_t len, uint32_t id) {
+    snprintf(buf, len, "%s/%s.dict.%u", bdb_settings.env_home, bdb_settings.db_file, id);
+}
+
+/*
+ * Opens the dictionary database. A replica can't create it, and waits for
+ * the master's. Called under dict_lock. Returns 0, or the BDB error.
+ */
+static int dict_db_open(void) {
+    char name[1024];
+    DB *db;
+    int ret;
+
+    if (dict_dbp != NULL)
+        return 0;
+    dict_db_name(name, sizeof(name));
+    if ((ret = db_create(&db, env, 0)) != 0) {
+        fprintf(stderr, "db_create: %s\n", db_strerror(ret));
+        return ret;
+    }
+    if ((ret = db->open(db, NULL, name, NULL, DB_BTREE, bdb_settings.db_flags, 0664)) != 0) {
+        if (ret != ENOENT)
+            fprintf(stderr, "dict: open %s: %s\n", name, db_strerror(ret));
+        db->close(db, 0);
+        return ret;
+    }
+    dict_dbp = db;
+    return 0;
+}
+
+/* Stores a dictionary under *id*, once and for all. */
+static int dict_db_put(uint32_t id, const unsigned char *data, size_t size) {
+    DBT dbkey, dbdata;
+    uint32_t nid = htonl(id);
+    int ret, attempt = 0;
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = &nid;
+    dbkey.size = sizeof(nid);
+    dbdata.data = (void *)data;
+    dbdata.size = size;
+    do {
+        ret = dict_dbp->put(dict_dbp, NULL, &dbkey, &dbdata, DB_NOOVERWRITE);
+    } while (bdb_retry(ret, &attempt));
+    if (ret != 0 && ret != DB_KEYEXIST)
+        fprintf(stderr, "dict: put %u: %s\n", id, db_strerror(ret));
+    return ret;
+}
+
+/*
+ * Makes dictionary *id* visible to deflate and inflate. Called under
+ * dict_lock; the size is there before anyone sees the pointer.
+ */
+static void dict_publish(uint32_t id, unsigned char *data, uInt size) {
+    dict_sizes[id] = size;
+    __atomic_store_n(&dicts[id], data, __ATOMIC_RELEASE);
+    dict_versions++;
+}
+
+/*
+ * Loads dictionary *id* from the database, if it isn't loaded yet. Called
+ * under dict_lock. Returns 0 if it is loaded now.
+ */
+static int dict_load(uint32_t id) {
+    DBT dbkey, dbdata;
+    uint32_t nid = htonl(id);
+    int ret, attempt = 0;
+
+    if (dicts[id] != NULL)
+        return 0;
+    if (dict_db_open() != 0)
+        return -1;
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = &nid;
+    dbkey.size = sizeof(nid);
+    dbdata.flags = DB_DBT_MALLOC;
+    do {
+        ret = dict_dbp->get(dict_dbp, NULL, &dbkey, &dbdata, 0);
+    } while (bdb_retry(ret, &attempt));
+    if (ret != 0) {
+        if (ret != DB_NOTFOUND)
+            fprintf(stderr, "dict: get %u: %s\n", id, db_strerror(ret));
+        return -1;
+    }
+    if (dbdata.size == 0 || dbdata.size > DICT_MAX_SIZE) {
+        fprintf(stderr, "ignoring dictionary %u: bad size %u\n", id, dbdata.size);
+        free(dbdata.data);
+        return -1;
+    }
+    dict_publish(id, dbdata.data, dbdata.size);
+    return 0;
+}
+
+/*
+ * Moves a dictionary file of an older version into the database. Called
+ * under dict_lock, on a writable database. The file stays, for a rollback.
+ */
+static void dict_import_file(uint32_t id) {
+    char path[1024];
+    struct stat st;
+    unsigned char *data;
+    FILE *fp;
+
+    dict_file_path(path, sizeof(path), id);
+    if (stat(path, &st) != 0)
+        return;
+    if (st.st_size <= 0 || st.st_size > DICT_MAX_SIZE) {
+        fprintf(stderr, "ignoring dictionary %s: bad size %ld\n", path, (long)st.st_size);
+        return;
+    }
+    if ((data = malloc(st.st_size)) == NULL)
+        return;
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "failed to open dictionary %s: %s\n", path, strerror(errno));
+        free(data);
+        return;
+    }
+    if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size) {
+        fprintf(stderr, "failed to read dictionary %s\n", path);
+    } else if (dict_db_put(id, data, st.st_size) == 0) {
+        fprintf(stderr, "dictionary %s moved into the database\n", path);
+    }
+    fclose(fp);
+    free(data);
+}
+
+/*
+ * Loads every dictionary in the database. The one with the highest id is
+ * used for new records. Dictionary files left by an older version are
+ * moved into the database first.
+ */
+void dict_init(void) {
+    uint32_t id;
+
+    pthread_mutex_lock(&dict_lock);
+    if (dict_db_open() == 0) {
+        if (bdb_settings.db_flags & DB_CREATE) {
+            for (id = 1; id <= DICT_MAX_VERSIONS; id++)
+                dict_import_file(id);
+        }
+        for (id = 1; id <= DICT_MAX_VERSIONS; id++) {
+            if (dict_load(id) == 0)
+                __atomic_store_n(&dict_curr, id, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&dict_lock);
+
+    if (settings.verbose > 0 && dict_curr > 0) {
+        fprintf(stderr, "dictionary compression: %d dictionaries loaded, current is %u\n",
+                dict_versions, dict_curr);
+    }
+}
+
+/* Waits for a training run to be done, and closes the database. */
+void dict_close(void) {
+    if (dict_train_started) {
+        pthread_join(dict_train_tid, NULL);
+        dict_train_started = false;
+    }
+    pthread_mutex_lock(&dict_lock);
+    if (dict_dbp != NULL) {
+        dict_dbp->close(dict_dbp, 0);
+        dict_dbp = NULL;
+    }
+    pthread_mutex_unlock(&dict_lock);
+}
+
+/*
+ * Returns whether a stored record was written by dict_deflate().
+ */
+bool dict_is_deflated(const void *buf, size_t size) {
+    return size >= sizeof(zitem) && ((const zitem *)buf)->magic == ZITEM_MAGIC;
+}
+
+/*
+ * Deflates a whole item against the current dictionary. Returns a malloc'd
+ * record, or NULL if there is no dictionary or it didn't make the item any
+ * smaller; the caller then stores the item as is.
+ */
+void *dict_deflate(item *it, size_t *nzip) {
+    struct dict_streams *zs;
+    size_t ntotal = ITEM_ntotal(it);
+    zitem *z;
+    uint32_t id;
+    unsigned char *dict;
+    uInt dict_size;
+    int ret;
+
+    id = __atomic_load_n(&dict_curr, __ATOMIC_ACQUIRE);
+    if (id == 0 || (zs = dict_streams_get()) == NULL)
+        return NULL;
+    dict = __atomic_load_n(&dicts[id], __ATOMIC_ACQUIRE);
+    dict_size = dict_sizes[id];
+
+    if (!zs->def_ready) {
+        /* raw deflate, the zlib header and adler32 would cost us 6 bytes a record */
+        if (deflateInit2(&zs->def, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return NULL;
+        zs->def_ready = 1;
+    } else {
+        deflateReset(&zs->def);
+    }
+
+    if (deflateSetDictionary(&zs->def, dict, dict_size) != Z_OK)
+        return NULL;
+
+    /* not worth it unless we save at least the header we add */
+    if ((z = malloc(ntotal)) == NULL)
+        return NULL;
+
+    zs->def.next_in = (Bytef *)it;
+    zs->def.avail_in = ntotal;
+    zs->def.next_out = z->data;
+    zs->def.avail_out = ntotal - sizeof(zitem);
+
+    ret = deflate(&zs->def, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        free(z);
+        return NULL;
+    }
+
+    z->magic = ZITEM_MAGIC;
+    z->dict_id = id;
+    z->ntotal = ntotal;
+    *nzip = sizeof(zitem) + zs->def.total_out;
+
+    __atomic_fetch_add(&dict_stats.deflated, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dict_stats.bytes_in, ntotal, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dict_stats.bytes_out, *nzip, __ATOMIC_RELAXED);
+
+    return z;
+}
+
+/*
+ * Inflates a record written by dict_deflate() into a fresh item buffer.
+ * Returns NULL if the dictionary is gone or the record is corrupt.
+ */
+item *dict_inflate(const void *buf, size_t size) {
+    const zitem *z = buf;
+    struct dict_streams *zs;
+    unsigned char *dict = NULL;
+    uInt dict_size = 0;
+    item *it;
+    int ret;
+
+    if (z->dict_id > 0 && z->dict_id <= DICT_MAX_VERSIONS) {
+        dict = __atomic_load_n(&dicts[z->dict_id], __ATOMIC_ACQUIRE);
+        if (dict == NULL) {
+            /* on a replica, one trained since we started */
+            pthread_mutex_lock(&dict_lock);
+            dict_load(z->dict_id);
+            dict = dicts[z->dict_id];
+            pthread_mutex_unlock(&dict_lock);
+        }
+        if (dict != NULL)
+            dict_size = dict_sizes[z->dict_id];
+    }
+    if (dict == NULL) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "dictionary %u needed to read a record is missing\n", z->dict_id);
+        goto error;
+    }
+
+    if ((zs = dict_streams_get()) == NULL)
+        goto error;
+    if (!zs->inf_ready) {
+        if (inflateInit2(&zs->inf, -15) != Z_OK)
+            goto error;
+        zs->inf_ready = 1;
+    } else {
+        inflateReset(&zs->inf);
+    }
+    if (inflateSetDictionary(&zs->inf, dict, dict_size) != Z_OK)
+        goto error;
+
+    if ((it = item_alloc2(z->ntotal)) == NULL)
+        goto error;
+
+    zs->inf.next_in = (Bytef *)z->data;
+    zs->inf.avail_in = size - sizeof(zitem);
+    zs->inf.next_out = (Bytef *)it;
+    zs->inf.avail_out = z->ntotal;
+
+    ret = inflate(&zs->inf, Z_FINISH);
+    if (ret != Z_STREAM_END || zs->inf.total_out != z->ntotal
+        || ITEM_ntotal(it) != z->ntotal) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "inflate: corrupt record under dictionary %u\n", z->dict_id);
+        item_free_buf(it, z->ntotal);
+        goto error;
+    }
+
+    __atomic_fetch_add(&dict_stats.inflated, 1, __ATOMIC_RELAXED);
+    return it;
+
+error:
+    __atomic_fetch_add(&dict_stats.errors, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* the training sample, and counts of every k-mer seen in it */
+struct dict_segment {
+    item        *it;
+    int         off;
+    int         len;
+    uint64_t    score;
+};
+
+static uint32_t dict_kmer_hash(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - DICT_HASH_BITS));
+}
+
+static uint64_t dict_segment_score(const struct dict_segment *s, const uint16_t *counts) {
+    const unsigned char *p = (unsigned char *)ITEM_data(s->it) + s->off;
+    uint64_t score = 0;
+    int i;
+
+    for (i = 0; i + DICT_KMER <= s->len; i++)
+        score += counts[dict_kmer_hash(p + i)];
+    return score;
+}
+
+static int dict_segment_cmp(const void *a, const void *b) {
+    const struct dict_segment *x = a, *y = b;
+    if (x->score == y->score)
+        return 0;
+    return x->score < y->score ? 1 : -1;
+}
+
+/*
+ * Trains a new dictionary from a sample of stored values, saves it and
+ * makes it current. The sample is a reservoir over the first
+ * DICT_SCAN_ITEMS records. Values are cut into DICT_SEGMENT byte pieces,
+ * scored by how common their k-mers are across the whole sample, and the
+ * best pieces are packed into the dictionary with the best at the end,
+ * where deflate reaches them with the shortest distances.
+ *
+ * Returns the new dictionary id, or -1 on failure.
+ */
+static int dict_train(void) {
+    DBC *cursorp = NULL;
+    item **sample = NULL;
+    uint16_t *counts = NULL;
+    struct dict_segment *segs = NULL;
+    unsigned char *dict = NULL;
+    size_t nsegs = 0, maxsegs = 0, dict_size = 0;
+    int nsample = 0, nseen = 0, nshards = 0;
+    uint32_t id = 0;
+    item *it;
+    int i, j, ret;
+
+    pthread_mutex_lock(&dict_lock);
+    for (id = DICT_MAX_VERSIONS; id > 0 && dicts[id] == NULL; id--)
+        ;
+    ret = dict_db_open();
+    pthread_mutex_unlock(&dict_lock);
+    if (ret != 0) {
+        fprintf(stderr, "dict_train: no dictionary database\n");
+        return -1;
+    }
+    if (++id > DICT_MAX_VERSIONS) {
+        fprintf(stderr, "dict_train: all %d dictionary ids are used\n", DICT_MAX_VERSIONS);
+        return -1;
+    }
+
+    sample = calloc(DICT_SAMPLE_ITEMS, sizeof(item *));
+    counts = calloc(1 << DICT_HASH_BITS, sizeof(uint16_t));
+    dict = malloc(DICT_MAX_SIZE);
+    if (sample == NULL || counts == NULL || dict == NULL)
+        goto out;
+
+    /* an even share of the scan from every shard of every keyspace */
+    for (i = 0; i < bdb_nns; i++)
+        nshards += bdb_ns[i].nshards;
+    for (i = 0; i < bdb_nns * MAX_DB_SHARDS; i++) {
+        DB *db = bdb_ns[i / MAX_DB_SHARDS].dbps[i % MAX_DB_SHARDS];
+        int nscan = DICT_SCAN_ITEMS / nshards;
+
+        if (db == NULL)
+            continue;
+        if ((ret = db->cursor(db, NULL, &cursorp, 0)) != 0) {
+            fprintf(stderr, "dbp->cursor: %s\n", db_strerror(ret));
+            goto out;
+        }
+        for (it = item_cget(cursorp, NULL, 0, DB_NEXT);
+             it != NULL && nscan > 0 && !daemon_quit;
+             it = item_cget(cursorp, NULL, 0, DB_NEXT), nseen++, nscan--) {
+            if (it->nbytes - 2 < DICT_KMER) {
+                item_free(it);
+                continue;
+            }
+            if (nsample < DICT_SAMPLE_ITEMS) {
+                sample[nsample++] = it;
+            } else if ((j = random() % (nseen + 1)) < DICT_SAMPLE_ITEMS) {
+                item_free(sample[j]);
+                sample[j] = it;
+            } else {
+                item_free(it);
+            }
+        }
+        if (it != NULL)
+            item_free(it);
+        cursorp->close(cursorp);
+    }
+
+    if (nsample == 0) {
+        fprintf(stderr, "dict_train: nothing to train on\n");
+        goto out;
+    }
+
+    /* count k-mers, then cut the sample into scored segments */
+    for (i = 0; i < nsample; i++) {
+        unsigned char *p = (unsigned char *)ITEM_data(sample[i]);
+        int len = sample[i]->nbytes - 2;
+        for (j = 0; j + DICT_KMER <= len; j++) {
+            uint16_t *c = &counts[dict_kmer_hash(p + j)];
+            if (*c < UINT16_MAX)
+                (*c)++;
+        }
+        maxsegs += (len + DICT_SEGMENT - 1) / DICT_SEGMENT;
+    }
+    if ((segs = malloc(sizeof(struct dict_segment) * maxsegs)) == NULL)
+        goto out;
+    for (i = 0; i < nsample; i++) {
+        int len = sample[i]->nbytes - 2;
+        for (j = 0; j + DICT_KMER <= len; j += DICT_SEGMENT) {
+            struct dict_segment *s = &segs[nsegs++];
+            s->it = sample[i];
+            s->off = j;
+            s->len = len - j < DICT_SEGMENT ? len - j : DICT_SEGMENT;
+            s->score = dict_segment_score(s, counts);
+        }
+    }
+    qsort(segs, nsegs, sizeof(struct dict_segment), dict_segment_cmp);
+
+    /*
+     * Greedy pick. A chosen segment zeroes the counts of its k-mers, so
+     * near-duplicates of what we already have lose their score.
+     */
+    for (i = 0; i < (int)nsegs && dict_size < DICT_MAX_SIZE; i++) {
+        struct dict_segment *s = &segs[i];
+        unsigned char *p = (unsigned char *)ITEM_data(s->it) + s->off;
+        int len = s->len;
+
+        /* only keep pieces that appear, on average, in more than one value */
+        if (dict_segment_score(s, counts) < (uint64_t)(2 * (len - DICT_KMER + 1)))
+            continue;
+        if ((size_t)len > DICT_MAX_SIZE - dict_size)
+            len = DICT_MAX_SIZE - dict_size;
+        memcpy(dict + DICT_MAX_SIZE - dict_size - len, p, len);
+        dict_size += len;
+        for (j = 0; j + DICT_KMER <= s->len; j++)
+            counts[dict_kmer_hash(p + j)] = 0;
+    }
+
+    if (dict_size == 0) {
+        fprintf(stderr, "dict_train: sample of %d values has nothing in common\n", nsample);
+        goto out;
+    }
+    memmove(dict, dict + DICT_MAX_SIZE - dict_size, dict_size);
+
+    /* the database has it before any record is written under it */
+    if (dict_db_put(id, dict, dict_size) != 0)
+        goto out;
+
+    pthread_mutex_lock(&dict_lock);
+    dict_publish(id, dict, dict_size);
+    __atomic_store_n(&dict_curr, id, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dict_lock);
+    dict = NULL;
+
+    if (settings.verbose > 0) {
+        fprintf(stderr, "dict_train: dictionary %u, %"PRIuS" bytes from %d of %d values\n",
+                id, dict_size, nsample, nseen);
+    }
+    ret = id;
+    goto done;
+
+out:
+    ret = -1;
+done:
+    if (sample != NULL) {
+        for (i = 0; i < nsample; i++)
+            item_free(sample[i]);
+        free(sample);
+    }
+    free(counts);
+    free(segs);
+    free(dict);
+    return ret;
+}
+
+static void *dict_train_thread(void *arg) {
+    int ret = dict_train();
+
+    pthread_mutex_lock(&dict_lock);
+    dict_train_result = ret;
+    dict_training = false;
+    pthread_mutex_unlock(&dict_lock);
+    return NULL;
+}
+
+/*
+ * Starts training a new dictionary in the background. Returns 0, or -1 if
+ * a training run is already going or can't be started.
+ */
+int dict_train_start(void) {
+    pthread_mutex_lock(&dict_lock);
+    if (dict_training) {
+        pthread_mutex_unlock(&dict_lock);
+        return -1;
+    }
+    /* the last run is over, reap it */
+    if (dict_train_started) {
+        pthread_join(dict_train_tid, NULL);
+        dict_train_started = false;
+    }
+    if ((errno = pthread_create(&dict_train_tid, NULL, dict_train_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning dictionary training thread: %s\n", strerror(errno));
+        pthread_mutex_unlock(&dict_lock);
+        return -1;
+    }
+    dict_training = dict_train_started = true;
+    pthread_mutex_unlock(&dict_lock);
+    return 0;
+}
+
+void stats_dict(char *temp) {
+    char *pos = temp;
+
+    pthread_mutex_lock(&dict_lock);
+    pos += sprintf(pos, "STAT dict_min_size %d\r\n", bdb_settings.dict_min_size);
+    pos += sprintf(pos, "STAT dict_id %u\r\n", dict_curr);
+    pos += sprintf(pos, "STAT dict_size %u\r\n", dict_curr ? dict_sizes[dict_curr] : 0);
+    pos += sprintf(pos, "STAT dict_versions %d\r\n", dict_versions);
+    pos += sprintf(pos, "STAT dict_training %d\r\n", dict_training);
+    pos += sprintf(pos, "STAT dict_last_train %d\r\n", dict_train_result);
+    pos += sprintf(pos, "STAT dict_deflated %"PRIu64"\r\n",
+                   __atomic_load_n(&dict_stats.deflated, __ATOMIC_RELAXED));
+    pos += sprintf(pos, "STAT dict_inflated %"PRIu64"\r\n",
+                   __atomic_load_n(&dict_stats.inflated, __ATOMIC_RELAXED));
+    pos += sprintf(pos, "STAT dict_bytes_in %"PRIu64"\r\n",
+                   __atomic_load_n(&dict_stats.bytes_in, __ATOMIC_RELAXED));
+    pos += sprintf(pos, "STAT dict_bytes_out %"PRIu64"\r\n",
+                   __atomic_load_n(&dict_stats.bytes_out, __ATOMIC_RELAXED));
+    pos += sprintf(pos, "STAT dict_errors %"PRIu64"\r\n",
+                   __atomic_load_n(&dict_stats.errors, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&dict_lock);
+    pos += sprintf(pos, "END");
+}
@@ -0,0 +1,568 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Parallel export of every keyspace to local files.
+ *
+ *  Each shard is a job, and a btree shard is split further into key
+ *  ranges when there are more threads than shards: its first and last
+ *  keys are read, and split points interpolated over the bytes after
+ *  their common prefix. The ranges are only as even as the keys are, but
+ *  they cover the shard whatever the keys look like.
+ *
+ *  A job walks its range with a cursor, a bulk DB_MULTIPLE_KEY buffer at
+ *  a time, and writes the records to "<dir>/<ns>-<shard>-<part>.dump"
+ *  (gzip'd, with a ".gz", if asked for) in the format -g loads; <dir> is a
+ *  new directory, named by the client, in the --dump-dir one:
+ *
+ *      <key> <flags> <bytes>\r\n
+ *      <data block>\r\n
+ *
+ *  The cursors take no transaction, so the export is not a snapshot; it
+ *  only holds a page lock while a buffer fills.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <db.h>
+
+#define DUMP_BULK (1024 * 1024)  /* bulk buffer, a multiple of 1024 */
+#define DUMP_MAX_THREADS 64
+#define DUMP_DEFAULT_THREADS 4
+#define DUMP_SPLIT_BYTES 8       /* interpolated past the common prefix */
+#define DUMP_KEY_SIZE (KEY_MAX_LENGTH + DUMP_SPLIT_BYTES)
+
+/* cancelling and failing last until the dump thread has joined the workers */
+enum dump_state { DUMP_IDLE, DUMP_RUNNING, DUMP_CANCELLING, DUMP_FAILING,
+                  DUMP_CANCELLED, DUMP_DONE, DUMP_FAILED };
+
+static const char *dump_state_names[] = {
+    "idle", "running", "cancelling", "failing", "cancelled", "done", "failed"
+};
+
+struct dump_job {
+    int ns;
+    int shard;
+    int part;
+    char start[DUMP_KEY_SIZE];
+    size_t nstart;          /* 0 for the first key */
+    char end[DUMP_KEY_SIZE];
+    size_t nend;            /* 0 for the last key */
+};
+
+struct dump_out {
+    FILE *fp;
+    gzFile gz;
+};
+
+static struct {
+    enum dump_state state;
+    char dir[PATH_MAX];
+    int nthreads;
+    bool gzip;
+    struct dump_job *jobs;
+    int njobs;
+    int next_job;
+    int jobs_done;
+    u_int64_t records;
+    u_int64_t bytes;        /* before compression */
+    time_t started;
+    time_t finished;
+    char error[128];
+} dump;
+
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t dump_tid;
+static bool dump_started = false;   /* dump_tid is there to join */
+
+static int dump_write(struct dump_out *out, const void *buf, size_t len) {
+    if (out->gz != NULL)
+        return gzwrite(out->gz, buf, len) == (int)len ? 0 : -1;
+    return fwrite(buf, 1, len, out->fp) == len ? 0 : -1;
+}
+
+/*
+ * Writes one record, as stored: an item, or one deflated with the
+ * dictionary. Returns the bytes written, or -1.
+ */
+static long dump_record(struct dump_out *out, char *rec, size_t size, char **scratch, size_t *nscratch) {
+    item hdr, *it = NULL;
+    char *key, *rest;
+    long n;
+    int ret;
+
+    if (size >= sizeof(int) && dict_is_deflated(rec, size)) {
+        /* the bulk buffer keeps no alignment, inflate from a copy */
+        if (size > *nscratch) {
+            free(*scratch);
+            if ((*scratch = malloc(size)) == NULL) {
+                *nscratch = 0;
+                return -1;
+            }
+            *nscratch = size;
+        }
+        memcpy(*scratch, rec, size);
+        if ((it = dict_inflate(*scratch, size)) == NULL)
+            return -1;
+        memcpy(&hdr, it, sizeof(item));
+        key = ITEM_key(it);
+    } else {
+        if (size < sizeof(item))
+            return -1;
+        memcpy(&hdr, rec, sizeof(item));
+        key = rec + sizeof(item);
+    }
+    /* the key, then the suffix " <flags> <bytes>\r\n" and the data */
+    rest = key + hdr.nkey + 1;
+    n = hdr.nkey + hdr.nsuffix + hdr.nbytes;
+    if (it == NULL && sizeof(item) + hdr.nkey + 1 + hdr.nsuffix + hdr.nbytes > size)
+        n = -1;
+    else if ((ret = dump_write(out, key, hdr.nkey)) != 0 ||
+             (ret = dump_write(out, rest, hdr.nsuffix + hdr.nbytes)) != 0)
+        n = -1;
+    if (it != NULL)
+        item_free(it);
+    return n;
+}
+
+static int dump_keycmp(const void *a, size_t na, const void *b, size_t nb) {
+    return bdb_defcmp((void *)a, na, (void *)b, nb);
+}
+
+/*
+ * Walks a job's range with a bulk cursor. After a deadlock the cursor is
+ * reopened at the last key written, which is then skipped.
+ */
+static int dump_job_run(struct dump_job *job, struct dump_out *out, DBT *bulk) {
+    DB *db = bdb_ns[job->ns].dbps[job->shard];
+    DBC *dbc = NULL;
+    DBT key;
+    DBTYPE type;
+    char last[DUMP_KEY_SIZE], kbuf[DUMP_KEY_SIZE];
+    char *scratch = NULL;
+    size_t nscratch = 0, nlast = 0;
+    bool have_last = false, done = false, skip = false;
+    u_int32_t flags = DB_FIRST;
+    void *p, *k, *d;
+    u_int32_t nk, nd;
+    long n;
+    int ret = 0, attempt = 0;
+    u_int64_t records, bytes;
+
+    if ((ret = db->get_type(db, &type)) != 0)
+        return ret;
+
+    while (!done) {
+        if (dbc == NULL) {
+            if ((ret = db->cursor(db, NULL, &dbc, 0)) != 0)
+                break;
+            memset(&key, 0, sizeof(key));
+            key.data = kbuf;
+            key.ulen = sizeof(kbuf);
+            key.flags = DB_DBT_USERMEM;
+            skip = have_last;
+            if (have_last) {
+                memcpy(kbuf, last, nlast);
+                key.size = nlast;
+                flags = type == DB_BTREE ? DB_SET_RANGE : DB_SET;
+            } else if (job->nstart > 0) {
+                memcpy(kbuf, job->start, job->nstart);
+                key.size = job->nstart;
+                flags = DB_SET_RANGE;
+            } else {
+                flags = DB_FIRST;
+            }
+        }
+
+        ret = dbc->get(dbc, &key, bulk, flags | DB_MULTIPLE_KEY);
+        if (ret == DB_BUFFER_SMALL) {
+            /* one record bigger than the buffer */
+            u_int32_t ulen = bulk->size > bulk->ulen ? (bulk->size + 1023) & ~1023 : bulk->ulen * 2;
+            void *nb = realloc(bulk->data, ulen);
+            if (nb == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+            bulk->data = nb;
+            bulk->ulen = ulen;
+            /* a DB_NEXT didn't move, anything else positions again */
+            if (flags != DB_NEXT) {
+                dbc->close(dbc);
+                dbc = NULL;
+            }
+            continue;
+        }
+        if (ret == DB_NOTFOUND && flags != DB_SET) {
+            /* a hash db can't go on from a key deleted since, that fails */
+            ret = 0;
+            break;
+        }
+        if (ret != 0) {
+            dbc->close(dbc);
+            dbc = NULL;
+            if (bdb_retry(ret, &attempt))
+                continue;
+            break;
+        }
+        flags = DB_NEXT;
+
+        records = bytes = 0;
+        DB_MULTIPLE_INIT(p, bulk);
+        for (;;) {
+            DB_MULTIPLE_KEY_NEXT(p, bulk, k, nk, d, nd);
+            if (p == NULL)
+                break;
+            if (skip) {
+                skip = false;
+                if (nk == nlast && memcmp(k, last, nk) == 0)
+                    continue;
+            }
+            if (job->nend > 0 && dump_keycmp(k, nk, job->end, job->nend) >= 0) {
+                done = true;
+                break;
+            }
+            if ((n = dump_record(out, d, nd, &scratch, &nscratch)) < 0) {
+                ret = EIO;
+                done = true;
+                break;
+            }
+            if (nk <= sizeof(last)) {
+                memcpy(last, k, nk);
+                nlast = nk;
+                have_last = true;
+            }
+            records++;
+            bytes += n;
+        }
+
+        pthread_mutex_lock(&dump_lock);
+        dump.records += records;
+        dump.bytes += bytes;
+        if (dump.state != DUMP_RUNNING && ret == 0)
+            ret = ECANCELED;
+        pthread_mutex_unlock(&dump_lock);
+        if (ret != 0)
+            break;
+    }
+    if (dbc != NULL)
+        dbc->close(dbc);
+    free(scratch);
+    return ret;
+}
+
+static void *dump_worker(void *arg) {
+    struct dump_out out;
+    struct dump_job *job;
+    char path[PATH_MAX];
+    DBT bulk;
+    int ret = 0, fd;
+
+    affinity_housekeeping();
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.ulen = DUMP_BULK;
+    bulk.flags = DB_DBT_USERMEM;
+    if ((bulk.data = malloc(bulk.ulen)) == NULL)
+        ret = ENOMEM;
+
+    while (ret == 0) {
+        pthread_mutex_lock(&dump_lock);
+        if (dump.next_job == dump.njobs || dump.state != DUMP_RUNNING) {
+            pthread_mutex_unlock(&dump_lock);
+            break;
+        }
+        job = &dump.jobs[dump.next_job++];
+        pthread_mutex_unlock(&dump_lock);
+
+        snprintf(path, sizeof(path), "%s/%s-%d-%d.dump%s", dump.dir,
+                 bdb_ns[job->ns].name, job->shard, job->part, dump.gzip ? ".gz" : "");
+        memset(&out, 0, sizeof(out));
+        errno = 0;
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+        if (fd != -1 && dump.gzip) {
+            out.gz = gzdopen(fd, "wb1");
+        } else if (fd != -1 && (out.fp = fdopen(fd, "w")) != NULL) {
+            setvbuf(out.fp, NULL, _IOFBF, 256 * 1024);
+        }
+        if (out.gz == NULL && out.fp == NULL) {
+            ret = errno != 0 ? errno : EIO;
+            if (fd != -1)
+                close(fd);
+        } else {
+            ret = dump_job_run(job, &out, &bulk);
+            if (out.gz != NULL && gzclose(out.gz) != Z_OK && ret == 0)
+                ret = EIO;
+            if (out.fp != NULL && fclose(out.fp) != 0 && ret == 0)
+                ret = errno;
+        }
+
+        pthread_mutex_lock(&dump_lock);
+        if (ret == 0) {
+            dump.jobs_done++;
+        } else if (dump.state == DUMP_RUNNING) {
+            /* the others stop at their next buffer, dump_thread ends the run */
+            dump.state = DUMP_FAILING;
+            snprintf(dump.error, sizeof(dump.error), "%s: %s", path, db_strerror(ret));
+        }
+        pthread_mutex_unlock(&dump_lock);
+    }
+    free(bulk.data);
+    return NULL;
+}
+
+/* reads the first or the last key of *db* into *buf*, returns its size or 0 */
+static size_t dump_edge_key(DB *db, u_int32_t flags, char *buf) {
+    DBC *dbc;
+    DBT key, data;
+    size_t n = 0;
+
+    if (db->cursor(db, NULL, &dbc, 0) != 0)
+        return 0;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    key.data = buf;
+    key.ulen = DUMP_KEY_SIZE;
+    key.flags = DB_DBT_USERMEM;
+    data.flags = DB_DBT_PARTIAL;    /* the key is all we need */
+    if (dbc->get(dbc, &key, &data, flags) == 0)
+        n = key.size;
+    dbc->close(dbc);
+    return n;
+}
+
+/*
+ * Splits a btree shard into *parts* jobs at *jobs*, interpolating the
+ * DUMP_SPLIT_BYTES after the common prefix of its first and last keys.
+ * Returns the number of jobs, 1 if it can't be split.
+ */
+static int dump_split(int ns, int shard, int parts, struct dump_job *jobs) {
+    DB *db = bdb_ns[ns].dbps[shard];
+    char first[DUMP_KEY_SIZE], last[DUMP_KEY_SIZE];
+    size_t nfirst, nlast, prefix;
+    u_int64_t lo = 0, hi = 0, step, v;
+    int i, j;
+
+    memset(&jobs[0], 0, sizeof(jobs[0]));
+    jobs[0].ns = ns;
+    jobs[0].shard = shard;
+    if (parts < 2 || bdb_ns[ns].db_type != DB_BTREE)
+        return 1;
+    if ((nfirst = dump_edge_key(db, DB_FIRST, first)) == 0 ||
+        (nlast = dump_edge_key(db, DB_LAST, last)) == 0)
+        return 1;
+
+    for (prefix = 0; prefix < nfirst && prefix < nlast && first[prefix] == last[prefix]; prefix++)
+        ;
+    if (prefix > KEY_MAX_LENGTH)
+        return 1;
+    for (i = 0; i < DUMP_SPLIT_BYTES; i++) {
+        lo = lo << 8 | (prefix + i < nfirst ? (unsigned char)first[prefix + i] : 0);
+        hi = hi << 8 | (prefix + i < nlast ? (unsigned char)last[prefix + i] : 0);
+    }
+    if (hi - lo < (u_int64_t)parts)
+        return 1;
+    step = (hi - lo) / parts;
+
+    for (i = 1; i < parts; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].ns = ns;
+        jobs[i].shard = shard;
+        jobs[i].part = i;
+        memcpy(jobs[i].start, first, prefix);
+        v = lo + step * i;
+        for (j = DUMP_SPLIT_BYTES - 1; j >= 0; j--, v >>= 8)
+            jobs[i].start[prefix + j] = (char)(v & 0xff);
+        jobs[i].nstart = prefix + DUMP_SPLIT_BYTES;
+        memcpy(jobs[i - 1].end, jobs[i].start, jobs[i].nstart);
+        jobs[i - 1].nend = jobs[i].nstart;
+    }
+    return parts;
+}
+
+/* fails the run with *what* and the error *err*, before any worker is up */
+static void dump_fail(const char *what, int err) {
+    pthread_mutex_lock(&dump_lock);
+    snprintf(dump.error, sizeof(dump.error), "%s: %s", what, db_strerror(err));
+    fprintf(stderr, "dump to %s failed, %s\n", dump.dir, dump.error);
+    dump.finished = time(NULL);
+    dump.state = DUMP_FAILED;
+    pthread_mutex_unlock(&dump_lock);
+}
+
+static void *dump_thread(void *arg) {
+    pthread_t tids[DUMP_MAX_THREADS];
+    char path[PATH_MAX];
+    int i, s, nshards = 0, parts, nthreads;
+    enum dump_state last;
+
+    affinity_housekeeping();
+
+    /* a new directory of its own, in the dump dir */
+    if (bdb_export_dir(bdb_settings.dump_dir, path) != 0) {
+        dump_fail(dump.dir, errno);
+        return NULL;
+    }
+    if (strlen(path) + strlen(dump.dir) + 2 > sizeof(path)) {
+        dump_fail(dump.dir, ENAMETOOLONG);
+        return NULL;
+    }
+    strcat(path, "/");
+    strcat(path, dump.dir);
+    if (mkdir(path, 0700) != 0) {
+        dump_fail(dump.dir, errno);
+        return NULL;
+    }
+    pthread_mutex_lock(&dump_lock);
+    snprintf(dump.dir, sizeof(dump.dir), "%s", path);
+    pthread_mutex_unlock(&dump_lock);
+
+    for (i = 0; i < bdb_nns; i++)
+        nshards += bdb_ns[i].nshards;
+    parts = (dump.nthreads + nshards - 1) / nshards;
+
+    if ((dump.jobs = calloc(nshards * parts, sizeof(struct dump_job))) == NULL) {
+        dump_fail("jobs", ENOMEM);
+        return NULL;
+    }
+    for (i = 0; i < bdb_nns; i++) {
+        for (s = 0; s < bdb_ns[i].nshards; s++)
+            dump.njobs += dump_split(i, s, parts, &dump.jobs[dump.njobs]);
+    }
+
+    nthreads = dump.nthreads < dump.njobs ? dump.nthreads : dump.njobs;
+    for (i = 0; i < nthreads; i++) {
+        if ((errno = pthread_create(&tids[i], NULL, dump_worker, NULL)) != 0) {
+            fprintf(stderr, "failed spawning dump thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+    nthreads = i;
+    if (nthreads == 0)
+        dump_worker(NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    /* every worker is gone, the run can end; nothing touches dump after this */
+    pthread_mutex_lock(&dump_lock);
+    if (dump.state == DUMP_RUNNING)
+        last = DUMP_DONE;
+    else if (dump.state == DUMP_CANCELLING)
+        last = DUMP_CANCELLED;
+    else
+        last = DUMP_FAILED;
+    if (last == DUMP_FAILED) {
+        fprintf(stderr, "dump to %s failed, %s\n", dump.dir, dump.error);
+    } else if (settings.verbose > 0) {
+        fprintf(stderr, "dump to %s %s, %llu records\n", dump.dir,
+                dump_state_names[last], (unsigned long long)dump.records);
+    }
+    dump.finished = time(NULL);
+    free(dump.jobs);
+    dump.jobs = NULL;
+    dump.state = last;
+    pthread_mutex_unlock(&dump_lock);
+    return NULL;
+}
+
+/*
+ * Starts an export to *dir*, a new directory of that plain name in the
+ * dump dir, with *nthreads* threads, 0 for the default, gzip'd if *gzip*.
+ * Creating it is up to the dump thread, which fails the run in "stats
+ * dump" if it can't. Returns -1 if one is already going, there is no dump
+ * dir or *dir* isn't a plain name.
+ */
+int dump_start(const char *dir, int nthreads, bool gzip) {
+    if (bdb_settings.dump_dir == NULL || *dir == '\0' || strchr(dir, '/') != NULL ||
+        strcmp(dir, ".") == 0 || strcmp(dir, "..") == 0 || strlen(dir) >= NAME_MAX)
+        return -1;
+
+    pthread_mutex_lock(&dump_lock);
+    if (dump.state == DUMP_RUNNING || dump.state == DUMP_CANCELLING ||
+        dump.state == DUMP_FAILING) {
+        pthread_mutex_unlock(&dump_lock);
+        return -1;
+    }
+    /* the last run is over: its thread set the final state as the last
+       thing it did under dump_lock, and only has to return */
+    if (dump_started) {
+        pthread_join(dump_tid, NULL);
+        dump_started = false;
+    }
+    memset(&dump, 0, sizeof(dump));
+    dump.state = DUMP_RUNNING;
+    snprintf(dump.dir, sizeof(dump.dir), "%s", dir);
+    if (nthreads <= 0)
+        nthreads = DUMP_DEFAULT_THREADS;
+    dump.nthreads = nthreads > DUMP_MAX_THREADS ? DUMP_MAX_THREADS : nthreads;
+    dump.gzip = gzip;
+    dump.started = time(NULL);
+
+    if ((errno = pthread_create(&dump_tid, NULL, dump_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning dump thread: %s\n", strerror(errno));
+        dump.state = DUMP_FAILED;
+        snprintf(dump.error, sizeof(dump.error), "%s", strerror(errno));
+        pthread_mutex_unlock(&dump_lock);
+        return -1;
+    }
+    dump_started = true;
+    pthread_mutex_unlock(&dump_lock);
+    return 0;
+}
+
+int dump_cancel(void) {
+    int ret = -1;
+
+    pthread_mutex_lock(&dump_lock);
+    if (dump.state == DUMP_RUNNING) {
+        dump.state = DUMP_CANCELLING;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return ret;
+}
+
+/* Cancels a run, and waits for its threads to be gone; before the db closes. */
+void dump_close(void) {
+    bool started;
+
+    dump_cancel();
+    pthread_mutex_lock(&dump_lock);
+    started = dump_started;
+    dump_started = false;
+    pthread_mutex_unlock(&dump_lock);
+    if (started)
+        pthread_join(dump_tid, NULL);
+}
+
+void stats_dump(char *temp) {
+    char *pos = temp;
+    time_t until;
+
+    pthread_mutex_lock(&dump_lock);
+    pos += sprintf(pos, "STAT dump_state %s\r\n", dump_state_names[dump.state]);
+    if (dump.state != DUMP_IDLE) {
+        until = dump.finished != 0 ? dump.finished : time(NULL);
+        pos += sprintf(pos, "STAT dump_dir %.256s\r\n", dump.dir);
+        pos += sprintf(pos, "STAT dump_threads %d\r\n", dump.nthreads);
+        pos += sprintf(pos, "STAT dump_gzip %d\r\n", dump.gzip);
+        pos += sprintf(pos, "STAT dump_jobs %d/%d\r\n", dump.jobs_done, dump.njobs);
+        pos += sprintf(pos, "STAT dump_records %llu\r\n", (unsigned long long)dump.records);
+        pos += sprintf(pos, "STAT dump_bytes %llu\r\n", (unsigned long long)dump.bytes);
+        pos += sprintf(pos, "STAT dump_elapsed %ld\r\n", (long)(until - dump.started));
+    }
+    if (dump.state == DUMP_FAILING || dump.state == DUMP_FAILED)
+        pos += sprintf(pos, "STAT dump_error %s\r\n", dump.error);
+    pos += sprintf(pos, "END");
+    pthread_mutex_unlock(&dump_lock);
+}
@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Handing the listening sockets over to a new process, for restarts
+ *  without a listen gap.
+ *
+ *  A serving process listens on "<env home>/handoff.sock". A new one
+ *  started with --takeover on the same env home connects there before it
+ *  makes sockets of its own, and is sent the listening sockets with
+ *  SCM_RIGHTS. It checks them against its own listen options, and says
+ *  whether it takes them with one byte back; if not, or if it goes away,
+ *  the old one serves on. Otherwise the old one drains: it stops
+ *  accepting, finishes what its conns have in flight, checkpoints, closes
+ *  the env and exits, which closes the handoff connection.
+ *
+ *  The new process waits for that before it opens the env, as recovery
+ *  needs it to itself. Connections coming in meanwhile wait in the
+ *  listen queue of the shared sockets; none is refused.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#define HANDOFF_SOCK "handoff.sock"
+#define HANDOFF_TAKEN 'y'           /* the new process's answer, if it takes them */
+#define HANDOFF_TIMEOUT 5           /* seconds a read from the old process may block */
+#define HANDOFF_EXIT_TIMEOUT 120    /* seconds it gets to drain and exit once we take over */
+
+static int handoff_fd = -1;         /* the connection between the two */
+static int handoff_listen_fd = -1;
+static struct event handoff_event;
+static struct event handoff_answer_event;
+static int handoff_offer_fd = -1;   /* a new process we sent them, not yet answered */
+static int *handoff_fds;
+static int handoff_nfds;
+static bool handoff_sent;           /* a new process has our sockets */
+
+static int handoff_path(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s",
+                 bdb_settings.env_home, HANDOFF_SOCK) >= (int)sizeof(addr->sun_path)) {
+        fprintf(stderr, "handoff: env home path is too long for a unix socket\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* bounds every read on *fd* to HANDOFF_TIMEOUT seconds */
+static int handoff_timeout(int fd) {
+    struct timeval tv;
+
+    tv.tv_sec = HANDOFF_TIMEOUT;
+    tv.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+        fprintf(stderr, "handoff: setsockopt(SO_RCVTIMEO): %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Asks a process serving the same env home for its listening sockets.
+ * Returns how many were put in *fds*, 0 if there is no such process, or
+ * -1 if the handoff failed halfway or the process didn't send them in
+ * HANDOFF_TIMEOUT seconds.
+ */
+int handoff_receive(int *fds, int max) {
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    int nfds, n, sfd;
+
+    if (handoff_path(&addr) != 0)
+        return 0;
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return 0;
+    if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        /* a socket file left by a process that is gone */
+        if (errno == ECONNREFUSED)
+            unlink(addr.sun_path);
+        close(sfd);
+        return 0;
+    }
+    if (handoff_timeout(sfd) != 0) {
+        close(sfd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &nfds;
+    iov.iov_len = sizeof(nfds);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    while ((n = recvmsg(sfd, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fprintf(stderr, "handoff: the old process sent nothing in %d seconds\n", HANDOFF_TIMEOUT);
+        close(sfd);
+        return -1;
+    }
+    cmsg = n == sizeof(nfds) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        nfds <= 0 || nfds > max || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * nfds)) {
+        fprintf(stderr, "handoff: bad message from the old process\n");
+        close(sfd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    handoff_fd = sfd;
+    fprintf(stderr, "handoff: got %d listening sockets\n", nfds);
+    return nfds;
+}
+
+/*
+ * Answers the old process, after handoff_receive(): if *take*, it drains
+ * and leaves the sockets to us; if not, it serves on.
+ */
+void handoff_answer(bool take) {
+    char c = HANDOFF_TAKEN;
+
+    if (handoff_fd == -1)
+        return;
+    if (take && write(handoff_fd, &c, 1) == 1) {
+        fprintf(stderr, "handoff: waiting for the old process to exit\n");
+        return;
+    }
+    close(handoff_fd);
+    handoff_fd = -1;
+}
+
+/*
+ * Waits for the old process to be gone, after handoff_answer(). Reads
+ * time out every HANDOFF_TIMEOUT seconds, so a process that hangs while
+ * draining can't hold us forever. Returns 0, or -1 if it is still there
+ * after HANDOFF_EXIT_TIMEOUT seconds.
+ */
+int handoff_wait(void) {
+    time_t deadline = time(NULL) + HANDOFF_EXIT_TIMEOUT;
+    char c;
+    int n;
+
+    if (handoff_fd == -1)
+        return 0;
+    for (;;) {
+        n = read(handoff_fd, &c, 1);
+        if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+            break;
+        if (time(NULL) >= deadline) {
+            fprintf(stderr, "handoff: the old process is still there after %d seconds\n",
+                    HANDOFF_EXIT_TIMEOUT);
+            close(handoff_fd);
+            handoff_fd = -1;
+            return -1;
+        }
+    }
+    close(handoff_fd);
+    handoff_fd = -1;
+    fprintf(stderr, "handoff: the old process is gone, taking over\n");
+    return 0;
+}
+
+/* the new process's answer to handoff_send() */
+static void handoff_answered(int fd, short which, void *arg) {
+    struct sockaddr_un addr;
+    char c = 0;
+    int n;
+
+    while ((n = read(fd, &c, 1)) == -1 && errno == EINTR)
+        ;
+    handoff_offer_fd = -1;
+    if (n != 1 || c != HANDOFF_TAKEN) {
+        fprintf(stderr, "handoff: the new process didn't take the listening sockets, serving on\n");
+        close(fd);
+        return;
+    }
+
+    /* one handoff is all there is, the next process asks the new one */
+    event_del(&handoff_event);
+    close(handoff_listen_fd);
+    handoff_listen_fd = -1;
+    if (handoff_path(&addr) == 0)
+        unlink(addr.sun_path);
+    handoff_fd = fd;
+    handoff_sent = true;
+
+    fprintf(stderr, "handoff: listening sockets taken by a new process\n");
+    conn_drain_start();
+}
+
+static void handoff_send(int fd, short which, void *arg) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    int cfd;
+
+    if ((cfd = accept(handoff_listen_fd, NULL, NULL)) == -1)
+        return;
+    /* one offer at a time */
+    if (handoff_offer_fd != -1) {
+        close(cfd);
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = &handoff_nfds;
+    iov.iov_len = sizeof(handoff_nfds);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * handoff_nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handoff_nfds);
+    memcpy(CMSG_DATA(cmsg), handoff_fds, sizeof(int) * handoff_nfds);
+    if (sendmsg(cfd, &msg, 0) != sizeof(handoff_nfds)) {
+        perror("handoff: sendmsg()");
+        close(cfd);
+        return;
+    }
+
+    /* nothing changes until it says it takes them */
+    event_set(&handoff_answer_event, cfd, EV_READ, handoff_answered, NULL);
+    event_base_set((struct event_base *)arg, &handoff_answer_event);
+    if (event_add(&handoff_answer_event, 0) == -1) {
+        perror("handoff: event_add");
+        close(cfd);
+        return;
+    }
+    handoff_offer_fd = cfd;
+    fprintf(stderr, "handoff: listening sockets sent to a new process\n");
+}
+
+/*
+ * Offers the *nfds* listening sockets at *fds* to the next process, from
+ * the event loop of *base*. Returns 0, or -1 if that can't be set up.
+ */
+int handoff_listen(struct event_base *base, int *fds, int nfds) {
+    struct sockaddr_un addr;
+    int flags;
+
+    if (nfds == 0 || handoff_path(&addr) != 0)
+        return -1;
+    if ((handoff_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("handoff: socket()");
+        return -1;
+    }
+    unlink(addr.sun_path);
+    if (bind(handoff_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(handoff_listen_fd, 1) == -1 ||
+        (flags = fcntl(handoff_listen_fd, F_GETFL, 0)) < 0 ||
+        fcntl(handoff_listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("handoff: bind() or listen()");
+        close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+        return -1;
+    }
+    chmod(addr.sun_path, 0700);
+
+    handoff_fds = fds;
+    handoff_nfds = nfds;
+    event_set(&handoff_event, handoff_listen_fd, EV_READ | EV_PERSIST, handoff_send, base);
+    event_base_set(base, &handoff_event);
+    if (event_add(&handoff_event, 0) == -1) {
+        perror("handoff: event_add");
+        close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Lets the new process go on, once the env is closed. Returns true if
+ * there is one, which owns the pid file from now on.
+ */
+bool handoff_done(void) {
+    if (handoff_offer_fd != -1) {
+        close(handoff_offer_fd);
+        handoff_offer_fd = -1;
+    }
+    if (handoff_listen_fd != -1) {
+        struct sockaddr_un addr;
+
+        close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+        if (handoff_path(&addr) == 0)
+            unlink(addr.sun_path);
+    }
+    if (handoff_fd != -1) {
+        close(handoff_fd);
+        handoff_fd = -1;
+    }
+    return handoff_sent;
+}
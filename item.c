@@ -93,6 +93,19 @@ int do_item_add_to_freelist(item *it) {
     return 1;
 }
 
+/*
+ * Moves up to n buffers off the freelist into *its*, for a thread's own
+ * cache. Returns how many it moved. Should be called under the same lock
+ * as do_item_from_freelist.
+ */
+int do_item_take_from_freelist(item **its, int n) {
+    int i;
+
+    for (i = 0; i < n && freeitemcurr > 0; i++)
+        its[i] = freeitem[--freeitemcurr];
+    return i;
+}
+
 /**
  * Generates the variable-sized part of the header for an object.
  *
@@ -180,19 +193,27 @@ item *item_alloc2(size_t ntotal) {
  */
 
 int item_free(item *it) {
-    size_t ntotal = 0;
     if (NULL == it)
         return 0;
 
     /* ntotal may be wrong, if 'it' is not a full item. */
-    ntotal = ITEM_ntotal(it);
+    return item_free_buf(it, ITEM_ntotal(it));
+}
+
+/*
+ * free a buffer got from item_alloc2(ntotal), whatever it holds now.
+ */
+int item_free_buf(void *it, size_t ntotal) {
+    if (NULL == it)
+        return 0;
+
     if (ntotal > settings.item_buf_size){
         if (settings.verbose > 1) {
             fprintf(stderr, "ntotal: %"PRIuS", use free() directly.\n", ntotal);
         }
         free(it);   
     }else{
-        if (0 != item_add_to_freelist(it)) {
+        if (0 != item_add_to_freelist((item *)it)) {
             if (settings.verbose > 1) {
                 fprintf(stderr, "ntotal: %"PRIuS", add a item buffer to freelist fail, use free() directly.\n", ntotal);
             }
@@ -206,16 +227,49 @@ int item_free(item *it) {
     return 0;
 }
 
-/* if return item is not NULL, free by caller */
-item *item_get(char *key, size_t nkey){
+/*
+ * turn a record just read into dbdata->data into an item. Records written
+ * by dict_deflate() are inflated into a new buffer and the raw one freed.
+ */
+static item *item_from_record(item *it, DBT *dbdata){
+    item *new_it;
+
+    if (!dict_is_deflated(it, dbdata->size)) {
+        return it;
+    }
+    new_it = dict_inflate(it, dbdata->size);
+    item_free_buf(it, dbdata->ulen);
+    return new_it;
+}
+
+/*
+ * if return item is not NULL, free by caller. NULL is a miss, unless
+ * *failed* (if not NULL) is set: the read itself failed, or the record
+ * could not be inflated.
+ */
+item *item_get(struct bdb_ns *ns, char *key, size_t nkey, bool *failed){
     item *it = NULL;
     DBT dbkey, dbdata;
     bool stop;
-    int ret;
+    int ret, attempt = 0;
+    int shard = bdb_shard(ns, key, nkey);
+    uint64_t gen;
+
+    if (failed != NULL)
+        *failed = false;
+
+    SHARD_STATS_INC(ns, shard, gets);
+
+    /* surely a miss? or a recent one? */
+    if (!bloom_check(ns, key, nkey) || negcache_lookup(ns, key, nkey, &gen)) {
+        return NULL;
+    }
     
     /* first, alloc a fixed size */
     it = item_alloc2(settings.item_buf_size);
     if (it == 0) {
+        if (failed != NULL)
+            *failed = true;
         return NULL;
     }
 
@@ -229,13 +283,15 @@ item *item_get(char *key, size_t nkey){
     stop = false;
     /* try to get a item from bdb */
     while (!stop) {
-        switch (ret = dbp->get(dbp, NULL, &dbkey, &dbdata, 0)) {
+        switch (ret = ns->dbps[shard]->get(ns->dbps[shard], NULL, &dbkey, &dbdata, 0)) {
         case DB_BUFFER_SMALL:    /* user mem small */
             /* free the original smaller buffer */
-            item_free(it);
+            item_free_buf(it, dbdata.ulen);
             /* alloc the correct size */
             it = item_alloc2(dbdata.size);
             if (it == NULL) {
+                if (failed != NULL)
+                    *failed = true;
                 return NULL;
             }
             dbdata.ulen = dbdata.size;
@@ -243,18 +299,32 @@ item *item_get(char *key, size_t nkey){
             break;
         case 0:                  /* Success. */
             stop = true;
+            it = item_from_record(it, &dbdata);
+            if (it == NULL) {
+                /* it is there, we just can't read it */
+                if (failed != NULL)
+                    *failed = true;
+                break;
+            }
+            warmup_touch(ns, key, nkey);
             break;
         case DB_NOTFOUND:
             stop = true;
-            item_free(it);
+            item_free_buf(it, dbdata.ulen);
             it = NULL;
+            negcache_insert(ns, key, nkey, gen);
             break;
+        case DB_LOCK_DEADLOCK:
+        case DB_LOCK_NOTGRANTED:
+            if (bdb_retry(ret, &attempt))
+                break;
+            /* fall through */
         default:
-            /* TODO: may cause bug here, if return DB_BUFFER_SMALL then retun non-zero again
-             * here 'it' may not a full one. a item buffer larger than item_buf_size may be added to freelist */
             stop = true;
-            item_free(it);
+            item_free_buf(it, dbdata.ulen);
             it = NULL;
+            if (failed != NULL)
+                *failed = true;
             if (settings.verbose > 1) {
                 fprintf(stderr, "dbp->get: %s\n", db_strerror(ret));
             }
@@ -294,7 +364,7 @@ item *item_cget(DBC *cursorp, char *start, size_t nstart, u_int32_t flags){
                 fprintf(stderr, "cursorp->get: %s\n", db_strerror(ret));
             }
             /* free the original smaller buffer */
-            item_free(it);
+            item_free_buf(it, dbdata.ulen);
             /* alloc the correct size */
             it = item_alloc2(dbdata.size);
             if (it == NULL) {
@@ -307,17 +377,16 @@ item *item_cget(DBC *cursorp, char *start, size_t nstart, u_int32_t flags){
             break;
         case 0:                  /* Success. */
             stop = true;
+            it = item_from_record(it, &dbdata);
             break;
         case DB_NOTFOUND:
             stop = true;
-            item_free(it);
+            item_free_buf(it, dbdata.ulen);
             it = NULL;
             break;
         default:
-            /* TODO: may cause bug here, if return DB_BUFFER_SMALL then retun non-zero again
-             * here 'it' may not a full one. a item buffer larger than item_buf_size may be added to freelist */
             stop = true;
-            item_free(it);
+            item_free_buf(it, dbdata.ulen);
             it = NULL;
             if (settings.verbose > 1) {
                 fprintf(stderr, "cursorp->get: %s\n", db_strerror(ret));
@@ -330,17 +399,38 @@ item *item_cget(DBC *cursorp, char *start, size_t nstart, u_int32_t flags){
 /* 0 for Success
    -1 for SERVER_ERROR
 */
-int item_put(char *key, size_t nkey, item *it){
-    int ret;
+int item_put(struct bdb_ns *ns, char *key, size_t nkey, item *it){
+    int ret, attempt = 0;
     DBT dbkey, dbdata;
+    void *zbuf = NULL;
+    size_t nzip;
+    int shard = bdb_shard(ns, key, nkey);
 
     BDB_CLEANUP_DBT();
     dbkey.data = key;
     dbkey.size = nkey;
     dbdata.data = it;
     dbdata.size = ITEM_ntotal(it);
-    ret = dbp->put(dbp, NULL, &dbkey, &dbdata, 0);
+
+    /* small values go through the trained dictionary, if it pays */
+    if (ns->dict_min_size > 0 && it->nbytes - 2 >= ns->dict_min_size &&
+        (zbuf = dict_deflate(it, &nzip)) != NULL) {
+        dbdata.data = zbuf;
+        dbdata.size = nzip;
+    }
+
+    SHARD_STATS_INC(ns, shard, puts);
+
+    do {
+        ret = ns->dbps[shard]->put(ns->dbps[shard], NULL, &dbkey, &dbdata, 0);
+    } while (bdb_retry(ret, &attempt));
+    negcache_invalidate(ns, key, nkey);
+    if (zbuf != NULL) {
+        free(zbuf);
+    }
     if (ret == 0) {
+        /* in the filter before the put is answered, see bloom.c */
+        bloom_add(ns, key, nkey);
         return 0;
     } else {
         if (settings.verbose > 1) {
@@ -354,14 +444,20 @@ int item_put(char *key, size_t nkey, item *it){
    1 for NOT_FOUND
    -1 for SERVER_ERROR
 */
-int item_delete(char *key, size_t nkey){
-    int ret;
+int item_delete(struct bdb_ns *ns, char *key, size_t nkey){
+    int ret, attempt = 0;
     DBT dbkey;
+    int shard = bdb_shard(ns, key, nkey);
     
     memset(&dbkey, 0, sizeof(dbkey));
     dbkey.data = key;
     dbkey.size = nkey;
-    ret = dbp->del(dbp, NULL, &dbkey, 0);
+
+    SHARD_STATS_INC(ns, shard, deletes);
+
+    do {
+        ret = ns->dbps[shard]->del(ns->dbps[shard], NULL, &dbkey, 0);
+    } while (bdb_retry(ret, &attempt));
     if (ret == 0){
         return 0;
     }else if(ret == DB_NOTFOUND){
@@ -378,16 +474,27 @@ int item_delete(char *key, size_t nkey){
 1 for exists
 0 for non-exist
 */
-int item_exists(char *key, size_t nkey){
+int item_exists(struct bdb_ns *ns, char *key, size_t nkey){
     int ret;
     DBT dbkey;
+    int shard = bdb_shard(ns, key, nkey);
+    uint64_t gen;
     
     memset(&dbkey, 0, sizeof(dbkey));
     dbkey.data = key;
     dbkey.size = nkey;
-    ret = dbp->exists(dbp, NULL, &dbkey, 0);
+
+    SHARD_STATS_INC(ns, shard, gets);
+
+    if (!bloom_check(ns, key, nkey) || negcache_lookup(ns, key, nkey, &gen)){
+        return 0;
+    }
+    ret = ns->dbps[shard]->exists(ns->dbps[shard], NULL, &dbkey, 0);
     if (ret == 0){
         return 1;
     }
+    if (ret == DB_NOTFOUND){
+        negcache_insert(ns, key, nkey, gen);
+    }
     return 0;
 }
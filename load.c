@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Bulk loading of the default keyspace, offline (-g).
+ *
+ *  The input is a stream of records as a set would send them, without
+ *  the command:
+ *
+ *      <key> <flags> <bytes>\r\n
+ *      <data block>\r\n
+ *
+ *  The reader hands the records to one thread per shard in batches. Each
+ *  batch is sorted, then goes into the shard through one cursor in one
+ *  transaction, so a sorted input turns into appends on the rightmost
+ *  leaf. The databases are opened DB_TXN_NOT_DURABLE for this, so nothing
+ *  is logged; they are synced once at the end instead, and a checkpoint
+ *  follows on the way out. A crash halfway can leave pages that recovery
+ *  can't fix, so only an empty keyspace is loaded, with nothing to lose.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <db.h>
+
+#define LOAD_BATCH 10000   /* records a transaction */
+#define LOAD_QUEUE 2       /* batches waiting for a shard */
+
+struct load_batch {
+    int n;
+    item *items[LOAD_BATCH];
+};
+
+struct load_shard {
+    pthread_t tid;
+    struct bdb_ns *ns;
+    DB *db;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct load_batch *queue[LOAD_QUEUE];
+    int head;
+    int count;
+    bool eof;
+    int error;              /* the first db error, the rest is skipped */
+    struct load_batch *filling;  /* the reader's */
+};
+
+static int load_cmp(const void *a, const void *b) {
+    const item *x = *(item * const *)a;
+    const item *y = *(item * const *)b;
+
+    return bdb_defcmp(ITEM_key(x), x->nkey, ITEM_key(y), y->nkey);
+}
+
+/* puts a batch into the shard, in one transaction */
+static int load_batch_put(struct load_shard *ls, struct load_batch *b) {
+    DB_TXN *txn;
+    DBC *dbc;
+    DBT dbkey, dbdata;
+    void *zbuf;
+    size_t nzip;
+    int i, ret, attempt = 0;
+
+    if (ls->ns->db_type == DB_BTREE)
+        qsort(b->items, b->n, sizeof(item *), load_cmp);
+
+    do {
+        if ((ret = env->txn_begin(env, NULL, &txn, DB_TXN_NOSYNC)) != 0)
+            return ret;
+        if ((ret = ls->db->cursor(ls->db, txn, &dbc, 0)) != 0) {
+            txn->abort(txn);
+            return ret;
+        }
+        for (i = 0; i < b->n && ret == 0; i++) {
+            item *it = b->items[i];
+
+            memset(&dbkey, 0, sizeof(dbkey));
+            memset(&dbdata, 0, sizeof(dbdata));
+            dbkey.data = ITEM_key(it);
+            dbkey.size = it->nkey;
+            dbdata.data = it;
+            dbdata.size = ITEM_ntotal(it);
+            zbuf = NULL;
+            if (ls->ns->dict_min_size > 0 && it->nbytes - 2 >= ls->ns->dict_min_size &&
+                (zbuf = dict_deflate(it, &nzip)) != NULL) {
+                dbdata.data = zbuf;
+                dbdata.size = nzip;
+            }
+            ret = dbc->put(dbc, &dbkey, &dbdata, DB_KEYLAST);
+            if (zbuf != NULL)
+                free(zbuf);
+        }
+        dbc->close(dbc);
+        if (ret == 0)
+            ret = txn->commit(txn, 0);
+        else
+            txn->abort(txn);
+    } while (bdb_retry(ret, &attempt));
+    return ret;
+}
+
+static void load_batch_free(struct load_batch *b) {
+    int i;
+
+    for (i = 0; i < b->n; i++)
+        item_free(b->items[i]);
+    free(b);
+}
+
+static void *load_thread(void *arg) {
+    struct load_shard *ls = arg;
+    struct load_batch *b;
+    int i;
+
+    affinity_storage();
+    for (;;) {
+        pthread_mutex_lock(&ls->lock);
+        while (ls->count == 0 && !ls->eof)
+            pthread_cond_wait(&ls->cond, &ls->lock);
+        if (ls->count == 0) {
+            pthread_mutex_unlock(&ls->lock);
+            break;
+        }
+        b = ls->queue[ls->head];
+        ls->head = (ls->head + 1) % LOAD_QUEUE;
+        ls->count--;
+        pthread_cond_signal(&ls->cond);
+        pthread_mutex_unlock(&ls->lock);
+
+        if (ls->error == 0 && (ls->error = load_batch_put(ls, b)) == 0) {
+            /* in the filter once in the db, as item_put() does */
+            for (i = 0; i < b->n; i++)
+                bloom_add(ls->ns, ITEM_key(b->items[i]), b->items[i]->nkey);
+        }
+        load_batch_free(b);
+    }
+    return NULL;
+}
+
+/* hands the reader's batch to the shard's thread, waiting for room */
+static void load_submit(struct load_shard *ls) {
+    pthread_mutex_lock(&ls->lock);
+    while (ls->count == LOAD_QUEUE)
+        pthread_cond_wait(&ls->cond, &ls->lock);
+    ls->queue[(ls->head + ls->count) % LOAD_QUEUE] = ls->filling;
+    ls->count++;
+    pthread_cond_signal(&ls->cond);
+    pthread_mutex_unlock(&ls->lock);
+    ls->filling = NULL;
+}
+
+/*
+ * Reads the next record from *fp* into a new item. Returns 1 for a record,
+ * 0 at the end of the input, and -1 if the input is not well formed.
+ */
+static int load_read(FILE *fp, item **itp) {
+    char line[KEY_MAX_LENGTH + 64], *key, *p, *end;
+    unsigned long flags;
+    long nbytes;
+    size_t nkey;
+    item *it;
+
+    if (fgets(line, sizeof(line), fp) == NULL)
+        return ferror(fp) ? -1 : 0;
+    if ((p = strchr(line, '\n')) == NULL)
+        return -1;
+    *p = '\0';
+    if (p > line && p[-1] == '\r')
+        p[-1] = '\0';
+
+    key = line;
+    if ((p = strchr(key, ' ')) == NULL)
+        return -1;
+    nkey = p - key;
+    *p = '\0';
+    flags = strtoul(p + 1, &end, 10);
+    if (end == p + 1 || *end != ' ')
+        return -1;
+    nbytes = strtol(end + 1, &p, 10);
+    if (p == end + 1 || *p != '\0' || nbytes < 0 || nkey == 0 || nkey > KEY_MAX_LENGTH)
+        return -1;
+
+    if ((it = item_alloc1(key, nkey, flags, nbytes + 2)) == NULL)
+        return -1;
+    if (fread(ITEM_data(it), 1, nbytes + 2, fp) != (size_t)nbytes + 2 ||
+        memcmp(ITEM_data(it) + nbytes, "\r\n", 2) != 0) {
+        item_free(it);
+        return -1;
+    }
+    *itp = it;
+    return 1;
+}
+
+/* whether any shard of *ns* has a record, or -1 on a db error */
+static int load_has_records(struct bdb_ns *ns) {
+    DBC *dbc;
+    DBT dbkey, dbdata;
+    int s, ret = DB_NOTFOUND;
+
+    for (s = 0; s < ns->nshards && ret == DB_NOTFOUND; s++) {
+        if ((ret = ns->dbps[s]->cursor(ns->dbps[s], NULL, &dbc, 0)) != 0)
+            break;
+        memset(&dbkey, 0, sizeof(dbkey));
+        memset(&dbdata, 0, sizeof(dbdata));
+        dbdata.flags = DB_DBT_PARTIAL;
+        ret = dbc->get(dbc, &dbkey, &dbdata, DB_FIRST);
+        dbc->close(dbc);
+    }
+    if (ret == DB_NOTFOUND)
+        return 0;
+    if (ret == 0)
+        return 1;
+    fprintf(stderr, "bulk load: dbc->get: %s\n", db_strerror(ret));
+    return -1;
+}
+
+/*
+ * Loads the records in the file at *path*, or stdin for "-", into the
+ * default keyspace. Returns 0, or -1 if the input or a db write failed.
+ */
+int bulk_load(const char *path) {
+    struct bdb_ns *ns = &bdb_ns[0];
+    struct load_shard *shards;
+    struct load_shard *ls;
+    FILE *fp;
+    item *it;
+    u_int64_t records = 0;
+    time_t started = time(NULL);
+    int s, ret, failed = 0;
+
+    if ((ret = load_has_records(ns)) != 0) {
+        if (ret > 0)
+            fprintf(stderr, "bulk load: %s already has records, and is only loaded when empty\n",
+                    ns->db_file);
+        return -1;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        fp = stdin;
+    } else if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "bulk load: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if ((shards = calloc(ns->nshards, sizeof(struct load_shard))) == NULL) {
+        fprintf(stderr, "bulk load: out of memory\n");
+        if (fp != stdin)
+            fclose(fp);
+        return -1;
+    }
+    for (s = 0; s < ns->nshards; s++) {
+        ls = &shards[s];
+        ls->ns = ns;
+        ls->db = ns->dbps[s];
+        pthread_mutex_init(&ls->lock, NULL);
+        pthread_cond_init(&ls->cond, NULL);
+        if ((errno = pthread_create(&ls->tid, NULL, load_thread, ls)) != 0) {
+            fprintf(stderr, "failed spawning bulk load thread: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while ((ret = load_read(fp, &it)) == 1) {
+        negcache_invalidate(ns, ITEM_key(it), it->nkey);
+
+        ls = &shards[bdb_shard(ns, ITEM_key(it), it->nkey)];
+        if (ls->filling == NULL && (ls->filling = calloc(1, sizeof(struct load_batch))) == NULL) {
+            item_free(it);
+            ret = -1;
+            break;
+        }
+        ls->filling->items[ls->filling->n++] = it;
+        if (ls->filling->n == LOAD_BATCH)
+            load_submit(ls);
+
+        if (++records % 1000000 == 0 && settings.verbose > 0)
+            fprintf(stderr, "bulk load: %llu records\n", (unsigned long long)records);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "bulk load: bad record after %llu records\n",
+                (unsigned long long)records);
+        failed = 1;
+    }
+    if (fp != stdin)
+        fclose(fp);
+
+    for (s = 0; s < ns->nshards; s++) {
+        ls = &shards[s];
+        if (ls->filling != NULL)
+            load_submit(ls);
+        pthread_mutex_lock(&ls->lock);
+        ls->eof = true;
+        pthread_cond_signal(&ls->cond);
+        pthread_mutex_unlock(&ls->lock);
+    }
+    for (s = 0; s < ns->nshards; s++) {
+        ls = &shards[s];
+        pthread_join(ls->tid, NULL);
+        if (ls->error != 0) {
+            fprintf(stderr, "bulk load: shard %d: %s\n", s, db_strerror(ls->error));
+            failed = 1;
+        }
+        /* nothing was logged, so this is what makes it durable */
+        if ((ret = ls->db->sync(ls->db, 0)) != 0) {
+            fprintf(stderr, "bulk load: dbp->sync: %s\n", db_strerror(ret));
+            failed = 1;
+        }
+        pthread_mutex_destroy(&ls->lock);
+        pthread_cond_destroy(&ls->cond);
+    }
+    free(shards);
+
+    fprintf(stderr, "bulk load: %llu records in %ld seconds%s\n",
+            (unsigned long long)records, (long)(time(NULL) - started),
+            failed ? ", with errors" : "");
+    return failed ? -1 : 0;
+}
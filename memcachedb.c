@@ -46,6 +46,8 @@
 #include <time.h>
 #include <assert.h>
 #include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #ifdef HAVE_MALLOC_H
 /* OpenBSD has a malloc.h, but warns to use stdlib.h instead */
@@ -89,7 +91,7 @@ static void conn_init(void);
 static void accept_new_conns(const bool do_accept);
 static bool update_event(conn *c, const int new_flags);
 static void complete_nread(conn *c);
-static void process_command(conn *c, char *command);
+static void process_command(conn *c, char *command, size_t ncommand);
 static int transmit(conn *c);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
@@ -104,7 +106,6 @@ struct settings settings;
 struct bdb_settings bdb_settings;
 struct bdb_version bdb_version;
 DB_ENV *env;
-DB *dbp;
 
 int daemon_quit = 0;
 
@@ -112,6 +113,20 @@ int daemon_quit = 0;
 static conn *listen_conn = NULL;
 static struct event_base *main_base;
 
+/* every listening socket, to hand over to the next process */
+static int listen_fds[HANDOFF_MAX_FDS];
+static int nlisten_fds = 0;
+
+/* every conn, and how many of them are clients, for draining */
+static conn *all_conns = NULL;
+static int nclient_conns = 0;
+static pthread_mutex_t all_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool draining = false;
+static time_t drain_deadline;
+
+/* seconds a drain waits for busy clients before giving up on them */
+#define DRAIN_TIMEOUT 30
+
 #define TRANSMIT_COMPLETE   0
 #define TRANSMIT_INCOMPLETE 1
 #define TRANSMIT_SOFT_ERROR 2
@@ -121,6 +136,7 @@ static void stats_init(void) {
     stats.curr_conns = stats.total_conns = stats.conn_structs = 0;
     stats.get_cmds = stats.set_cmds = stats.get_hits = stats.get_misses = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    stats.deadlocks = stats.deadlock_retries = stats.deadlock_failures = 0;
 
     /* make the time we started always be 2 seconds before we really
        did, so time(0) - time.started is never zero.  if so, things
@@ -130,11 +146,17 @@ static void stats_init(void) {
 }
 
 static void stats_reset(void) {
+    int i;
+
     STATS_LOCK();
     stats.total_conns = 0;
     stats.get_cmds = stats.set_cmds = stats.get_hits = stats.get_misses = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    stats.deadlocks = stats.deadlock_retries = stats.deadlock_failures = 0;
+    for (i = 0; i < bdb_nns; i++)
+        memset(bdb_ns[i].stats, 0, sizeof(bdb_ns[i].stats));
     STATS_UNLOCK();
+    negcache_stats_reset();
 }
 
 static void settings_init(void) {
@@ -152,6 +174,12 @@ static void settings_init(void) {
 #else
     settings.num_threads = 1;
 #endif
+    settings.num_storage_threads = 0; /* db calls run on the libevent threads */
+    settings.reuseport = false;       /* main thread accepts and hands out */
+    settings.use_uring = false;
+    settings.status_port = 0;         /* no status port */
+    settings.read_only_until_ready = false;
+    settings.takeover = false;
 }
 
 /*
@@ -206,6 +234,18 @@ static conn **freeconns;
 static int freetotal;
 static int freecurr;
 
+/*
+ * Read buffers of TCP conns, DATA_BUFFER_SIZE bytes each. A conn only holds
+ * one while it has input to parse, and gives it back here when it goes
+ * idle, so idle conns cost no read buffer.
+ */
+static char **freerbufs;
+static int freerbuftotal;
+static int freerbufcurr;
+
+/* buffers the freelist keeps at most, past a burst the rest go back to malloc */
+#define RBUF_FREELIST_HIGHWAT 1024
+
 
 static void conn_init(void) {
     freetotal = 200;
@@ -213,6 +253,11 @@ static void conn_init(void) {
     if ((freeconns = (conn **)malloc(sizeof(conn *) * freetotal)) == NULL) {
         fprintf(stderr, "malloc()\n");
     }
+    freerbuftotal = 200;
+    freerbufcurr = 0;
+    if ((freerbufs = (char **)malloc(sizeof(char *) * freerbuftotal)) == NULL) {
+        fprintf(stderr, "malloc()\n");
+    }
     return;
 }
 
@@ -253,9 +298,84 @@ bool do_conn_add_to_freelist(conn *c) {
     return true;
 }
 
+/*
+ * Returns a read buffer from the freelist, or a new one if it is empty.
+ * Should call this using rbuf_from_freelist() for thread safety.
+ */
+char *do_rbuf_from_freelist(void) {
+    if (freerbufcurr > 0)
+        return freerbufs[--freerbufcurr];
+    return (char *)malloc(DATA_BUFFER_SIZE);
+}
+
+/*
+ * Takes up to *n* read buffers off the freelist. Should be called under
+ * the same lock as do_rbuf_from_freelist.
+ */
+int do_rbuf_take_from_freelist(char **bufs, int n) {
+    int i;
+
+    for (i = 0; i < n && freerbufcurr > 0; i++)
+        bufs[i] = freerbufs[--freerbufcurr];
+    return i;
+}
+
+/*
+ * Adds a read buffer to the freelist. 0 = success. Should call this using
+ * rbuf_add_to_freelist() for thread safety.
+ */
+bool do_rbuf_add_to_freelist(char *buf) {
+    if (freerbufcurr >= RBUF_FREELIST_HIGHWAT) {
+        return true;
+    } else if (freerbufcurr < freerbuftotal) {
+        freerbufs[freerbufcurr++] = buf;
+        return false;
+    } else {
+        /* try to enlarge free read buffers array */
+        char **new_freerbufs = realloc(freerbufs, sizeof(char *) * freerbuftotal * 2);
+        if (new_freerbufs) {
+            freerbuftotal *= 2;
+            freerbufs = new_freerbufs;
+            freerbufs[freerbufcurr++] = buf;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Gives a TCP conn a read buffer, if it has none.
+ *
+ * Returns false on out-of-memory.
+ */
+static bool conn_rbuf_get(conn *c) {
+    if (c->rbuf != NULL)
+        return true;
+    if ((c->rbuf = rbuf_from_freelist()) == NULL)
+        return false;
+    c->rcurr = c->rbuf;
+    c->rsize = DATA_BUFFER_SIZE;
+    c->rbytes = 0;
+    return true;
+}
+
+/*
+ * Takes a conn's read buffer away, along with anything left in it. One
+ * that grew past DATA_BUFFER_SIZE isn't kept.
+ */
+static void conn_rbuf_put(conn *c) {
+    if (c->rbuf == NULL)
+        return;
+    if (c->rsize != DATA_BUFFER_SIZE || rbuf_add_to_freelist(c->rbuf))
+        free(c->rbuf);
+    c->rbuf = c->rcurr = NULL;
+    c->rsize = c->rbytes = 0;
+}
+
 conn *conn_new(const int sfd, const int init_state, const int event_flags,
                 const int read_buffer_size, const bool is_udp, struct event_base *base) {
-    conn *c = conn_from_freelist();
+    /* with pinned workers, a fresh conn is allocated on this thread's node */
+    conn *c = affinity_workers_pinned() ? NULL : conn_from_freelist();
 
     if (NULL == c) {
         if (!(c = (conn *)calloc(1, sizeof(conn)))) {
@@ -267,21 +387,25 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
         c->iov = 0;
         c->msglist = 0;
         c->hdrbuf = 0;
+        c->udp_batch = NULL;
+        c->udp_unbatched = false;
 
-        c->rsize = read_buffer_size;
+        /* TCP conns take a read buffer when there is something to read */
+        c->rsize = is_udp ? read_buffer_size : 0;
         c->wsize = DATA_BUFFER_SIZE;
         c->isize = ITEM_LIST_INITIAL;
         c->iovsize = IOV_LIST_INITIAL;
         c->msgsize = MSG_LIST_INITIAL;
         c->hdrsize = 0;
 
-        c->rbuf = (char *)malloc((size_t)c->rsize);
+        if (is_udp)
+            c->rbuf = (char *)malloc((size_t)c->rsize);
         c->wbuf = (char *)malloc((size_t)c->wsize);
         c->ilist = (item **)malloc(sizeof(item *) * c->isize);
         c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
         c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
 
-        if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
+        if ((is_udp && c->rbuf == 0) || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
                 c->msglist == 0) {
             conn_free(c);
             fprintf(stderr, "malloc()\n");
@@ -306,25 +430,41 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
     c->udp = is_udp;
     c->state = init_state;
     c->rlbytes = 0;
-    c->rbytes = c->wbytes = 0;
+    c->rbytes = c->wbytes = c->wused = 0;
     c->wcurr = c->wbuf;
     c->rcurr = c->rbuf;
     c->ritem = 0;
     c->icurr = c->ilist;
     c->ileft = 0;
     c->iovused = 0;
+    c->iovmark = 0;
     c->msgcurr = 0;
     c->msgused = 0;
+    c->replies_queued = c->replies_sending = false;
 
     c->write_and_go = conn_read;
     c->write_and_free = 0;
     c->item = 0;
-
-    event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
+    c->ns = &bdb_ns[0];
+
+    c->uring = NULL;
+    c->uring_rhead = c->uring_rtail = -1;
+    c->uring_rcount = 0;
+    c->uring_rerr = 0;
+    c->uring_armed = c->uring_sending = c->uring_starved = c->uring_paused = false;
+    c->uring_closing = false;
+    c->uring_next = NULL;
+    if (settings.use_uring && !is_udp && init_state == conn_read)
+        uring_conn_attach(c, base);
+
+    /* reads of a conn on io_uring are signalled by uring.c, not libevent */
+    event_set(&c->event, sfd, c->uring ? event_flags & ~EV_READ : event_flags,
+              event_handler, (void *)c);
     event_base_set(base, &c->event);
     c->ev_flags = event_flags;
 
     if (event_add(&c->event, 0) == -1) {
+        uring_conn_close(c);
         if (conn_add_to_freelist(c)) {
             conn_free(c);
         }
@@ -332,6 +472,16 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
         return NULL;
     }
 
+    pthread_mutex_lock(&all_conns_lock);
+    c->all_prev = NULL;
+    c->all_next = all_conns;
+    if (all_conns != NULL)
+        all_conns->all_prev = c;
+    all_conns = c;
+    if (!is_udp && init_state != conn_listening)
+        nclient_conns++;
+    pthread_mutex_unlock(&all_conns_lock);
+
     STATS_LOCK();
     stats.curr_conns++;
     stats.total_conns++;
@@ -358,6 +508,10 @@ static void conn_cleanup(conn *c) {
         free(c->write_and_free);
         c->write_and_free = 0;
     }
+
+    c->wused = 0;
+    c->iovmark = 0;
+    c->replies_queued = c->replies_sending = false;
 }
 
 /*
@@ -367,6 +521,7 @@ void conn_free(conn *c) {
     if (c) {
         if (c->hdrbuf)
             free(c->hdrbuf);
+        udp_batch_free(c);
         if (c->msglist)
             free(c->msglist);
         if (c->rbuf)
@@ -390,12 +545,35 @@ static void conn_close(conn *c) {
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
 
+    pthread_mutex_lock(&all_conns_lock);
+    if (c->all_prev != NULL)
+        c->all_prev->all_next = c->all_next;
+    else
+        all_conns = c->all_next;
+    if (c->all_next != NULL)
+        c->all_next->all_prev = c->all_prev;
+    if (!c->udp && c->state != conn_listening)
+        nclient_conns--;
+    pthread_mutex_unlock(&all_conns_lock);
+
+    /* a send io_uring has in flight still reads the conn's buffers */
+    if (uring_conn_close(c))
+        return;
+    conn_close_done(c);
+}
+
+/*
+ * Closes the socket and frees or recycles the conn, once nothing is in
+ * flight for it.
+ */
+void conn_close_done(conn *c) {
     close(c->sfd);
     accept_new_conns(true);
     conn_cleanup(c);
+    conn_rbuf_put(c);
 
-    /* if the connection has big buffers, just free it */
-    if (c->rsize > READ_BUFFER_HIGHWAT || conn_add_to_freelist(c)) {
+    /* if pinned workers won't reuse the conn from another node, just free it */
+    if (affinity_workers_pinned() || conn_add_to_freelist(c)) {
         conn_free(c);
     }
 
@@ -463,6 +641,14 @@ static void conn_shrink(conn *c) {
         }
     /* TODO check return value */
     }
+
+    if (c->wsize > DATA_BUFFER_SIZE && c->wused == 0) {
+        char *newbuf = (char *)realloc((void *)c->wbuf, DATA_BUFFER_SIZE);
+        if (newbuf) {
+            c->wbuf = newbuf;
+            c->wsize = DATA_BUFFER_SIZE;
+        }
+    }
 }
 
 /*
@@ -608,6 +794,32 @@ static int build_udp_headers(conn *c) {
 }
 
 
+/*
+ * Makes room in wbuf for *need* more bytes behind the queued replies. The
+ * iovecs that point into wbuf are moved along with it.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int grow_wbuf(conn *c, int need) {
+    char *newbuf;
+    int size = c->wsize, i;
+
+    while (c->wused + need > size)
+        size *= 2;
+    if (! (newbuf = (char *)malloc((size_t)size)))
+        return -1;
+    memcpy(newbuf, c->wbuf, c->wused);
+    for (i = 0; i < c->iovused; i++) {
+        char *base = (char *)c->iov[i].iov_base;
+        if (base >= c->wbuf && base < c->wbuf + c->wused)
+            c->iov[i].iov_base = newbuf + (base - c->wbuf);
+    }
+    free(c->wbuf);
+    c->wbuf = newbuf;
+    c->wsize = size;
+    return 0;
+}
+
 static void out_string(conn *c, const char *str) {
     size_t len;
 
@@ -617,16 +829,24 @@ static void out_string(conn *c, const char *str) {
         fprintf(stderr, ">%d %s\n", c->sfd, str);
 
     len = strlen(str);
-    if ((len + 2) > c->wsize) {
+    if ((len + 2) > DATA_BUFFER_SIZE) {
         /* ought to be always enough. just fail for simplicity */
         str = "SERVER_ERROR output line too long";
         len = strlen(str);
     }
+    if (c->wused + len + 2 > c->wsize && grow_wbuf(c, len + 2) != 0) {
+        str = "SERVER_ERROR out of memory writing response";
+        len = strlen(str);
+        if (c->wused + len + 2 > c->wsize) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+    }
 
-    memcpy(c->wbuf, str, len);
-    memcpy(c->wbuf + len, "\r\n", 2);
+    c->wcurr = c->wbuf + c->wused;
+    memcpy(c->wcurr, str, len);
+    memcpy(c->wcurr + len, "\r\n", 2);
     c->wbytes = len + 2;
-    c->wcurr = c->wbuf;
 
     conn_set_state(c, conn_write);
     c->write_and_go = conn_read;
@@ -652,7 +872,7 @@ static void complete_nread(conn *c) {
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
         out_string(c, "CLIENT_ERROR bad data chunk");
     } else {
-      ret = store_item(it, comm);
+      ret = store_item(c->ns, it, comm);
       if (ret == 1)
           out_string(c, "STORED");
       else if(ret == 2)
@@ -673,7 +893,7 @@ static void complete_nread(conn *c) {
  *
  * Returns true if the item was stored.
  */
-int do_store_item(item *it, int comm) {
+int do_store_item(struct bdb_ns *ns, item *it, int comm) {
     char *key = ITEM_key(it);
     int ret;
     item *old_it = NULL;
@@ -682,14 +902,14 @@ int do_store_item(item *it, int comm) {
     int flags;
 
     if (comm == NREAD_ADD || comm == NREAD_REPLACE) {
-        ret = item_exists(key, strlen(key));
+        ret = item_exists(ns, key, strlen(key));
         if ((ret == 0 && comm == NREAD_REPLACE) ||
             (ret == 1 && comm == NREAD_ADD) ){
                return 0;
         }
     } else if (comm == NREAD_APPEND || comm == NREAD_PREPEND){
         /* get orignal item */
-        old_it = item_get(key, strlen(key));
+        old_it = item_get(ns, key, strlen(key), NULL);
         if (old_it == NULL){
             return 0;
         }
@@ -718,7 +938,7 @@ int do_store_item(item *it, int comm) {
         it = new_it;
     }
         
-    ret = item_put(key, strlen(key), it);
+    ret = item_put(ns, key, strlen(key), it);
     
     if (old_it != NULL)
         item_free(old_it);
@@ -740,16 +960,17 @@ typedef struct token_s {
 #define COMMAND_TOKEN 0
 #define SUBCOMMAND_TOKEN 1
 #define KEY_TOKEN 1
-#define KEY_MAX_LENGTH 250
 
-#define MAX_TOKENS 8
+/* enough for a get of 22 keys in one pass */
+#define MAX_TOKENS 24
 
 /*
- * Tokenize the command string by replacing whitespace with '\0' and update
- * the token array tokens with pointer to start of each token and length.
- * Returns total number of tokens.  The last valid token is the terminal
- * token (value points to the first unprocessed character of the string and
- * length zero).
+ * Tokenize the command string of *len* bytes by replacing whitespace with
+ * '\0' and update the token array tokens with pointer to start of each
+ * token and length. The spaces are found with memchr(), which libc scans
+ * for a word or a vector at a time. Returns total number of tokens. The
+ * last valid token is the terminal token (value points to the first
+ * unprocessed character of the string and length zero).
  *
  * Usage example:
  *
@@ -757,48 +978,124 @@ typedef struct token_s {
  *      for(int ix = 0; tokens[ix].length != 0; ix++) {
  *          ...
  *      }
- *      ncommand = tokens[ix].value - command;
+ *      ncommand -= tokens[ix].value - command;
  *      command  = tokens[ix].value;
  *   }
  */
-static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
-    char *s, *e;
+static size_t tokenize_command(char *command, size_t len, token_t *tokens, const size_t max_tokens) {
+    char *s = command, *e, *end = command + len;
     size_t ntokens = 0;
 
     assert(command != NULL && tokens != NULL && max_tokens > 1);
 
-    for (s = e = command; ntokens < max_tokens - 1; ++e) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-            }
-            s = e + 1;
-        }
-        else if (*e == '\0') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-            }
-
-            break; /* string end */
-        }
+    while (ntokens < max_tokens - 1) {
+        while (s < end && *s == ' ')
+            s++;
+        if (s == end)
+            break;
+        if ((e = memchr(s, ' ', end - s)) == NULL)
+            e = end;
+        tokens[ntokens].value = s;
+        tokens[ntokens].length = e - s;
+        ntokens++;
+        *e = '\0';
+        s = (e == end) ? end : e + 1;
     }
+    while (s < end && *s == ' ')
+        s++;
 
     /*
      * If we scanned the whole string, the terminal value pointer is null,
      * otherwise it is the first unprocessed character.
      */
-    tokens[ntokens].value =  *e == '\0' ? NULL : e;
+    tokens[ntokens].value = s < end ? s : NULL;
     tokens[ntokens].length = 0;
     ntokens++;
 
     return ntokens;
 }
 
+/*
+ * The command verbs, told apart by length and then a byte or two, so a
+ * command costs one memcmp() to identify.
+ */
+enum command_verb {
+    VERB_UNKNOWN,
+    VERB_GET, VERB_ADD, VERB_SET, VERB_REPLACE, VERB_PREPEND, VERB_APPEND,
+    VERB_RGET, VERB_INCR, VERB_DECR, VERB_DELETE, VERB_STATS, VERB_FLUSH_ALL,
+    VERB_VERSION, VERB_QUIT, VERB_VERBOSITY, VERB_USE,
+    VERB_REP_SET_ACK_POLICY, VERB_REP_SET_PRIORITY,
+    VERB_DB_ARCHIVE, VERB_DB_CHECKPOINT, VERB_DB_COMPACT, VERB_DB_DICT_TRAIN,
+    VERB_DB_BACKUP, VERB_DB_DUMP
+};
+
+#define VERB(str, verb) (memcmp(s, str, sizeof(str) - 1) == 0 ? (verb) : VERB_UNKNOWN)
+
+static enum command_verb command_verb(const token_t *token) {
+    const char *s = token->value;
+
+    switch (token->length) {
+    case 3:
+        switch (s[0]) {
+        case 'g': return VERB("get", VERB_GET);
+        case 's': return VERB("set", VERB_SET);
+        case 'a': return VERB("add", VERB_ADD);
+        case 'u': return VERB("use", VERB_USE);
+        }
+        break;
+    case 4:
+        switch (s[0]) {
+        case 'i': return VERB("incr", VERB_INCR);
+        case 'd': return VERB("decr", VERB_DECR);
+        case 'r': return VERB("rget", VERB_RGET);
+        case 'q': return VERB("quit", VERB_QUIT);
+        }
+        break;
+    case 5:
+        return VERB("stats", VERB_STATS);
+    case 6:
+        switch (s[0]) {
+        case 'd': return VERB("delete", VERB_DELETE);
+        case 'a': return VERB("append", VERB_APPEND);
+        }
+        break;
+    case 7:
+        switch (s[0]) {
+        case 'r': return VERB("replace", VERB_REPLACE);
+        case 'p': return VERB("prepend", VERB_PREPEND);
+        case 'v': return VERB("version", VERB_VERSION);
+        case 'd': return VERB("db_dump", VERB_DB_DUMP);
+        }
+        break;
+    case 9:
+        switch (s[0]) {
+        case 'v': return VERB("verbosity", VERB_VERBOSITY);
+        case 'f': return VERB("flush_all", VERB_FLUSH_ALL);
+        case 'd': return VERB("db_backup", VERB_DB_BACKUP);
+        }
+        break;
+    case 10:
+        switch (s[3]) {
+        case 'a': return VERB("db_archive", VERB_DB_ARCHIVE);
+        case 'c': return VERB("db_compact", VERB_DB_COMPACT);
+        }
+        break;
+    case 13:
+        switch (s[3]) {
+        case 'c': return VERB("db_checkpoint", VERB_DB_CHECKPOINT);
+        case 'd': return VERB("db_dict_train", VERB_DB_DICT_TRAIN);
+        }
+        break;
+    case 16:
+        return VERB("rep_set_priority", VERB_REP_SET_PRIORITY);
+    case 18:
+        return VERB("rep_set_ack_policy", VERB_REP_SET_ACK_POLICY);
+    }
+    return VERB_UNKNOWN;
+}
+
+#undef VERB
+
 /* set up a connection to write a buffer then free it, used for stats */
 static void write_and_free(conn *c, char *buf, int bytes) {
     if (buf) {
@@ -830,12 +1127,15 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         char temp[1024];
         pid_t pid = getpid();
         char *pos = temp;
+        uint64_t neg_lookups, neg_hits, neg_inserts;
 
 #ifndef WIN32
         struct rusage usage;
         getrusage(RUSAGE_SELF, &usage);
 #endif /* !WIN32 */
 
+        negcache_stats(&neg_lookups, &neg_hits, &neg_inserts);
+
         STATS_LOCK();
         pos += sprintf(pos, "STAT pid %ld\r\n", (long)pid);
         pos += sprintf(pos, "STAT uptime %"PRIuS"\r\n", now - stats.started);
@@ -854,9 +1154,14 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         pos += sprintf(pos, "STAT cmd_set %"PRIu64"\r\n", stats.set_cmds);
         pos += sprintf(pos, "STAT get_hits %"PRIu64"\r\n", stats.get_hits);
         pos += sprintf(pos, "STAT get_misses %"PRIu64"\r\n", stats.get_misses);
+        pos += sprintf(pos, "STAT negcache_lookups %"PRIu64"\r\n", neg_lookups);
+        pos += sprintf(pos, "STAT negcache_hits %"PRIu64"\r\n", neg_hits);
+        pos += sprintf(pos, "STAT negcache_inserts %"PRIu64"\r\n", neg_inserts);
         pos += sprintf(pos, "STAT bytes_read %"PRIu64"\r\n", stats.bytes_read);
         pos += sprintf(pos, "STAT bytes_written %"PRIu64"\r\n", stats.bytes_written);
         pos += sprintf(pos, "STAT threads %d\r\n", settings.num_threads);
+        pos += sprintf(pos, "STAT storage_threads %d\r\n", settings.num_storage_threads);
+        pos += sprintf(pos, "STAT io_uring_threads %d\r\n", uring_count());
         pos += sprintf(pos, "END");
         STATS_UNLOCK();
         out_string(c, temp);
@@ -873,11 +1178,100 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
 
     /* for bdb stats */
     if (strcmp(subcommand, "bdb") == 0) {
-        char temp[512];
+        char temp[2048];
         stats_bdb(temp);
         out_string(c, temp);
         return;
     }
+
+    /* for memp_trickle stats */
+    if (strcmp(subcommand, "trickle") == 0) {
+        char temp[512];
+        stats_trickle(temp);
+        out_string(c, temp);
+        return;
+    }
+
+    /* for background compaction stats */
+    if (strcmp(subcommand, "compact") == 0) {
+        char temp[1024];
+        stats_compact(temp);
+        out_string(c, temp);
+        return;
+    }
+
+    /* for hot backup stats */
+    if (strcmp(subcommand, "backup") == 0) {
+        char temp[1024];
+        stats_backup(temp);
+        out_string(c, temp);
+        return;
+    }
+
+    /* for startup progress */
+    if (strcmp(subcommand, "startup") == 0) {
+        char temp[1024];
+        stats_startup(temp);
+        out_string(c, temp);
+        return;
+    }
+
+    /* for cache warm-up stats */
+    if (strcmp(subcommand, "warmup") == 0) {
+        char temp[1024];
+        stats_warmup(temp);
+        out_string(c, temp);
+        return;
+    }
+
+    /* for parallel dump stats */
+    if (strcmp(subcommand, "dump") == 0) {
+        char temp[1024];
+        stats_dump(temp);
+        out_string(c, temp);
+        return;
+    }
+
+    /* for per shard stats, one line a shard */
+    if (strcmp(subcommand, "shards") == 0) {
+        char *temp = malloc(64 + c->ns->nshards * 96);
+        if (temp != NULL) {
+            stats_shards(temp, c->ns);
+            strcat(temp, "\r\n");
+        }
+        write_and_free(c, temp, temp != NULL ? strlen(temp) : 0);
+        return;
+    }
+
+    /* for keyspace stats, one line a namespace */
+    if (strcmp(subcommand, "ns") == 0) {
+        char *temp = malloc(64 + bdb_nns * (NS_NAME_LENGTH * 2 + 96));
+        if (temp != NULL) {
+            stats_ns(temp);
+            strcat(temp, "\r\n");
+        }
+        write_and_free(c, temp, temp != NULL ? strlen(temp) : 0);
+        return;
+    }
+
+    /* for key filter stats */
+    if (strcmp(subcommand, "bloom") == 0) {
+        char *temp = malloc(128 + bdb_nns * (NS_NAME_LENGTH + 96));
+        if (temp != NULL) {
+            stats_bloom(temp);
+            strcat(temp, "\r\n");
+        }
+        write_and_free(c, temp, temp != NULL ? strlen(temp) : 0);
+        return;
+    }
+
+    /* for dictionary compression stats */
+    if (strcmp(subcommand, "dict") == 0) {
+        char temp[512];
+        stats_dict(temp);
+        out_string(c, temp);
+        return;
+    }
     
     /* for replication stats */
     if (bdb_settings.is_replicated){
@@ -910,20 +1304,22 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
     out_string(c, "ERROR");
 }
 
-/* ntokens is overwritten here... shrug.. */
+/* ntokens is overwritten when the keys didn't fit in one tokenizing pass */
 static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens) {
     char *key;
     size_t nkey;
-    int i = 0;
+    int i = c->ileft; /* items of replies queued ahead of this one */
     item *it = NULL;
     token_t *key_token = &tokens[KEY_TOKEN];
     int stats_get_cmds   = 0;
     int stats_get_hits   = 0;
     int stats_get_misses = 0;
+    bool failed = false;
     assert(c != NULL);
 
     do {
-        while(key_token->length != 0) {
+        /* the last token is the terminator, not a key */
+        while(key_token < &tokens[ntokens - 1]) {
 
             key = key_token->value;
             nkey = key_token->length;
@@ -940,7 +1336,10 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
 
             stats_get_cmds++;
             
-            it = item_get(key, nkey);
+            it = item_get(c->ns, key, nkey, &failed);
+            if (failed) {
+                break;
+            }
 
             if (it) {
                 if (i >= c->isize) {
@@ -990,12 +1389,13 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
          * If the command string hasn't been fully processed, get the next set
          * of tokens.
          */
-        if(key_token->value != NULL) {
-            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
+        if(key_token->value != NULL && !failed) {
+            ntokens = tokenize_command(key_token->value, strlen(key_token->value),
+                                       tokens, MAX_TOKENS);
             key_token = tokens;
         }
 
-    } while(key_token->value != NULL);
+    } while(key_token->value != NULL && !failed);
 
     c->icurr = c->ilist;
     c->ileft = i;
@@ -1008,7 +1408,11 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
         reliable to add END\r\n to the buffer, because it might not end
         in \r\n. So we send SERVER_ERROR instead.
     */
-    if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0
+    if (failed) {
+        /* a stored value we can't read is not a miss */
+        out_string(c, "SERVER_ERROR failed to read a stored value");
+    }
+    else if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0
         || (c->udp && build_udp_headers(c) != 0)) {
         out_string(c, "SERVER_ERROR out of memory writing get response");
     }
@@ -1026,6 +1430,26 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
     return;
 }
 
+/* pop the smallest key off the shards' cursors, so rget sees one ordered keyspace */
+static item *rget_next(item **heads, DBC **cursors, int nshards) {
+    item *it;
+    int s, min = -1;
+
+    for (s = 0; s < nshards; s++) {
+        if (heads[s] == NULL)
+            continue;
+        if (min < 0 || bdb_defcmp(ITEM_key(heads[s]), heads[s]->nkey,
+                                  ITEM_key(heads[min]), heads[min]->nkey) < 0)
+            min = s;
+    }
+    if (min < 0)
+        return NULL;
+
+    it = heads[min];
+    heads[min] = item_cget(cursors[min], NULL, 0, DB_NEXT);
+    return it;
+}
+
 static inline void process_rget_command(conn *c, token_t *tokens, size_t ntokens) {
     char *start;
     size_t nstart;
@@ -1036,9 +1460,13 @@ static inline void process_rget_command(conn *c, token_t *tokens, size_t ntokens
     uint32_t max_items;
     
     DB_TXN *txn = NULL;
-    DBC *cursorp = NULL;
+    DBC *cursors[MAX_DB_SHARDS];
+    item *heads[MAX_DB_SHARDS];
+    DB **dbps = c->ns->dbps;
+    int nshards = c->ns->nshards;
+    int s;
     
-    int i = 0;
+    int i = c->ileft; /* items of replies queued ahead of this one */
     int ret = 0;
     item *it = NULL;
     bool is_left_checked = false;
@@ -1072,15 +1500,29 @@ static inline void process_rget_command(conn *c, token_t *tokens, size_t ntokens
         return;
     }
     
-    /* Get a cursor, we use 2 degree isolation */
-    ret = dbp->cursor(dbp, txn, &cursorp, DB_READ_COMMITTED); 
-    if (ret != 0) {
-        fprintf(stderr, "dbp->cursor: %s\n", db_strerror(ret));
-        out_string(c, "SERVER_ERROR dbp->cursor");
+    /* Get a cursor per shard, we use 2 degree isolation */
+    memset(cursors, 0, sizeof(DBC *) * nshards);
+    memset(heads, 0, sizeof(item *) * nshards);
+    for (s = 0; s < nshards; s++) {
+        ret = dbps[s]->cursor(dbps[s], txn, &cursors[s], DB_READ_COMMITTED); 
+        if (ret != 0) {
+            fprintf(stderr, "dbp->cursor: %s\n", db_strerror(ret));
+            out_string(c, "SERVER_ERROR dbp->cursor");
+            break;
+        }
+        heads[s] = item_cget(cursors[s], start, nstart, DB_SET_RANGE);
+    }
+    if (s < nshards) {
+        while (s-- > 0) {
+            if (heads[s] != NULL)
+                item_free(heads[s]);
+            cursors[s]->close(cursors[s]);
+        }
+        txn->abort(txn);
         return;
     }
     
-    it = item_cget(cursorp, start, nstart, DB_SET_RANGE);
+    it = rget_next(heads, cursors, nshards);
 
     while(it) {
         /* skip first item? */
@@ -1089,7 +1531,7 @@ static inline void process_rget_command(conn *c, token_t *tokens, size_t ntokens
             item_free(it);
             it = NULL;
             is_left_checked = true;
-            it = item_cget(cursorp, NULL, 0, DB_NEXT);
+            it = rget_next(heads, cursors, nshards);
             continue;
         }
     
@@ -1137,15 +1579,18 @@ static inline void process_rget_command(conn *c, token_t *tokens, size_t ntokens
         *(c->ilist + i) = it;
         i++;
         /* got enough? */
-        if (i == max_items){
+        if (i - c->ileft == max_items){
             break;
         }
         /* move to the next item */    
-        it = item_cget(cursorp, NULL, 0, DB_NEXT);
+        it = rget_next(heads, cursors, nshards);
     }
     
-    if (cursorp != NULL){
-        cursorp->close(cursorp);
+    for (s = 0; s < nshards; s++) {
+        if (heads[s] != NULL){
+            item_free(heads[s]);
+        }
+        cursors[s]->close(cursors[s]);
     }
 
     /* txn commit */
@@ -1205,6 +1650,13 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         return;
     }
 
+    if (!startup_writable()) {
+        out_string(c, "SERVER_ERROR not ready, read only");
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen + 2;
+        return;
+    }
+
     it = item_alloc1(key, nkey, flags, vlen+2);
 
     if (it == NULL) {
@@ -1235,6 +1687,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         return;
     }
 
+    if (!startup_writable()) {
+        out_string(c, "SERVER_ERROR not ready, read only");
+        return;
+    }
+
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
 
@@ -1245,7 +1702,7 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         return;
     }
 
-    out_string(c, add_delta(incr, delta, temp, key, nkey));
+    out_string(c, add_delta(c->ns, incr, delta, temp, key, nkey));
 }
 
 /*
@@ -1258,17 +1715,18 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
  *
  * returns a response string to send back to the client.
  */
-char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey) {
+char *do_add_delta(struct bdb_ns *ns, const bool incr, const int64_t delta, char *buf, char *key, size_t nkey) {
     char *ptr;
     int64_t value;
     int vlen, flags, ret;
     item *old_it = NULL;
     item *new_it = NULL;
+    bool failed;
 
     /* get orignal item */
-    old_it = item_get(key, nkey);
+    old_it = item_get(ns, key, nkey, &failed);
     if (old_it == NULL){
-        return "NOT_FOUND";
+        return failed ? "SERVER_ERROR failed to read the stored value" : "NOT_FOUND";
     }
 
     /* get orignal digital value */
@@ -1304,7 +1762,7 @@ char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, s
     memcpy(ITEM_data(new_it) + vlen, "\r\n", 2);
     
     /* put new item into storage */
-    ret = item_put(key, nkey, new_it);
+    ret = item_put(ns, key, nkey, new_it);
 
     if (old_it != NULL)
         item_free(old_it);
@@ -1328,7 +1786,11 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
-    switch (ret = item_delete(key, nkey)) {
+    if (!startup_writable()) {
+        out_string(c, "SERVER_ERROR not ready, read only");
+        return;
+    }
+    switch (ret = item_delete(c->ns, key, nkey)) {
     case 0:
         out_string(c, "DELETED");
         break;
@@ -1344,6 +1806,22 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     return;
 }
 
+/* switch the connection to another keyspace */
+static void process_use_command(conn *c, token_t *tokens, const size_t ntokens) {
+    struct bdb_ns *ns;
+
+    assert(c != NULL);
+
+    ns = bdb_ns_find(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length);
+    if (ns == NULL) {
+        out_string(c, "NOT_FOUND");
+        return;
+    }
+    c->ns = ns;
+    out_string(c, "OK");
+    return;
+}
+
 static void process_verbosity_command(conn *c, token_t *tokens, const size_t ntokens) {
     unsigned int level;
 
@@ -1408,6 +1886,11 @@ static void process_bdb_command(conn *c, token_t *tokens, const size_t ntokens)
     assert(c != NULL);
 
     if (strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0){
+        /* a backup still has to copy them */
+        if (backup_running()){
+            out_string(c, "ERROR");
+            return;
+        }
         if(0 != (ret = env->log_archive(env, NULL, DB_ARCH_REMOVE))){
             if (settings.verbose > 1) {
                 fprintf(stderr, "env->log_archive: %s\n", db_strerror(ret));
@@ -1430,11 +1913,84 @@ static void process_bdb_command(conn *c, token_t *tokens, const size_t ntokens)
         return;
     
     }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_compact") == 0){
-		DB_COMPACT c_data;
-        if(0 != (ret = dbp->compact(dbp, NULL, NULL, NULL, &c_data, DB_FREE_SPACE, NULL))){
-            if (settings.verbose > 1) {
-                fprintf(stderr, "dbp->compact: %s\n", db_strerror(ret));
-			}
+        /* db_compact [start [<pages> [<msecs>]]|pause|resume|cancel] */
+        char *sub = ntokens > 2 ? tokens[KEY_TOKEN].value : "start";
+        int pages = 0, msecs = 0;
+        if (strcmp(sub, "start") == 0){
+            if (ntokens > 3)
+                pages = strtol(tokens[KEY_TOKEN + 1].value, NULL, 10);
+            if (ntokens > 4)
+                msecs = strtol(tokens[KEY_TOKEN + 2].value, NULL, 10);
+            if (pages < 0 || msecs < 0){
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            ret = compact_start(pages, msecs);
+        }else if (ntokens == 3 && strcmp(sub, "pause") == 0){
+            ret = compact_pause();
+        }else if (ntokens == 3 && strcmp(sub, "resume") == 0){
+            ret = compact_resume();
+        }else if (ntokens == 3 && strcmp(sub, "cancel") == 0){
+            ret = compact_cancel();
+        }else{
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        if(0 != ret){
+            out_string(c, "ERROR");
+        }else{
+            out_string(c, "OK");
+        }
+        return;
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_backup") == 0){
+        /* db_backup <file>|<host:port> [<kbytes/s>], or db_backup cancel */
+        char *dest = tokens[KEY_TOKEN].value;
+        int rate = 0;
+        if (ntokens == 3 && strcmp(dest, "cancel") == 0){
+            ret = backup_cancel();
+        }else{
+            if (ntokens > 3)
+                rate = strtol(tokens[KEY_TOKEN + 1].value, NULL, 10);
+            if (rate < 0){
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            if (0 != (ret = backup_start(dest, rate)) && settings.verbose > 1){
+                fprintf(stderr, "backup to %s: %s\n", dest, strerror(errno));
+            }
+        }
+        if(0 != ret){
+            out_string(c, "ERROR");
+        }else{
+            out_string(c, "OK");
+        }
+        return;
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_dump") == 0){
+        /* db_dump <dir> [<threads> [gzip]], or db_dump cancel */
+        char *dir = tokens[KEY_TOKEN].value;
+        int threads = 0;
+        bool gzip = false;
+        if (ntokens == 3 && strcmp(dir, "cancel") == 0){
+            ret = dump_cancel();
+        }else{
+            if (ntokens > 3)
+                threads = strtol(tokens[KEY_TOKEN + 1].value, NULL, 10);
+            if (ntokens > 4)
+                gzip = strcmp(tokens[KEY_TOKEN + 2].value, "gzip") == 0;
+            if (threads < 0 || (ntokens > 4 && !gzip)){
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            ret = dump_start(dir, threads, gzip);
+        }
+        if(0 != ret){
+            out_string(c, "ERROR");
+        }else{
+            out_string(c, "OK");
+        }
+        return;
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_dict_train") == 0){
+        if (dict_train_start() < 0){
             out_string(c, "ERROR");
         }else{
             out_string(c, "OK");
@@ -1447,10 +2003,11 @@ static void process_bdb_command(conn *c, token_t *tokens, const size_t ntokens)
 }
 
 
-static void process_command(conn *c, char *command) {
+static void process_command(conn *c, char *command, size_t ncommand) {
 
     token_t tokens[MAX_TOKENS];
     size_t ntokens;
+    enum command_verb verb;
     int comm;
 
     assert(c != NULL);
@@ -1463,85 +2020,206 @@ static void process_command(conn *c, char *command) {
      * directly into it, then continue in nread_complete().
      */
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        out_string(c, "SERVER_ERROR out of memory preparing response");
-        return;
+    /* a pipelined command adds its reply behind the queued ones */
+    if (!c->replies_queued) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            out_string(c, "SERVER_ERROR out of memory preparing response");
+            return;
+        }
     }
 
-    ntokens = tokenize_command(command, tokens, MAX_TOKENS);
-    if (ntokens >= 3 &&
-        (strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ) {
-
+    ntokens = tokenize_command(command, ncommand, tokens, MAX_TOKENS);
+    verb = ntokens > 1 ? command_verb(&tokens[COMMAND_TOKEN]) : VERB_UNKNOWN;
+    switch (verb) {
+    case VERB_GET:
+        if (ntokens < 3)
+            break;
         process_get_command(c, tokens, ntokens);
+        return;
 
-    } else if ((ntokens == 6 || ntokens == 7) &&
-               ((strcmp(tokens[COMMAND_TOKEN].value, "add") == 0 && (comm = NREAD_ADD)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "set") == 0 && (comm = NREAD_SET)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0 && (comm = NREAD_REPLACE)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0 && (comm = NREAD_PREPEND)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "append") == 0 && (comm = NREAD_APPEND)) )) {
-
+    case VERB_ADD:
+    case VERB_SET:
+    case VERB_REPLACE:
+    case VERB_PREPEND:
+    case VERB_APPEND:
+        if (ntokens != 6 && ntokens != 7)
+            break;
+        switch (verb) {
+        case VERB_ADD:      comm = NREAD_ADD; break;
+        case VERB_SET:      comm = NREAD_SET; break;
+        case VERB_REPLACE:  comm = NREAD_REPLACE; break;
+        case VERB_PREPEND:  comm = NREAD_PREPEND; break;
+        default:            comm = NREAD_APPEND; break;
+        }
         process_update_command(c, tokens, ntokens, comm);
+        return;
 
-    } else if (ntokens == 7 && (strcmp(tokens[COMMAND_TOKEN].value, "rget") == 0)) {
-    
+    case VERB_RGET:
+        if (ntokens != 7)
+            break;
         process_rget_command(c, tokens, ntokens);
-    
-    } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)) {
-
-        process_arithmetic_command(c, tokens, ntokens, 1);
-
-    } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0)) {
-
-        process_arithmetic_command(c, tokens, ntokens, 0);
+        return;
 
-    } else if (ntokens >= 3 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
+    case VERB_INCR:
+    case VERB_DECR:
+        if (ntokens != 4)
+            break;
+        process_arithmetic_command(c, tokens, ntokens, verb == VERB_INCR);
+        return;
 
+    case VERB_DELETE:
+        if (ntokens < 3 || ntokens > 4)
+            break;
         process_delete_command(c, tokens, ntokens);
+        return;
 
-    } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
-
+    case VERB_STATS:
         process_stat(c, tokens, ntokens);
+        return;
 
-    } else if (ntokens >= 2 && ntokens <= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
-
+    case VERB_FLUSH_ALL:
+        if (ntokens > 3)
+            break;
         out_string(c, "ERROR");
+        return;
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
-
+    case VERB_VERSION:
+        if (ntokens != 2)
+            break;
         out_string(c, "VERSION " VERSION);
+        return;
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
-
-        conn_set_state(c, conn_closing);
-
-    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
+    case VERB_QUIT:
+        if (ntokens != 2)
+            break;
+        if (c->replies_queued) {
+            /* send the replies queued ahead of it first */
+            c->wcurr = c->wbuf + c->wused;
+            c->wbytes = 0;
+            conn_set_state(c, conn_write);
+            c->write_and_go = conn_closing;
+        } else {
+            conn_set_state(c, conn_closing);
+        }
+        return;
 
+    case VERB_VERBOSITY:
+        if (ntokens != 3)
+            break;
         process_verbosity_command(c, tokens, ntokens);
+        return;
 
-    } else if (ntokens == 3 && ((strcmp(tokens[COMMAND_TOKEN].value, "rep_set_ack_policy") == 0) ||
-                                (strcmp(tokens[COMMAND_TOKEN].value, "rep_set_priority") == 0) )) {
+    case VERB_USE:
+        if (ntokens != 3)
+            break;
+        process_use_command(c, tokens, ntokens);
+        return;
 
+    case VERB_REP_SET_ACK_POLICY:
+    case VERB_REP_SET_PRIORITY:
+        if (ntokens != 3)
+            break;
         process_rep_command(c, tokens, ntokens);
+        return;
 
-    } else if (ntokens == 2 && 
-              ((strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0 ) ||
-               (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0 ) ||
-               (strcmp(tokens[COMMAND_TOKEN].value, "db_compact") == 0 ))) {
+    case VERB_DB_ARCHIVE:
+    case VERB_DB_CHECKPOINT:
+    case VERB_DB_DICT_TRAIN:
+        if (ntokens != 2)
+            break;
+        process_bdb_command(c, tokens, ntokens);
+        return;
 
+    case VERB_DB_COMPACT:
+        if (ntokens > 5)
+            break;
         process_bdb_command(c, tokens, ntokens);
+        return;
 
-    } else {
-        out_string(c, "ERROR");
+    case VERB_DB_BACKUP:
+        if (ntokens != 3 && ntokens != 4)
+            break;
+        process_bdb_command(c, tokens, ntokens);
+        return;
+
+    case VERB_DB_DUMP:
+        if (ntokens < 3 || ntokens > 5)
+            break;
+        process_bdb_command(c, tokens, ntokens);
+        return;
+
+    case VERB_UNKNOWN:
+        break;
     }
-    return;
+
+    out_string(c, "ERROR");
+}
+
+/*
+ * Returns true if the command line needs the db, and so may block.
+ */
+static bool is_storage_command(const char *command) {
+    return strncmp(command, "get ", 4) == 0 ||
+           strncmp(command, "rget ", 5) == 0 ||
+           strncmp(command, "incr ", 5) == 0 ||
+           strncmp(command, "decr ", 5) == 0 ||
+           strncmp(command, "delete ", 7) == 0 ||
+           strncmp(command, "db_", 3) == 0;
+}
+
+/*
+ * Hands the connection's pending command to a storage thread, if there are
+ * any. Its events are turned off until the conn is handed back, and it
+ * must not be touched after this returns true.
+ */
+static bool park_conn(conn *c, char *command, size_t ncommand, char *cont) {
+    if (settings.num_storage_threads == 0 || !update_event(c, 0))
+        return false;
+
+    c->job_command = command;
+    c->job_ncommand = ncommand;
+    c->job_cont = cont;
+    conn_set_state(c, conn_waiting);
+    dispatch_storage_job(c);
+    return true;
+}
+
+/*
+ * Runs the command a conn was parked with. Called on a storage thread.
+ */
+void conn_run_job(conn *c) {
+    assert(c != NULL && c->state == conn_waiting);
+
+    /* set the state directly, conn_set_state() could shrink rbuf under us */
+    if (c->job_command == NULL) {
+        c->state = conn_nread;
+        complete_nread(c);
+        return;
+    }
+
+    c->state = conn_read;
+    process_command(c, c->job_command, c->job_ncommand);
+
+    c->rbytes -= (c->job_cont - c->rcurr);
+    c->rcurr = c->job_cont;
+
+    assert(c->rcurr <= (c->rbuf + c->rsize));
+}
+
+/*
+ * Picks a parked conn up again, on the thread that owns it, once its
+ * command has run.
+ */
+void conn_resume(conn *c) {
+    drive_machine(c);
 }
 
 /*
  * if we have a complete line in the buffer, process it.
+ * return -1 if the command went to a storage thread along with the conn.
  */
 static int try_read_command(conn *c) {
     char *el, *cont;
@@ -1562,7 +2240,10 @@ static int try_read_command(conn *c) {
 
     assert(cont <= (c->rcurr + c->rbytes));
 
-    process_command(c, c->rcurr);
+    if (is_storage_command(c->rcurr) && park_conn(c, c->rcurr, el - c->rcurr, cont))
+        return -1;
+
+    process_command(c, c->rcurr, el - c->rcurr);
 
     c->rbytes -= (cont - c->rcurr);
     c->rcurr = cont;
@@ -1581,30 +2262,40 @@ static int try_read_udp(conn *c) {
 
     assert(c != NULL);
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, &c->request_addr, &c->request_addr_size);
-    if (res > 8) {
+    /* drain datagrams until a whole request is in */
+    while ((res = udp_recv(c)) >= 0) {
         unsigned char *buf = (unsigned char *)c->rbuf;
+
+        if (res <= UDP_HEADER_SIZE)
+            continue;
+
         STATS_LOCK();
         stats.bytes_read += res;
         STATS_UNLOCK();
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
+        c->rcurr = c->rbuf;
 
-        /* If this is a multi-packet request, drop it. */
+        /* If this is one of several packets, put the request together. */
         if (buf[4] != 0 || buf[5] != 1) {
-            out_string(c, "SERVER_ERROR multi-packet request not supported");
-            return 0;
+            res = udp_reasm_add(c, res);
+            if (res == 0)
+                continue;
+            if (res < 0) {
+                c->rbytes = 0;
+                out_string(c, "SERVER_ERROR multi-packet request too large");
+                return 1;
+            }
+            c->rbytes = res;
+            return 1;
         }
 
         /* Don't care about any of the rest of the header. */
-        res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
+        res -= UDP_HEADER_SIZE;
+        memmove(c->rbuf, c->rbuf + UDP_HEADER_SIZE, res);
 
-        c->rbytes += res;
-        c->rcurr = c->rbuf;
+        c->rbytes = res;
         return 1;
     }
     return 0;
@@ -1617,19 +2308,39 @@ static int try_read_udp(conn *c) {
  * (if any) to the beginning of the buffer.
  * return 0 if there's nothing to read on the first read.
  */
+/*
+ * Reads from a conn's socket, or from what its io_uring receive collected.
+ */
+static ssize_t conn_recv(conn *c, void *buf, size_t len) {
+    if (c->uring != NULL)
+        return uring_recv(c, buf, len);
+    return read(c->sfd, buf, len);
+}
+
 static int try_read_network(conn *c) {
     int gotdata = 0;
     int res;
 
     assert(c != NULL);
 
-    if (c->rcurr != c->rbuf) {
-        if (c->rbytes != 0) /* otherwise there's nothing to copy */
-            memmove(c->rbuf, c->rcurr, c->rbytes);
-        c->rcurr = c->rbuf;
+    if (!conn_rbuf_get(c)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't allocate input buffer\n");
+        conn_set_state(c, conn_closing);
+        return 1;
     }
+    if (c->rbytes == 0)
+        c->rcurr = c->rbuf;
 
     while (1) {
+        /*
+         * A partial command stays where it is until it runs into the end
+         * of rbuf; only then is it moved to the front, or rbuf grown.
+         */
+        if (c->rcurr + c->rbytes == c->rbuf + c->rsize && c->rcurr != c->rbuf) {
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+            c->rcurr = c->rbuf;
+        }
         if (c->rbytes >= c->rsize) {
             char *new_rbuf = realloc(c->rbuf, c->rsize * 2);
             if (!new_rbuf) {
@@ -1653,8 +2364,8 @@ static int try_read_network(conn *c) {
             c->request_addr_size = 0;
         }
 
-        int avail = c->rsize - c->rbytes;
-        res = read(c->sfd, c->rbuf + c->rbytes, avail);
+        int avail = c->rsize - (c->rcurr - c->rbuf) - c->rbytes;
+        res = conn_recv(c, c->rcurr + c->rbytes, avail);
         if (res > 0) {
             STATS_LOCK();
             stats.bytes_read += res;
@@ -1682,6 +2393,18 @@ static int try_read_network(conn *c) {
     return gotdata;
 }
 
+/*
+ * Turns a per-thread listener back on, a while after it ran out of fds.
+ */
+static void listen_resume(const int fd, const short which, void *arg) {
+    conn *c = (conn *)arg;
+
+    if (draining)
+        return;
+    if (!update_event(c, EV_READ | EV_PERSIST) && settings.verbose > 0)
+        fprintf(stderr, "Couldn't update event\n");
+}
+
 static bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
@@ -1689,7 +2412,8 @@ static bool update_event(conn *c, const int new_flags) {
     if (c->ev_flags == new_flags)
         return true;
     if (event_del(&c->event) == -1) return false;
-    event_set(&c->event, c->sfd, new_flags, event_handler, (void *)c);
+    event_set(&c->event, c->sfd, c->uring ? new_flags & ~EV_READ : new_flags,
+              event_handler, (void *)c);
     event_base_set(base, &c->event);
     c->ev_flags = new_flags;
     if (event_add(&c->event, 0) == -1) return false;
@@ -1702,7 +2426,7 @@ static bool update_event(conn *c, const int new_flags) {
 void accept_new_conns(const bool do_accept) {
     conn *next;
 
-    if (! is_listen_thread())
+    if (! is_listen_thread() || draining)
         return;
 
     for (next = listen_conn; next; next = next->next) {
@@ -1721,6 +2445,101 @@ void accept_new_conns(const bool do_accept) {
     }
 }
 
+/*
+ * Starts a drain on the libevent thread running *arg*: its listeners stop,
+ * and its clients idle between commands go. The others go when they are,
+ * see conn_read in drive_machine().
+ */
+static void conn_drain_thread(void *arg) {
+    struct event_base *base = (struct event_base *)arg;
+    conn *c, *idle = NULL;
+
+    pthread_mutex_lock(&all_conns_lock);
+    for (c = all_conns; c != NULL; c = c->all_next) {
+        if (c->event.ev_base != base)
+            continue;
+        if (c->udp || c->state == conn_listening) {
+            /* leave the socket be, the next process may have it too */
+            update_event(c, 0);
+        } else if (c->state == conn_read && c->ev_flags == (EV_READ | EV_PERSIST) &&
+                   c->rbytes == 0 && !c->replies_queued && c->uring_rcount == 0) {
+            /* a parked conn has no events, so this one isn't on a storage thread */
+            c->next = idle;
+            idle = c;
+        }
+    }
+    pthread_mutex_unlock(&all_conns_lock);
+
+    while (idle != NULL) {
+        c = idle;
+        idle = c->next;
+        conn_close(c);
+    }
+}
+
+/*
+ * Closes every client the libevent thread running *arg* still has, busy or
+ * not, once nothing else will run their commands: at shutdown, after the
+ * drain, and after the storage threads are gone.
+ */
+void conn_close_thread(void *arg) {
+    struct event_base *base = (struct event_base *)arg;
+    conn *c, *busy = NULL;
+
+    pthread_mutex_lock(&all_conns_lock);
+    for (c = all_conns; c != NULL; c = c->all_next) {
+        if (c->event.ev_base == base && !c->udp && c->state != conn_listening) {
+            c->next = busy;
+            busy = c;
+        }
+    }
+    pthread_mutex_unlock(&all_conns_lock);
+
+    while (busy != NULL) {
+        c = busy;
+        busy = c->next;
+        conn_close(c);
+    }
+}
+
+/* Ends the event loop once the clients are gone, or the drain took too long. */
+static void conn_drain_check(const int fd, const short which, void *arg) {
+    struct timeval tv = {0, 100000};
+    int left;
+
+    pthread_mutex_lock(&all_conns_lock);
+    left = nclient_conns;
+    pthread_mutex_unlock(&all_conns_lock);
+
+    if (left == 0 || time(NULL) >= drain_deadline) {
+        if (left > 0)
+            fprintf(stderr, "drain: %d connections still busy after %d seconds, closing anyway\n",
+                    left, DRAIN_TIMEOUT);
+        else
+            fprintf(stderr, "drain: all connections closed\n");
+        event_base_loopexit(main_base, 0);
+        return;
+    }
+    event_base_once(main_base, -1, EV_TIMEOUT, conn_drain_check, NULL, &tv);
+}
+
+/*
+ * Stops accepting and lets the clients finish what they are doing, then
+ * ends the main event loop. Called on the main thread.
+ */
+void conn_drain_start(void) {
+    struct timeval tv = {0, 100000};
+
+    if (draining)
+        return;
+    draining = true;
+    drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+    fprintf(stderr, "drain: no longer accepting, waiting for connections to finish\n");
+
+    dispatch_thread_all(conn_drain_thread);
+    event_base_once(main_base, -1, EV_TIMEOUT, conn_drain_check, NULL, &tv);
+}
+
 
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
@@ -1731,6 +2550,52 @@ void accept_new_conns(const bool do_accept) {
  *   TRANSMIT_SOFT_ERROR Can't write any more right now.
  *   TRANSMIT_HARD_ERROR Can't write (c->state is set to conn_closing)
  */
+/*
+ * Accounts for the result of sending msg *m*, as transmit() returns it.
+ */
+static int transmit_result(conn *c, struct msghdr *m, ssize_t res) {
+    if (res > 0) {
+        STATS_LOCK();
+        stats.bytes_written += res;
+        STATS_UNLOCK();
+
+        /* We've written some of the data. Remove the completed
+           iovec entries from the list of pending writes. */
+        while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
+            res -= m->msg_iov->iov_len;
+            m->msg_iovlen--;
+            m->msg_iov++;
+        }
+
+        /* Might have written just part of the last iovec entry;
+           adjust it so the next write will do the rest. */
+        if (res > 0) {
+            m->msg_iov->iov_base += res;
+            m->msg_iov->iov_len -= res;
+        }
+        return TRANSMIT_INCOMPLETE;
+    }
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "Couldn't update event\n");
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
+    }
+    /* if res==0 or res==-1 and error is not EAGAIN or EWOULDBLOCK,
+       we have a real error, on which we close the connection */
+    if (settings.verbose > 0)
+        perror("Failed to write, and not due to blocking");
+
+    if (c->udp)
+        conn_set_state(c, conn_read);
+    else
+        conn_set_state(c, conn_closing);
+    return TRANSMIT_HARD_ERROR;
+}
+
 static int transmit(conn *c) {
     assert(c != NULL);
 
@@ -1743,52 +2608,97 @@ static int transmit(conn *c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
-        res = sendmsg(c->sfd, m, 0);
-        if (res > 0) {
-            STATS_LOCK();
-            stats.bytes_written += res;
-            STATS_UNLOCK();
+        c->replies_sending = true;
 
-            /* We've written some of the data. Remove the completed
-               iovec entries from the list of pending writes. */
-            while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
-                res -= m->msg_iov->iov_len;
-                m->msg_iovlen--;
-                m->msg_iov++;
-            }
+        /* the datagrams of a UDP reply go out a batch at a time */
+        if (c->udp && c->msgused - c->msgcurr > 1) {
+            size_t bytes = 0;
+            int sent = udp_send(c->sfd, m, c->msgused - c->msgcurr, &bytes);
 
-            /* Might have written just part of the last iovec entry;
-               adjust it so the next write will do the rest. */
-            if (res > 0) {
-                m->msg_iov->iov_base += res;
-                m->msg_iov->iov_len -= res;
-            }
+            if (sent < 0)
+                return transmit_result(c, m, -1);
+            STATS_LOCK();
+            stats.bytes_written += bytes;
+            STATS_UNLOCK();
+            c->msgcurr += sent - 1;
+            c->msglist[c->msgcurr].msg_iovlen = 0;
             return TRANSMIT_INCOMPLETE;
         }
-        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            if (!update_event(c, EV_WRITE | EV_PERSIST)) {
-                if (settings.verbose > 0)
-                    fprintf(stderr, "Couldn't update event\n");
-                conn_set_state(c, conn_closing);
-                return TRANSMIT_HARD_ERROR;
-            }
+
+        /* on io_uring, the send finishes in conn_send_done() */
+        if (c->uring != NULL && (c->uring_sending || uring_sendmsg(c, m)))
             return TRANSMIT_SOFT_ERROR;
-        }
-        /* if res==0 or res==-1 and error is not EAGAIN or EWOULDBLOCK,
-           we have a real error, on which we close the connection */
-        if (settings.verbose > 0)
-            perror("Failed to write, and not due to blocking");
 
-        if (c->udp)
-            conn_set_state(c, conn_read);
-        else
-            conn_set_state(c, conn_closing);
-        return TRANSMIT_HARD_ERROR;
+        res = sendmsg(c->sfd, m, 0);
+        return transmit_result(c, m, res);
     } else {
         return TRANSMIT_COMPLETE;
     }
 }
 
+/*
+ * Picks a conn up again once io_uring has sent its current msg; *res* is
+ * what sendmsg() would have returned, or minus its errno.
+ */
+void conn_send_done(conn *c, int res) {
+    c->uring_sending = false;
+    if (res < 0) {
+        errno = -res;
+        res = -1;
+    }
+    if (transmit_result(c, &c->msglist[c->msgcurr], res) == TRANSMIT_SOFT_ERROR)
+        return;
+    drive_machine(c);
+}
+
+/*
+ * Holds back the reply just built if another complete command is already
+ * in rbuf, so that the replies to a pipelined batch go out together in as
+ * few sendmsg() calls as possible. The batch is cut at IOV_MAX iovecs and
+ * about a wbuf of short replies, and at any reply that has to be sent
+ * before the conn goes on (one that frees its buffer, or doesn't continue
+ * reading commands).
+ *
+ * Returns true if the reply was queued and the conn is back in conn_read.
+ */
+static bool queue_reply(conn *c) {
+    bool is_write = (c->state == conn_write);
+
+    if (c->udp || c->replies_sending || c->write_and_free != NULL ||
+        (is_write && c->write_and_go != conn_read) ||
+        c->iovused >= IOV_MAX ||
+        c->wused + (is_write ? c->wbytes : 0) >= DATA_BUFFER_SIZE ||
+        memchr(c->rcurr, '\n', c->rbytes) == NULL)
+        return false;
+
+    if (is_write)
+        c->wused += c->wbytes;
+    c->iovmark = c->iovused;
+    c->replies_queued = true;
+    /* not conn_set_state(), conn_shrink() would drop the queued msglist */
+    c->state = conn_read;
+    return true;
+}
+
+/*
+ * Releases what the replies just sent held on to.
+ */
+static void replies_sent(conn *c) {
+    while (c->ileft > 0) {
+        item *it = *(c->icurr);
+        item_free(it);
+        c->icurr++;
+        c->ileft--;
+    }
+    if (c->write_and_free) {
+        free(c->write_and_free);
+        c->write_and_free = 0;
+    }
+    c->wused = 0;
+    c->iovmark = 0;
+    c->replies_queued = c->replies_sending = false;
+}
+
 static void drive_machine(conn *c) {
     bool stop = false;
     int sfd, flags = 1;
@@ -1810,7 +2720,16 @@ static void drive_machine(conn *c) {
                 } else if (errno == EMFILE) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Too many open connections\n");
-                    accept_new_conns(false);
+                    if (settings.reuseport) {
+                        /* no conn_close() on this thread will wake it up,
+                           so give it a second instead */
+                        struct timeval tv = {1, 0};
+                        update_event(c, 0);
+                        event_base_once(c->event.ev_base, -1, EV_TIMEOUT,
+                                        listen_resume, c, &tv);
+                    } else {
+                        accept_new_conns(false);
+                    }
                     stop = true;
                 } else {
                     perror("accept()");
@@ -1824,18 +2743,45 @@ static void drive_machine(conn *c) {
                 close(sfd);
                 break;
             }
+            if (settings.reuseport) {
+                /* the kernel already picked this thread, keep the conn here */
+                if (conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
+                             DATA_BUFFER_SIZE, false, c->event.ev_base) == NULL) {
+                    if (settings.verbose > 0)
+                        fprintf(stderr, "Can't listen for events on fd %d\n", sfd);
+                    close(sfd);
+                }
+                break;
+            }
             dispatch_conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
                                      DATA_BUFFER_SIZE, false);
             break;
 
         case conn_read:
-            if (try_read_command(c) != 0) {
+            if ((res = try_read_command(c)) < 0) {
+                stop = true;
+                break;
+            }
+            if (res != 0) {
                 continue;
             }
+            if (c->replies_queued) {
+                /* no more complete commands, send what the batch has */
+                conn_set_state(c, conn_mwrite);
+                break;
+            }
             if ((c->udp ? try_read_udp(c) : try_read_network(c)) != 0) {
                 continue;
             }
             /* we have no command line and no data to read from network */
+            if (!c->udp && c->rbytes == 0) {
+                conn_rbuf_put(c);
+                /* between commands is where a drain lets a client go */
+                if (draining) {
+                    conn_set_state(c, conn_closing);
+                    break;
+                }
+            }
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -1848,6 +2794,10 @@ static void drive_machine(conn *c) {
         case conn_nread:
             /* we are reading rlbytes into ritem; */
             if (c->rlbytes == 0) {
+                if (park_conn(c, NULL, 0, NULL)) {
+                    stop = true;
+                    break;
+                }
                 complete_nread(c);
                 break;
             }
@@ -1863,7 +2813,7 @@ static void drive_machine(conn *c) {
             }
 
             /*  now try reading from the socket */
-            res = read(c->sfd, c->ritem, c->rlbytes);
+            res = conn_recv(c, c->ritem, c->rlbytes);
             if (res > 0) {
                 STATS_LOCK();
                 stats.bytes_read += res;
@@ -1909,7 +2859,11 @@ static void drive_machine(conn *c) {
             }
 
             /*  now try reading from the socket */
-            res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            if (!conn_rbuf_get(c)) {
+                conn_set_state(c, conn_closing);
+                break;
+            }
+            res = conn_recv(c, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
                 STATS_LOCK();
                 stats.bytes_read += res;
@@ -1943,7 +2897,7 @@ static void drive_machine(conn *c) {
              * assemble it into a msgbuf list (this will be a single-entry
              * list for TCP or a two-entry list for UDP).
              */
-            if (c->iovused == 0 || (c->udp && c->iovused == 1)) {
+            if (c->iovused == c->iovmark || (c->udp && c->iovused == 1)) {
                 if (add_iov(c, c->wcurr, c->wbytes) != 0 ||
                     (c->udp && build_udp_headers(c) != 0)) {
                     if (settings.verbose > 0)
@@ -1956,21 +2910,16 @@ static void drive_machine(conn *c) {
             /* fall through... */
 
         case conn_mwrite:
+            if (queue_reply(c))
+                break;
+
             switch (transmit(c)) {
             case TRANSMIT_COMPLETE:
                 if (c->state == conn_mwrite) {
-                    while (c->ileft > 0) {
-                        item *it = *(c->icurr);
-                        item_free(it);
-                        c->icurr++;
-                        c->ileft--;
-                    }
+                    replies_sent(c);
                     conn_set_state(c, conn_read);
                 } else if (c->state == conn_write) {
-                    if (c->write_and_free) {
-                        free(c->write_and_free);
-                        c->write_and_free = 0;
-                    }
+                    replies_sent(c);
                     conn_set_state(c, c->write_and_go);
                 } else {
                     if (settings.verbose > 0)
@@ -1996,6 +2945,11 @@ static void drive_machine(conn *c) {
                 conn_close(c);
             stop = true;
             break;
+
+        case conn_waiting:
+            /* a storage thread has it, conn_resume() picks it up again */
+            stop = true;
+            break;
         }
     }
 
@@ -2077,6 +3031,14 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+/* Remembers a listening socket, for handoff_listen(). */
+static void listen_fd_add(const int sfd) {
+    if (nlisten_fds < HANDOFF_MAX_FDS)
+        listen_fds[nlisten_fds++] = sfd;
+    else
+        fprintf(stderr, "too many listening sockets, fd %d won't be handed over\n", sfd);
+}
+
 static int server_socket(const int port, const bool is_udp) {
     int sfd;
     struct linger ling = {0, 0};
@@ -2118,6 +3080,13 @@ static int server_socket(const int port, const bool is_udp) {
     }
 
     for (next= ai; next; next= next->ai_next) {
+      int i, nlisteners = 1;
+
+      /* with SO_REUSEPORT every thread gets its own socket for the address */
+      if (!is_udp && settings.reuseport)
+          nlisteners = settings.num_threads;
+
+      for (i = 0; i < nlisteners; i++) {
         conn *listen_conn_add;
         if ((sfd = new_socket(next)) == -1) {
             freeaddrinfo(ai);
@@ -2125,6 +3094,16 @@ static int server_socket(const int port, const bool is_udp) {
         }
 
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+        if (!is_udp && settings.reuseport) {
+            if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) != 0) {
+                perror("setsockopt(SO_REUSEPORT)");
+                close(sfd);
+                freeaddrinfo(ai);
+                return 1;
+            }
+        }
+#endif
         if (is_udp) {
             maximize_sndbuf(sfd);
         } else {
@@ -2141,7 +3120,7 @@ static int server_socket(const int port, const bool is_udp) {
                 return 1;
             }
             close(sfd);
-            continue;
+            break;
         } else {
           success++;
           if (!is_udp && listen(sfd, 1024) == -1) {
@@ -2150,6 +3129,7 @@ static int server_socket(const int port, const bool is_udp) {
               freeaddrinfo(ai);
               return 1;
           }
+          listen_fd_add(sfd);
       }
 
       if (is_udp)
@@ -2161,6 +3141,9 @@ static int server_socket(const int port, const bool is_udp) {
             dispatch_conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
                               UDP_READ_BUFFER_SIZE, 1);
         }
+      } else if (settings.reuseport) {
+        /* round-robin again, so each thread gets one of the sockets */
+        dispatch_conn_new(sfd, conn_listening, EV_READ | EV_PERSIST, 1, false);
       } else {
         if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                          EV_READ | EV_PERSIST, 1, false, main_base))) {
@@ -2171,6 +3154,7 @@ static int server_socket(const int port, const bool is_udp) {
         listen_conn_add->next = listen_conn;
         listen_conn = listen_conn_add;
       }
+      }
     }
 
     freeaddrinfo(ai);
@@ -2251,10 +3235,121 @@ static int server_socket_unix(const char *path, int access_mask) {
         fprintf(stderr, "failed to create listening connection\n");
         exit(EXIT_FAILURE);
     }
+    listen_fd_add(sfd);
+
+    return 0;
+}
+
+/*
+ * Serves a listening socket handed over by the previous process, the way
+ * server_socket() or server_socket_unix() would have set it up.
+ */
+static int server_socket_inherit(const int sfd) {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    conn *listen_conn_add;
+    int type, c;
 
+    len = sizeof(type);
+    if (getsockopt(sfd, SOL_SOCKET, SO_TYPE, (void *)&type, &len) == -1) {
+        perror("getsockopt(SO_TYPE)");
+        return 1;
+    }
+    len = sizeof(addr);
+    if (getsockname(sfd, (struct sockaddr *)&addr, &len) == -1) {
+        perror("getsockname()");
+        return 1;
+    }
+    listen_fd_add(sfd);
+
+    if (type == SOCK_DGRAM) {
+        for (c = 0; c < settings.num_threads; c++) {
+            dispatch_conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
+                              UDP_READ_BUFFER_SIZE, 1);
+        }
+    } else if (settings.reuseport && addr.ss_family != AF_UNIX) {
+        dispatch_conn_new(sfd, conn_listening, EV_READ | EV_PERSIST, 1, false);
+    } else {
+        if (!(listen_conn_add = conn_new(sfd, conn_listening,
+                                         EV_READ | EV_PERSIST, 1, false, main_base))) {
+            fprintf(stderr, "failed to create listening connection\n");
+            exit(EXIT_FAILURE);
+        }
+        listen_conn_add->next = listen_conn;
+        listen_conn = listen_conn_add;
+    }
     return 0;
 }
 
+/* whether the address *sa* is the one -l asks for, or the wildcard without it */
+static bool server_addr_matches(const struct sockaddr *sa) {
+    struct addrinfo hints, *ai, *next;
+    bool match = false;
+
+    if (settings.inter == NULL) {
+        if (sa->sa_family == AF_INET)
+            return ((const struct sockaddr_in *)sa)->sin_addr.s_addr == htonl(INADDR_ANY);
+        return IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)sa)->sin6_addr);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = sa->sa_family;
+    if (getaddrinfo(settings.inter, NULL, &hints, &ai) != 0)
+        return false;
+    for (next = ai; next != NULL && !match; next = next->ai_next) {
+        if (sa->sa_family == AF_INET)
+            match = ((const struct sockaddr_in *)sa)->sin_addr.s_addr ==
+                    ((struct sockaddr_in *)next->ai_addr)->sin_addr.s_addr;
+        else
+            match = memcmp(&((const struct sockaddr_in6 *)sa)->sin6_addr,
+                           &((struct sockaddr_in6 *)next->ai_addr)->sin6_addr,
+                           sizeof(struct in6_addr)) == 0;
+    }
+    freeaddrinfo(ai);
+    return match;
+}
+
+/*
+ * Whether the *n* listening sockets at *fds*, handed over by the previous
+ * process, are what this one's -s, -p, -U and -l would have made: every
+ * one of them, and a stream socket at least.
+ */
+static bool server_sockets_match(const int *fds, const int n) {
+    struct sockaddr_storage addr;
+    struct sockaddr_un *sun = (struct sockaddr_un *)&addr;
+    socklen_t len;
+    bool stream = false;
+    int i, type, port;
+
+    for (i = 0; i < n; i++) {
+        len = sizeof(type);
+        if (getsockopt(fds[i], SOL_SOCKET, SO_TYPE, (void *)&type, &len) == -1)
+            return false;
+        len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        if (getsockname(fds[i], (struct sockaddr *)&addr, &len) == -1)
+            return false;
+        stream |= type == SOCK_STREAM;
+
+        if (addr.ss_family == AF_UNIX) {
+            if (settings.socketpath == NULL || type != SOCK_STREAM ||
+                strncmp(sun->sun_path, settings.socketpath, sizeof(sun->sun_path)) != 0)
+                return false;
+            continue;
+        }
+        if (settings.socketpath != NULL ||
+            (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+            return false;
+        port = type == SOCK_DGRAM && settings.udpport ? settings.udpport : settings.port;
+        if (ntohs(addr.ss_family == AF_INET ? ((struct sockaddr_in *)&addr)->sin_port
+                                            : ((struct sockaddr_in6 *)&addr)->sin6_port) != port ||
+            !server_addr_matches((struct sockaddr *)&addr))
+            return false;
+    }
+    return stream;
+}
+
 static void usage(void) {
     printf(PACKAGE " " VERSION "\n");
     printf("-p <num>      TCP port number to listen on (default: 21201)\n"
@@ -2275,7 +3370,15 @@ static void usage(void) {
            );
 #ifdef USE_THREADS
     printf("-t <num>      number of threads to use, default 4\n");
+    printf("-j <num>      number of threads running db calls off the event loop, default 0 (none)\n");
+#ifdef SO_REUSEPORT
+    printf("-o            every thread accepts on its own SO_REUSEPORT listening socket\n");
+#endif
 #endif
+    printf("-x <cpus>     pin the libevent threads one per cpu of <cpus>, e.g. '0-3,8'\n"
+           "              storage threads run on any of them\n");
+    printf("-y <cpus>     run db maintenance threads on <cpus>\n");
+    printf("-I            do TCP connection I/O through io_uring, where the kernel has it\n");
     printf("--------------------BerkeleyDB Options-------------------------------\n");
     printf("-m <num>      in-memmory cache size of BerkeleyDB in megabytes, default is 256MB\n");
     printf("-A <num>      underlying page size in bytes, default is 4096, (512B ~ 64KB, power-of-two)\n");
@@ -2284,13 +3387,46 @@ static void usage(void) {
     printf("-G <dir>      log dir of database, default is the same as env home\n");
     printf("-B <db_type>  type of database, 'btree' or 'hash'. default is 'btree'\n");
     printf("-L <num>      log buffer size in kbytes, default is 4MB\n");
-    printf("-C <num>      do checkpoint every <num> seconds, 0 for disable, default is 5 minutes\n");
-    printf("-T <num>      do memp_trickle every <num> seconds, 0 for disable, default is 30 seconds\n");
-    printf("-e <num>      percent of the pages in the cache that should be clean, default is 60%%\n");
-    printf("-D <num>      do deadlock detecting every <num> millisecond, 0 for disable, default is 100ms\n");
+    printf("-C <num>      do checkpoint at least every <num> seconds, 0 for disable, default is 5 minutes;\n"
+           "              0 also disables -K and -Q, unless they are given\n");
+    printf("-K <num>      do checkpoint once <num> kbytes of log are written since the last one,\n"
+           "              0 for disable, default is 65536 (64MB)\n");
+    printf("-Q <num>      do checkpoint once <num> percent of the cache size is dirty, 0 for disable, default is 50%%\n");
+    printf("-Y <num>      write dirty pages ahead of a checkpoint at most <num> kbytes a second,\n"
+           "              0 for no limit, default is 0\n");
+    printf("-T <num>      do memp_trickle at least every <num> seconds, 0 for disable, default is 30 seconds;\n"
+           "              more often, and aiming higher than -e, while readers have to write dirty pages\n");
+    printf("-e <num>      least percent of the pages in the cache that should be clean, default is 60%%\n");
+    printf("-D <num>      also poll for deadlocks every <num> millisecond, 0 for disable, default is 0;\n"
+           "              deadlocks are always looked for when a lock request blocks\n");
     printf("-N            enable DB_TXN_NOSYNC to gain big performance improved, default is off\n");
     printf("-E            automatically remove log files that are no longer needed\n");
     printf("-X            allocate region memory from the heap, default is off\n");
+    printf("-g <file>     load the records in <file> ('-' for stdin) into the default keyspace,\n"
+           "              without logging, then exit; a record is '<key> <flags> <bytes>\\r\\n<data>\\r\\n'.\n"
+           "              Refused unless the keyspace is empty, as a crash halfway can't be recovered\n");
+    printf("-k <num>      number of databases to hash the keyspace across, only used when the db file is created, default is 1\n");
+    printf("-W <spec>     add a namespace, <spec> is name[:btree|hash[:pagesize[:dict_min_size[:priority]]]],\n"
+           "              priority is the cache share: verylow, low, default, high or veryhigh\n");
+    printf("-F <rate>     false positive rate of the Bloom filter that answers misses without\n"
+           "              a disk read, e.g. 0.01; 0 for disable, default is 0. Not used with replication\n");
+    printf("-q <num>      remember up to <num> missed keys and answer them from memory until\n"
+           "              stored, 0 for disable, default is 0. Not used with replication\n");
+    printf("-w <num>      save the hottest keys to the env home every <num> seconds and on exit, and\n"
+           "              read them back at startup to warm the cache up, 0 for disable, default is 0\n");
+    printf("-J <num>      wait up to <num> seconds for the warm-up before serving, 0 for not, default is 0\n");
+    printf("-V <num>      answer startup progress on TCP port <num>, from before recovery, 0 for none, default is 0\n");
+    printf("-Z            refuse writes until recovery, replica sync and warm-up are done\n");
+    printf("-z <num>      compress values of at least <num> bytes with the trained dictionary, 0 for disable, default is 0\n");
+    printf("--takeover    take the listening sockets of the daemon serving the same env home,\n"
+           "              which then drains and exits; refused unless they are what -s, -p, -U\n"
+           "              and -l here ask for\n");
+    printf("--dump-dir <dir>\n"
+           "              db_dump may create its directories in <dir>, which must be outside the env home;\n"
+           "              without it, db_dump is refused\n");
+    printf("--backup-dir <dir>\n"
+           "              db_backup may create archives in <dir>, which must be outside the env home;\n"
+           "              without it, db_backup only streams to host:port\n");
     printf("--------------------Replication Options-------------------------------\n");
     printf("-R            identifies the host and port used by this site (required).\n");
     printf("-O            identifies another site participating in this replication group\n");
@@ -2443,6 +3579,21 @@ static void remove_pidfile(const char *pid_file) {
 
 }
 
+/*
+ * Once serving, the first TERM, QUIT or INT drains the conns before the
+ * event loop ends, and a second one ends it right away.
+ */
+static void drain_signal(const int sig, const short which, void *arg) {
+    if (!draining) {
+        fprintf(stderr, "Signal(%d) received, draining connections..\n", sig);
+        conn_drain_start();
+        return;
+    }
+    fprintf(stderr, "Signal(%d) received again, exiting now..\n", sig);
+    daemon_quit = 1;
+    event_base_loopexit(main_base, 0);
+}
+
 /* for safely exit, make sure to do checkpoint*/
 static void sig_handler(const int sig)
 {
@@ -2463,11 +3614,22 @@ static void sig_handler(const int sig)
       fprintf(stderr, "done.\n");
     else
       fprintf(stderr, "error.\n");
-
-    /* make sure deadlock detect loop is quit*/
-    sleep(2);
 }
 
+/* the short options are all taken, newer ones are long only */
+enum {
+    OPT_BACKUP_DIR = 256,
+    OPT_DUMP_DIR,
+    OPT_TAKEOVER
+};
+
+static const struct option long_options[] = {
+    { "backup-dir", required_argument, NULL, OPT_BACKUP_DIR },
+    { "dump-dir", required_argument, NULL, OPT_DUMP_DIR },
+    { "takeover", no_argument, NULL, OPT_TAKEOVER },
+    { NULL, 0, NULL, 0 }
+};
+
 int main (int argc, char **argv) {
     int c;
     struct in_addr addr;
@@ -2475,6 +3637,7 @@ int main (int argc, char **argv) {
     int maxcore = 0;
     char *username = NULL;
     char *pid_file = NULL;
+    char *load_file = NULL;
     struct passwd *pw;
     struct sigaction sa;
     struct rlimit rlim;
@@ -2487,6 +3650,15 @@ int main (int argc, char **argv) {
 
     char *portstr = NULL;
 
+    /* sockets handed over by a previous process */
+    int inherited[HANDOFF_MAX_FDS];
+    int ninherited, i;
+    bool handed_over;
+
+    /* the signals that drain, once serving */
+    static const int drain_signals[3] = { SIGTERM, SIGQUIT, SIGINT };
+    struct event drain_events[3];
+
     /* register signal callback */
     if (signal(SIGTERM, sig_handler) == SIG_ERR)
         fprintf(stderr, "can not catch SIGTERM\n");
@@ -2498,6 +3670,7 @@ int main (int argc, char **argv) {
     /* init settings */
     settings_init();
     bdb_settings_init();
+    affinity_init();
 
     /* get Berkeley DB version*/
     db_version(&(bdb_version.majver), &(bdb_version.minver), &(bdb_version.patch));
@@ -2506,7 +3679,8 @@ int main (int argc, char **argv) {
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "a:U:p:s:c:hivl:dru:P:t:b:f:H:G:B:m:A:L:C:T:e:D:NEXMSR:O:n:")) != -1) {
+    while ((c = getopt_long(argc, argv, "a:U:p:s:c:hivl:dru:P:t:j:ox:y:Ib:f:H:G:B:m:A:L:C:T:e:D:NEXz:k:W:F:q:w:J:V:ZMSR:O:n:K:Q:Y:g:",
+                            long_options, NULL)) != -1) {
         switch (c) {
         case 'a':
             /* access for unix domain socket, as octal mask (like chmod)*/
@@ -2557,7 +3731,34 @@ int main (int argc, char **argv) {
                 exit(EXIT_FAILURE);
             }
             break;
+        case 'j':
+            settings.num_storage_threads = atoi(optarg);
+            if (settings.num_storage_threads < 0) {
+                fprintf(stderr, "Number of storage threads must not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+#ifdef SO_REUSEPORT
+        case 'o':
+            settings.reuseport = true;
+            break;
+#endif
 #endif
+        case 'x':
+            if (affinity_set_workers(optarg) != 0) {
+                fprintf(stderr, "Bad cpu list for -x: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'y':
+            if (affinity_set_housekeeping(optarg) != 0) {
+                fprintf(stderr, "Bad cpu list for -y: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'I':
+            settings.use_uring = true;
+            break;
         case 'b':
             settings.item_buf_size = atoi(optarg);
             if(settings.item_buf_size < 512){
@@ -2599,6 +3800,24 @@ int main (int argc, char **argv) {
         case 'C':
             bdb_settings.chkpoint_val = atoi(optarg);
             break;
+        case 'K':
+            bdb_settings.chkpoint_kbyte = atoi(optarg);
+            if (bdb_settings.chkpoint_kbyte < 0){
+                fprintf(stderr, "chkpoint_kbyte should be >= 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Q':
+            bdb_settings.chkpoint_dirty_percent = atoi(optarg);
+            if (bdb_settings.chkpoint_dirty_percent < 0 ||
+                bdb_settings.chkpoint_dirty_percent > 100){
+                fprintf(stderr, "chkpoint_dirty_percent should be 0 ~ 100.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Y':
+            bdb_settings.chkpoint_rate = atoi(optarg);
+            break;
         case 'T':
             bdb_settings.memp_trickle_val = atoi(optarg);
             break;
@@ -2622,6 +3841,63 @@ int main (int argc, char **argv) {
         case 'X':
             bdb_settings.env_flags |= DB_PRIVATE;
             break;
+        case 'k':
+            bdb_settings.db_nshards = atoi(optarg);
+            if (bdb_settings.db_nshards <= 0 || bdb_settings.db_nshards > MAX_DB_SHARDS){
+                fprintf(stderr, "number of shards should be between 1 and %d.\n", MAX_DB_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'W':
+            if (bdb_ns_add(optarg) != 0){
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            bdb_settings.bloom_fp_rate = atof(optarg);
+            if (bdb_settings.bloom_fp_rate < 0 || bdb_settings.bloom_fp_rate >= 1){
+                fprintf(stderr, "false positive rate should be >= 0 and < 1.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            bdb_settings.negcache_size = atoi(optarg);
+            if (bdb_settings.negcache_size < 0){
+                fprintf(stderr, "negative cache size should be >= 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            bdb_settings.hotkeys_val = atoi(optarg);
+            if (bdb_settings.hotkeys_val < 0){
+                fprintf(stderr, "hot key save interval should be >= 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'J':
+            bdb_settings.warmup_wait = atoi(optarg);
+            if (bdb_settings.warmup_wait < 0){
+                fprintf(stderr, "warm-up wait should be >= 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'V':
+            settings.status_port = atoi(optarg);
+            if (settings.status_port < 0){
+                fprintf(stderr, "status port should be >= 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Z':
+            settings.read_only_until_ready = true;
+            break;
+        case 'z':
+            bdb_settings.dict_min_size = atoi(optarg);
+            if (bdb_settings.dict_min_size < 0){
+                fprintf(stderr, "dictionary compression size should be >= 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'M':
             if (bdb_settings.rep_start_policy == DB_REP_CLIENT){
                 fprintf(stderr, "Can't not be a Master and Slave at same time.\n");
@@ -2658,6 +3934,19 @@ int main (int argc, char **argv) {
         case 'n':
             bdb_settings.rep_nsites = atoi(optarg);
             break;
+        case 'g':
+            load_file = optarg;
+            bdb_settings.bulk_load = 1;
+            break;
+        case OPT_BACKUP_DIR:
+            bdb_settings.backup_dir = optarg;
+            break;
+        case OPT_DUMP_DIR:
+            bdb_settings.dump_dir = optarg;
+            break;
+        case OPT_TAKEOVER:
+            settings.takeover = true;
+            break;
 
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -2665,6 +3954,11 @@ int main (int argc, char **argv) {
         }
     }
 
+    if (bdb_settings.bulk_load && bdb_settings.is_replicated) {
+        fprintf(stderr, "bulk load is not logged, so can't be replicated.\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (maxcore != 0) {
         struct rlimit rlim_new;
         /*
@@ -2759,13 +4053,44 @@ int main (int argc, char **argv) {
     }
     /* start up worker threads if MT mode */
     thread_init(settings.num_threads, main_base);
+#ifndef USE_THREADS
+    if (settings.use_uring && uring_attach(main_base) != 0)
+        fprintf(stderr, "io_uring is not available, using libevent\n");
+#endif
     /* save the PID in if we're a daemon, do this after thread_init due to
        a file descriptor handling bug somewhere in libevent */
     if (daemonize)
         save_pid(getpid(), pid_file);
 
+    /* with --takeover, a process still serving the same env home hands its
+       sockets over, if they are the ones we would listen on */
+    ninherited = 0;
+    if (settings.takeover && (ninherited = handoff_receive(inherited, HANDOFF_MAX_FDS)) < 0) {
+        fprintf(stderr, "failed to take the listening sockets over\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ninherited > 0 && !server_sockets_match(inherited, ninherited)) {
+        fprintf(stderr, "handoff: the serving process listens on other sockets than -s, -p, -U and -l "
+                        "ask for, leaving it be\n");
+        for (i = 0; i < ninherited; i++)
+            close(inherited[i]);
+        handoff_answer(false);
+        exit(EXIT_FAILURE);
+    }
+    handoff_answer(true);
+    for (i = 0; i < ninherited; i++) {
+        if (server_socket_inherit(inherited[i])) {
+            fprintf(stderr, "failed to listen\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     /* create unix mode sockets after dropping privileges */
-    if (settings.socketpath != NULL) {
+    if (ninherited > 0) {
+        /* the sockets are all there is to it */
+    } else if (settings.socketpath != NULL) {
+        /* a unix socket has a single listener, which hands conns out */
+        settings.reuseport = false;
         if (server_socket_unix(settings.socketpath,settings.access)) {
           fprintf(stderr, "failed to listen\n");
           exit(EXIT_FAILURE);
@@ -2773,7 +4098,7 @@ int main (int argc, char **argv) {
     }
 
     /* create the listening socket, bind it, and init */
-    if (settings.socketpath == NULL) {
+    if (ninherited == 0 && settings.socketpath == NULL) {
         int udp_port;
 
         if (server_socket(settings.port, 0)) {
@@ -2795,26 +4120,86 @@ int main (int argc, char **argv) {
         }
     }
     
+    /* the env is ours once the previous process has closed it */
+    if (handoff_wait() != 0)
+        exit(EXIT_FAILURE);
+
+    /* the status port is up through recovery */
+    if (settings.status_port > 0 && startup_status_listen(settings.status_port) != 0) {
+        fprintf(stderr, "failed to listen on status port %d\n", settings.status_port);
+        exit(EXIT_FAILURE);
+    }
+
     /* here we init bdb env and open db */
     bdb_env_init();
     bdb_db_open();
+    dict_init();
+    bloom_init();
+    negcache_init();
+
+    /* -g loads the keyspace, then we are done */
+    if (load_file != NULL) {
+        int ret = bulk_load(load_file);
+        bloom_close();
+        dict_close();
+        bdb_chkpoint();
+        bdb_db_close();
+        bloom_save();
+        bdb_env_close();
+        exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
     /* start checkpoint and deadlock detect thread */
     start_chkpoint_thread();
     start_memp_trickle_thread();
     start_dl_detect_thread();
 
+    /* warm the cache up from the last run's hot keys, maybe before serving */
+    warmup_init();
+    if (bdb_settings.warmup_wait > 0 && !warmup_wait(bdb_settings.warmup_wait))
+        fprintf(stderr, "warm-up is not done after %d seconds, serving anyway\n",
+                bdb_settings.warmup_wait);
+    startup_set_phase(STARTUP_SERVING);
+
+    /* the main thread is libevent thread 0 from here on */
+    affinity_worker(0);
+
+    /* the next process can take the sockets over, and a signal drains */
+    if (handoff_listen(main_base, listen_fds, nlisten_fds) != 0)
+        fprintf(stderr, "can't offer the listening sockets to a new process\n");
+    for (i = 0; i < 3; i++) {
+        signal_set(&drain_events[i], drain_signals[i], drain_signal, NULL);
+        event_base_set(main_base, &drain_events[i]);
+        if (signal_add(&drain_events[i], 0) == -1)
+            perror("signal_add");
+    }
+
     /* enter the event loop */
     event_base_loop(main_base, 0);
+
+    /* a drain is done, stop the other threads as sig_handler() would */
+    daemon_quit = 1;
+
+    /* no client is left to use the db, nor a background job */
+    thread_shutdown();
+    compact_close();
+    dump_close();
+    backup_close();
+    warmup_close();
+    bloom_close();
+    bdb_threads_close();
     
     /* cleanup bdb staff */
     fprintf(stderr, "try to clean up bdb resource...\n");
+    dict_close();
     bdb_chkpoint();
     bdb_db_close();
+    bloom_save();
     bdb_env_close();
+    handed_over = handoff_done();
     
-    /* remove the PID file if we're a daemon */
-    if (daemonize)
+    /* remove the PID file if we're a daemon, and no new process took over */
+    if (daemonize && !handed_over)
         remove_pidfile(pid_file);
     /* Clean up strdup() call for bind() address */
     if (settings.inter)
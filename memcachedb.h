@@ -65,6 +65,13 @@
 
 #define RGET_MAX_ITEMS 100
 
+/* most databases a keyspace can be hashed across */
+#define MAX_DB_SHARDS 256
+
+/* most keyspaces, and the longest name, "use" can pick from */
+#define MAX_NAMESPACES 32
+#define NS_NAME_LENGTH 32
+
 /* Get a consistent bool type */
 #if HAVE_STDBOOL_H
 # include <stdbool.h>
@@ -113,8 +120,27 @@ struct stats {
     time_t        started;          /* when the process was started */
     uint64_t      bytes_read;
     uint64_t      bytes_written;
+    uint64_t      deadlocks;        /* db calls picked as deadlock victims */
+    uint64_t      deadlock_retries;
+    uint64_t      deadlock_failures; /* still deadlocked after the last retry */
 };
 
+/*
+ * per shard counters, bumped with relaxed atomic adds (SHARD_STATS_INC)
+ * outside STATS_LOCK and read with atomic loads; each shard is on a cache
+ * line of its own
+ */
+struct shard_stats {
+    uint64_t      gets;
+    uint64_t      puts;
+    uint64_t      deletes;
+} __attribute__((aligned(64)));
+
+#define SHARD_STATS_INC(ns, shard, field) \
+    __atomic_fetch_add(&(ns)->stats[shard].field, 1, __ATOMIC_RELAXED)
+
+#define KEY_MAX_LENGTH 250
+
 #define MAX_VERBOSITY_LEVEL 2
 
 struct settings {
@@ -127,6 +153,12 @@ struct settings {
     char *socketpath;   /* path to unix socket if using local socket */
     int access;  /* access mask (a la chmod) for unix domain socket */
     int num_threads;        /* number of libevent threads to run */
+    int num_storage_threads; /* threads running db calls for them, 0 for none */
+    bool reuseport;     /* each thread accepts on its own SO_REUSEPORT socket */
+    bool use_uring;     /* TCP conns do their I/O through io_uring if they can */
+    int status_port;    /* answers startup status from before recovery, 0 for none */
+    bool read_only_until_ready; /* refuse writes until the startup is done */
+    bool takeover;      /* take the listening sockets of a process serving the env home */
 };
 
 extern struct stats stats;
@@ -144,16 +176,28 @@ struct bdb_settings {
     char *db_file;    /* db filename, where dbfile located. */
     char *env_home;    /* db env home dir path */
     char *log_home;    /* db log home dir path*/
+    char *backup_dir;  /* where db_backup may create archives, NULL for nowhere */
+    char *dump_dir;    /* where db_dump may create its directories, NULL for nowhere */
     u_int64_t cache_size; /* cache size */
     u_int32_t txn_lg_bsize; /* transaction log buffer size */
     u_int32_t page_size;    /* underlying database pagesize*/
     DBTYPE db_type;
     int txn_nosync;    /* DB_TXN_NOSYNC flag, if 1 will lose transaction's durability for performance */
     int log_auto_remove;    /* DB_LOG_AUTO_REMOVE flag, if 1 will make catastrophic recovery impossible. */
-    int dldetect_val; /* do deadlock detect every *db_lock_detect_val* millisecond, 0 for disable */
-    int chkpoint_val;  /* do checkpoint every *db_chkpoint_val* second, 0 for disable */
+    int dldetect_val; /* also poll for deadlocks every *db_lock_detect_val* millisecond, 0 for disable */
+    int chkpoint_val;  /* do checkpoint at least every *db_chkpoint_val* second, 0 for disable */
+    int chkpoint_kbyte; /* do checkpoint once *chkpoint_kbyte* kbytes of log are written, 0 for disable, -1 until defaulted */
+    int chkpoint_dirty_percent; /* do checkpoint once this percent of the cache is dirty, 0 for disable, -1 until defaulted */
+    int chkpoint_rate; /* flush dirty pages ahead of a checkpoint at most *chkpoint_rate* kbytes a second, 0 for no limit */
     int memp_trickle_val;  /* do memp_trickle every *memp_trickle_val* second, 0 for disable */
     int memp_trickle_percent; /* percent of the pages in the cache that should be clean.*/
+    int dict_min_size; /* compress values of at least *dict_min_size* bytes against the trained dictionary, 0 for disable */
+    int db_nshards;  /* number of databases the keyspace is hashed across, fixed when the db file is created */
+    double bloom_fp_rate; /* false positive rate of the key filters, 0 for disable */
+    int negcache_size; /* number of recently missed keys to remember, 0 for disable */
+    int hotkeys_val; /* save the hottest keys every *hotkeys_val* second to warm up from, 0 for disable */
+    int warmup_wait; /* wait up to *warmup_wait* seconds for the warm-up before serving, 0 for not */
+    int bulk_load; /* open the databases DB_TXN_NOT_DURABLE, for -g */
     u_int32_t db_flags; /* database open flags */
     u_int32_t env_flags; /* env open flags */
 
@@ -199,6 +243,25 @@ struct bdb_settings {
 extern struct bdb_settings bdb_settings;
 extern struct bdb_version bdb_version;
 
+struct bloom;
+
+/* a named keyspace, kept in its own db file with its own tuning */
+struct bdb_ns {
+    char name[NS_NAME_LENGTH + 1];
+    char *db_file;    /* db filename, "<name>.db" but for the default one */
+    DBTYPE db_type;
+    u_int32_t page_size;
+    int dict_min_size;  /* as bdb_settings, per keyspace */
+    DB_CACHE_PRIORITY priority;  /* its pages' share of the cache */
+    int nshards;  /* number of databases in the file */
+    DB *dbps[MAX_DB_SHARDS];
+    struct shard_stats stats[MAX_DB_SHARDS];  /* see SHARD_STATS_INC */
+    struct bloom *bloom;  /* filter of the keys it holds, NULL if none */
+};
+
+extern struct bdb_ns bdb_ns[];
+extern int bdb_nns;
+
 typedef struct _stritem {
     int             nbytes;     /* size of data */
     uint8_t         nsuffix;    /* length of flags-and-length string */
@@ -224,6 +287,7 @@ enum conn_states {
     conn_swallow,    /** swallowing unnecessary bytes w/o storing */
     conn_closing,    /** closing this connection */
     conn_mwrite,     /** writing out many items sequentially */
+    conn_waiting,    /** parked while a storage thread runs its command */
 };
 
 #define NREAD_ADD 1
@@ -240,7 +304,7 @@ struct conn {
     short  ev_flags;
     short  which;   /** which events were just triggered */
 
-    char   *rbuf;   /** buffer to read commands into */
+    char   *rbuf;   /** buffer to read commands into, NULL while idle */
     char   *rcurr;  /** but if we parsed some already, this is where we stopped */
     int    rsize;   /** total allocated size of rbuf */
     int    rbytes;  /** how much data, starting from rcur, do we have unparsed */
@@ -249,6 +313,7 @@ struct conn {
     char   *wcurr;
     int    wsize;
     int    wbytes;
+    int    wused;   /** wbuf bytes held by replies queued ahead of this one */
     int    write_and_go; /** which state to go into after finishing current write */
     void   *write_and_free; /** free this memory after finishing writing */
 
@@ -279,6 +344,9 @@ struct conn {
     int    msgused;   /* number of elements used in msglist[] */
     int    msgcurr;   /* element in msglist[] being transmitted now */
     int    msgbytes;  /* number of bytes in current msg */
+    int    iovmark;   /* iov[] entries of the replies queued ahead of this one */
+    bool   replies_queued; /* replies to pipelined commands wait to go out together */
+    bool   replies_sending; /* and have started going out, so take no more */
 
     item   **ilist;   /* list of items to write out */
     int    isize;
@@ -292,7 +360,58 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_batch *udp_batch; /* datagrams read ahead of this one */
+    bool   udp_unbatched; /* couldn't get the buffers for a batch */
     conn   *next;     /* Used for generating a list of conn structures */
+    struct bdb_ns *ns;  /* keyspace picked by "use", the default one at first */
+
+    /* data for the waiting state */
+    char   *job_command; /* command line to run, NULL to finish an nread */
+    size_t job_ncommand; /* and its length */
+    char   *job_cont;    /* where the next command line starts */
+    conn   *job_next;    /* next conn in a storage job queue */
+
+    /* data for the io_uring backend */
+    struct uring *uring; /* NULL if the conn's I/O goes through libevent */
+    int    uring_rhead;  /* received buffers not yet read, by buffer id */
+    int    uring_rtail;
+    int    uring_rcount; /* how many buffers that is */
+    int    uring_rerr;   /* what ended the receive: -1 for EOF, or an errno */
+    bool   uring_armed;  /* a multishot receive is in flight */
+    bool   uring_sending; /* a sendmsg is in flight */
+    bool   uring_starved; /* waiting for receive buffers to come back */
+    bool   uring_paused; /* receive stopped until the conn reads what it has */
+    bool   uring_closing; /* closed, waiting for its send to come back */
+    conn   *uring_next;  /* next conn waiting for receive buffers */
+
+    /* every conn, for draining them at shutdown */
+    conn   *all_prev;
+    conn   *all_next;
+};
+
+/* what the checkpoint thread decided, for "stats bdb" */
+struct chkpoint_stats {
+    unsigned int count;            /* checkpoints done */
+    const char *last_reason;       /* what set the last one off: log, dirty or interval */
+    time_t last_time;
+    unsigned int last_msecs;       /* how long it took, writing ahead included */
+    unsigned int last_log_kbyte;   /* log written before it */
+    unsigned int last_dirty_percent;
+    unsigned int log_kbyte;        /* log written since, as of the last look */
+    unsigned int dirty_percent;
+    u_int64_t pages_written;       /* by the rate limited writing ahead */
+};
+
+/* what the memp_trickle thread is doing, for "stats trickle" */
+struct trickle_stats {
+    int percent;                   /* clean pages aimed at now */
+    int interval;                  /* seconds between trickles now */
+    unsigned int runs;
+    u_int64_t pages_written;
+    u_int64_t dirty_evictions;     /* dirty pages readers had to write out themselves */
+    unsigned int last_dirty_evictions; /* of those, in the last second */
+    unsigned int dirty_percent;
+    unsigned int hit_percent;      /* cache hits in the last second */
 };
 
 /*
@@ -306,38 +425,169 @@ void bdb_db_open(void);
 void start_chkpoint_thread(void);
 void start_memp_trickle_thread(void);
 void start_dl_detect_thread(void);
+void bdb_threads_close(void);
 void bdb_db_close(void);
 void bdb_env_close(void);
 void bdb_chkpoint(void);
+bool bdb_retry(int ret, int *attempt);
+bool bdb_backoff(int *attempt);
+void bdb_retry_defer(bool *deadlocked);
+int bdb_export_dir(const char *dir, char *path);
 int bdb_defcmp(void *a, size_t i, void *b, size_t j);
+int bdb_ns_add(char *spec);
+struct bdb_ns *bdb_ns_find(const char *name, size_t nname);
+int bdb_shard(struct bdb_ns *ns, const char *key, size_t nkey);
 
 /* item management */
 void item_init(void);
 item *do_item_from_freelist(void);
 int do_item_add_to_freelist(item *it);
+int do_item_take_from_freelist(item **its, int n);
 item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbytes);
 item *item_alloc2(size_t ntotal);
 int item_free(item *it);
-item *item_get(char *key, size_t nkey);
-int item_put(char *key, size_t nkey, item *it);
-int item_delete(char *key, size_t nkey);
-int item_exists(char *key, size_t nkey);
+int item_free_buf(void *it, size_t ntotal);
+item *item_get(struct bdb_ns *ns, char *key, size_t nkey, bool *failed);
+int item_put(struct bdb_ns *ns, char *key, size_t nkey, item *it);
+int item_delete(struct bdb_ns *ns, char *key, size_t nkey);
+int item_exists(struct bdb_ns *ns, char *key, size_t nkey);
 item *item_cget(DBC *cursorp, char *start, size_t nstart, u_int32_t flags);
 
+/* dictionary compression */
+void dict_init(void);
+int dict_train_start(void);
+void dict_close(void);
+void dict_db_name(char *buf, size_t len);
+bool dict_is_deflated(const void *buf, size_t size);
+void *dict_deflate(item *it, size_t *nzip);
+item *dict_inflate(const void *buf, size_t size);
+void stats_dict(char *temp);
+
+/* key filters */
+void bloom_init(void);
+void bloom_close(void);
+void bloom_save(void);
+bool bloom_check(struct bdb_ns *ns, const char *key, size_t nkey);
+void bloom_add(struct bdb_ns *ns, const char *key, size_t nkey);
+void stats_bloom(char *temp);
+
+/* io_uring backend */
+struct uring;
+int uring_attach(struct event_base *base);
+int uring_count(void);
+bool uring_conn_attach(conn *c, struct event_base *base);
+bool uring_conn_close(conn *c);
+ssize_t uring_recv(conn *c, void *buf, size_t len);
+bool uring_sendmsg(conn *c, struct msghdr *m);
+
+/* UDP request reassembly and batched I/O */
+struct udp_batch;
+int udp_reasm_add(conn *c, int len);
+int udp_recv(conn *c);
+void udp_batch_free(conn *c);
+int udp_send(int sfd, struct msghdr *msgs, int n, size_t *bytes);
+
+/* background compaction */
+int compact_start(int pages, int msecs);
+int compact_pause(void);
+int compact_resume(void);
+int compact_cancel(void);
+void compact_close(void);
+void stats_compact(char *temp);
+
+/* bulk load */
+int bulk_load(const char *path);
+
+/* hot backup */
+int backup_start(const char *dest, int rate);
+int backup_cancel(void);
+bool backup_running(void);
+void backup_close(void);
+void stats_backup(char *temp);
+
+/* parallel dump */
+int dump_start(const char *dir, int nthreads, bool gzip);
+int dump_cancel(void);
+void dump_close(void);
+void stats_dump(char *temp);
+
+/* cache warm-up */
+void warmup_init(void);
+void warmup_touch(struct bdb_ns *ns, const char *key, size_t nkey);
+int warmup_save(void);
+void warmup_close(void);
+bool warmup_wait(int secs);
+bool warmup_running(void);
+void stats_warmup(char *temp);
+
+/* startup progress */
+enum startup_phase { STARTUP_STARTING, STARTUP_RECOVERING, STARTUP_ELECTING,
+                     STARTUP_OPENING, STARTUP_SERVING,
+                     /* what is left while serving */
+                     STARTUP_SYNCING, STARTUP_WARMING, STARTUP_READY };
+void startup_set_phase(enum startup_phase phase);
+bool startup_ready(void);
+bool startup_writable(void);
+void startup_recovery_begin(void);
+void startup_recovery_end(DB_ENV *dbenv);
+void startup_feedback(DB_ENV *dbenv, int opcode, int percent);
+void startup_rep_event(u_int32_t which);
+bool startup_wait_role(int secs);
+void startup_wait_event(int secs);
+int startup_status_listen(int port);
+void stats_startup(char *temp);
+
+/* connection draining and socket handoff */
+#define HANDOFF_MAX_FDS 64
+void conn_drain_start(void);
+void conn_close_thread(void *arg);
+int handoff_receive(int *fds, int max);
+void handoff_answer(bool take);
+int handoff_wait(void);
+int handoff_listen(struct event_base *base, int *fds, int nfds);
+bool handoff_done(void);
+
+/* cpu affinity */
+void affinity_init(void);
+int affinity_set_workers(const char *spec);
+int affinity_set_housekeeping(const char *spec);
+bool affinity_workers_pinned(void);
+void affinity_worker(int n);
+void affinity_storage(void);
+void affinity_housekeeping(void);
+
+/* negative cache */
+void negcache_init(void);
+bool negcache_lookup(struct bdb_ns *ns, const char *key, size_t nkey, uint64_t *gen);
+void negcache_insert(struct bdb_ns *ns, const char *key, size_t nkey, uint64_t gen);
+void negcache_invalidate(struct bdb_ns *ns, const char *key, size_t nkey);
+void negcache_stats(uint64_t *lookups, uint64_t *hits, uint64_t *inserts);
+void negcache_stats_reset(void);
+
 /* bdb related stats */
 void stats_bdb(char *temp);
+void stats_trickle(char *temp);
 void stats_rep(char *temp);
 void stats_repmgr(char *temp);
 void stats_repcfg(char *temp);
 void stats_repms(char *temp);
+void stats_shards(char *temp, struct bdb_ns *ns);
+void stats_ns(char *temp);
 
 /* conn management */
 conn *do_conn_from_freelist();
 bool do_conn_add_to_freelist(conn *c);
+char *do_rbuf_from_freelist(void);
+int do_rbuf_take_from_freelist(char **bufs, int n);
+bool do_rbuf_add_to_freelist(char *buf);
 conn *conn_new(const int sfd, const int init_state, const int event_flags, const int read_buffer_size, const bool is_udp, struct event_base *base);
+void conn_run_job(conn *c);
+void conn_resume(conn *c);
+void conn_send_done(conn *c, int res);
+void conn_close_done(conn *c);
 
-char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey);
-int do_store_item(item *item, int comm);
+char *do_add_delta(struct bdb_ns *ns, const bool incr, const int64_t delta, char *buf, char *key, size_t nkey);
+int do_store_item(struct bdb_ns *ns, item *item, int comm);
 
 /*
  * In multithreaded mode, we wrap certain functions with lock management and
@@ -355,43 +605,57 @@ int do_store_item(item *item, int comm);
 #ifdef USE_THREADS
 
 void thread_init(int nthreads, struct event_base *main_base);
+void thread_shutdown(void);
 int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(int sfd, int init_state, int event_flags, int read_buffer_size, int is_udp);
+void dispatch_storage_job(conn *c);
+void dispatch_thread_call(struct event_base *base, void (*func)(void *), void *arg);
+void dispatch_thread_all(void (*func)(void *));
 
 /* Lock wrappers for cache functions that are called from main loop. */
-char *mt_add_delta(const int incr, const int64_t delta, char *buf, char *key, size_t nkey);
+char *mt_add_delta(struct bdb_ns *ns, const int incr, const int64_t delta, char *buf, char *key, size_t nkey);
 conn *mt_conn_from_freelist(void);
 bool  mt_conn_add_to_freelist(conn *c);
 int   mt_is_listen_thread(void);
 item *mt_item_from_freelist(void);
 int mt_item_add_to_freelist(item *it);
+char *mt_rbuf_from_freelist(void);
+bool  mt_rbuf_add_to_freelist(char *buf);
 void  mt_stats_lock(void);
 void  mt_stats_unlock(void);
-int   mt_store_item(item *item, int comm);
+int   mt_store_item(struct bdb_ns *ns, item *item, int comm);
 
-# define add_delta(x,y,z,a,b)        mt_add_delta(x,y,z,a,b)
+# define add_delta(n,x,y,z,a,b)      mt_add_delta(n,x,y,z,a,b)
 # define conn_from_freelist()        mt_conn_from_freelist()
 # define conn_add_to_freelist(x)     mt_conn_add_to_freelist(x)
 # define is_listen_thread()          mt_is_listen_thread()
 # define item_from_freelist()        mt_item_from_freelist()
 # define item_add_to_freelist(x)     mt_item_add_to_freelist(x)
-# define store_item(x,y)             mt_store_item(x,y)
+# define rbuf_from_freelist()        mt_rbuf_from_freelist()
+# define rbuf_add_to_freelist(x)     mt_rbuf_add_to_freelist(x)
+# define store_item(n,x,y)           mt_store_item(n,x,y)
 
 # define STATS_LOCK()                mt_stats_lock()
 # define STATS_UNLOCK()              mt_stats_unlock()
 
 #else /* !USE_THREADS */
 
-# define add_delta(x,y,z,a,b)         do_add_delta(x,y,z,a,b)
+# define add_delta(n,x,y,z,a,b)       do_add_delta(n,x,y,z,a,b)
 # define conn_from_freelist()         do_conn_from_freelist()
 # define conn_add_to_freelist(x)      do_conn_add_to_freelist(x)
 # define dispatch_conn_new(x,y,z,a,b) conn_new(x,y,z,a,b,main_base)
 # define dispatch_event_add(t,c)      event_add(&(c)->event, 0)
+# define dispatch_storage_job(c)      (conn_run_job(c), conn_resume(c))
+# define dispatch_thread_call(b,f,a)  (f)(a)
+# define dispatch_thread_all(f)       (f)(main_base)
 # define is_listen_thread()           1
 # define item_from_freelist()         do_item_from_freelist()
 # define item_add_to_freelist(x)      do_item_add_to_freelist(x)
-# define store_item(x,y)              do_store_item(x,y)
+# define rbuf_from_freelist()         do_rbuf_from_freelist()
+# define rbuf_add_to_freelist(x)      do_rbuf_add_to_freelist(x)
+# define store_item(n,x,y)            do_store_item(n,x,y)
 # define thread_init(x,y)             0
+# define thread_shutdown()            conn_close_thread(main_base)
 
 # define STATS_LOCK()                /**/
 # define STATS_UNLOCK()              /**/
@@ -404,5 +668,6 @@ int   mt_store_item(item *item, int comm);
     memset(&dbdata, 0, sizeof(dbdata))
 
 extern DB_ENV *env;
-extern DB *dbp;
 extern int daemon_quit;
+extern struct chkpoint_stats chkpoint_stats;
+extern struct trickle_stats trickle_stats;
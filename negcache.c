@@ -0,0 +1,214 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Negative cache: keys recently looked up and not found.
+ *
+ *  Clients polling for a key that doesn't exist yet would otherwise take
+ *  a db get for every poll. A small set-associative table remembers the
+ *  misses and answers them from memory until the key is stored.
+ *
+ *  A miss may be remembered only if no store of the key finished while
+ *  the lookup was going to disk. Every store bumps the generation of the
+ *  key's lock stripe once it is done, and a miss is only cached if the
+ *  generation it started under is still current.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NEGCACHE_WAYS 4
+#define NEGCACHE_LOCKS 64
+
+struct negcache_entry {
+    struct bdb_ns *ns;      /* NULL for an empty slot */
+    uint64_t    hash;
+    uint32_t    stamp;      /* when last used, to pick a victim */
+    size_t      nkey;
+    char        *key;
+};
+
+struct negcache_stripe {
+    pthread_mutex_t lock;
+    uint64_t    gen;        /* bumped by every store */
+    uint32_t    clock;
+    uint64_t    lookups;
+    uint64_t    hits;
+    uint64_t    inserts;
+};
+
+static struct negcache_entry *negcache;
+static uint64_t negcache_nsets = 0;
+static struct negcache_stripe negcache_stripes[NEGCACHE_LOCKS];
+
+static uint64_t negcache_hash(struct bdb_ns *ns, const char *key, size_t nkey) {
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)(ns - bdb_ns);
+
+    while (nkey-- > 0) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Sizes the cache for *bdb_settings.negcache_size* keys. Replicas don't
+ * get one: replicated writes never pass negcache_invalidate().
+ */
+void negcache_init(void) {
+    int i;
+
+    for (i = 0; i < NEGCACHE_LOCKS; i++)
+        pthread_mutex_init(&negcache_stripes[i].lock, NULL);
+
+    if (bdb_settings.negcache_size <= 0 || bdb_settings.is_replicated)
+        return;
+
+    negcache_nsets = (bdb_settings.negcache_size + NEGCACHE_WAYS - 1) / NEGCACHE_WAYS;
+    negcache = calloc(negcache_nsets * NEGCACHE_WAYS, sizeof(struct negcache_entry));
+    if (negcache == NULL) {
+        fprintf(stderr, "failed to allocate the negative cache, disabled\n");
+        negcache_nsets = 0;
+    }
+}
+
+static struct negcache_entry *negcache_find(struct negcache_entry *set, struct bdb_ns *ns,
+                                            uint64_t hash, const char *key, size_t nkey) {
+    int i;
+
+    for (i = 0; i < NEGCACHE_WAYS; i++) {
+        if (set[i].ns == ns && set[i].hash == hash && set[i].nkey == nkey &&
+            memcmp(set[i].key, key, nkey) == 0)
+            return &set[i];
+    }
+    return NULL;
+}
+
+/*
+ * Returns true if *key* is known to be missing. Otherwise *gen* is set to
+ * what negcache_insert() needs, should the key then turn out missing.
+ */
+bool negcache_lookup(struct bdb_ns *ns, const char *key, size_t nkey, uint64_t *gen) {
+    uint64_t hash, set;
+    struct negcache_stripe *st;
+    struct negcache_entry *e;
+
+    if (negcache_nsets == 0)
+        return false;
+
+    hash = negcache_hash(ns, key, nkey);
+    set = hash % negcache_nsets;
+    st = &negcache_stripes[set % NEGCACHE_LOCKS];
+
+    pthread_mutex_lock(&st->lock);
+    st->lookups++;
+    e = negcache_find(&negcache[set * NEGCACHE_WAYS], ns, hash, key, nkey);
+    if (e != NULL) {
+        e->stamp = ++st->clock;
+        st->hits++;
+    }
+    *gen = st->gen;
+    pthread_mutex_unlock(&st->lock);
+    return e != NULL;
+}
+
+/* remember a miss, unless a store of the key came in since the lookup */
+void negcache_insert(struct bdb_ns *ns, const char *key, size_t nkey, uint64_t gen) {
+    uint64_t hash, set;
+    struct negcache_stripe *st;
+    struct negcache_entry *e, *victim;
+    char *copy;
+    int i;
+
+    if (negcache_nsets == 0)
+        return;
+
+    hash = negcache_hash(ns, key, nkey);
+    set = hash % negcache_nsets;
+    st = &negcache_stripes[set % NEGCACHE_LOCKS];
+
+    pthread_mutex_lock(&st->lock);
+    e = &negcache[set * NEGCACHE_WAYS];
+    if (st->gen != gen || negcache_find(e, ns, hash, key, nkey) != NULL) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    /* an empty slot, or else the least recently used */
+    victim = &e[0];
+    for (i = 0; i < NEGCACHE_WAYS; i++) {
+        if (e[i].ns == NULL) {
+            victim = &e[i];
+            break;
+        }
+        if ((int32_t)(e[i].stamp - victim->stamp) < 0)
+            victim = &e[i];
+    }
+    if (victim->ns == NULL || victim->nkey < nkey) {
+        if ((copy = realloc(victim->key, nkey)) == NULL) {
+            pthread_mutex_unlock(&st->lock);
+            return;
+        }
+        victim->key = copy;
+    }
+    memcpy(victim->key, key, nkey);
+    victim->nkey = nkey;
+    victim->hash = hash;
+    victim->ns = ns;
+    victim->stamp = ++st->clock;
+    st->inserts++;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* forget *key*, call once a store of it is done, whether it worked or not */
+void negcache_invalidate(struct bdb_ns *ns, const char *key, size_t nkey) {
+    uint64_t hash, set;
+    struct negcache_stripe *st;
+    struct negcache_entry *e;
+
+    if (negcache_nsets == 0)
+        return;
+
+    hash = negcache_hash(ns, key, nkey);
+    set = hash % negcache_nsets;
+    st = &negcache_stripes[set % NEGCACHE_LOCKS];
+
+    pthread_mutex_lock(&st->lock);
+    st->gen++;
+    e = negcache_find(&negcache[set * NEGCACHE_WAYS], ns, hash, key, nkey);
+    if (e != NULL) {
+        /* keep the buffer for the next key that lands here */
+        e->ns = NULL;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* totals over all stripes, for "stats" */
+void negcache_stats(uint64_t *lookups, uint64_t *hits, uint64_t *inserts) {
+    int i;
+
+    *lookups = *hits = *inserts = 0;
+    for (i = 0; i < NEGCACHE_LOCKS; i++) {
+        pthread_mutex_lock(&negcache_stripes[i].lock);
+        *lookups += negcache_stripes[i].lookups;
+        *hits += negcache_stripes[i].hits;
+        *inserts += negcache_stripes[i].inserts;
+        pthread_mutex_unlock(&negcache_stripes[i].lock);
+    }
+}
+
+void negcache_stats_reset(void) {
+    int i;
+
+    for (i = 0; i < NEGCACHE_LOCKS; i++) {
+        pthread_mutex_lock(&negcache_stripes[i].lock);
+        negcache_stripes[i].lookups = 0;
+        negcache_stripes[i].hits = 0;
+        negcache_stripes[i].inserts = 0;
+        pthread_mutex_unlock(&negcache_stripes[i].lock);
+    }
+}
@@ -0,0 +1,312 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Startup progress and readiness.
+ *
+ *  Startup goes through phases: the env is opened and recovered, a
+ *  replica waits to learn its role, then the databases are opened. Once
+ *  serving, the server is ready unless a replica is still syncing from
+ *  its master or the cache is still warming up. Recovery reports how far
+ *  it is through the BerkeleyDB feedback callback, on stderr every 10%.
+ *
+ *  The phase is in "stats startup", and with -V on a port of its own
+ *  that answers every connection with the same lines and closes it. That
+ *  port is up before recovery starts, so a deploy can watch a long one.
+ *  With -Z, writes are refused until the server is ready, so a replica
+ *  catching up or a cold cache can serve reads meanwhile.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <db.h>
+
+static const char *startup_phase_names[] = {
+    "starting", "recovering", "electing", "opening", "serving", "syncing", "warming", "ready"
+};
+
+static struct {
+    enum startup_phase phase;
+    time_t started;
+    int recovery_percent;
+    int recovery_reported;      /* last 10% step on stderr */
+    time_t recovery_started;
+    time_t recovery_finished;
+    long first_log;             /* log files to recover, -1 if none */
+    long last_log;
+    u_int32_t lsn_file;         /* end of the log once recovered */
+    u_int32_t lsn_offset;
+    bool rep_startup_done;
+    u_int64_t rep_events;
+} startup = { STARTUP_STARTING, 0, 0, 0, 0, 0, -1, -1, 0, 0, false, 0 };
+
+static pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+
+void startup_set_phase(enum startup_phase phase) {
+    pthread_mutex_lock(&startup_lock);
+    if (startup.started == 0)
+        startup.started = time(NULL);
+    startup.phase = phase;
+    pthread_mutex_unlock(&startup_lock);
+}
+
+/* the phase now, STARTUP_SERVING is broken down into what is left */
+static enum startup_phase startup_phase_now(void) {
+    if (startup.phase != STARTUP_SERVING)
+        return startup.phase;
+    if (bdb_settings.is_replicated && bdb_settings.rep_whoami == MDB_CLIENT &&
+        !startup.rep_startup_done)
+        return STARTUP_SYNCING;
+    if (warmup_running())
+        return STARTUP_WARMING;
+    return STARTUP_READY;
+}
+
+bool startup_ready(void) {
+    bool ready;
+
+    pthread_mutex_lock(&startup_lock);
+    ready = startup_phase_now() == STARTUP_READY;
+    pthread_mutex_unlock(&startup_lock);
+    return ready;
+}
+
+/* false while -Z holds writes back */
+bool startup_writable(void) {
+    return !settings.read_only_until_ready || startup_ready();
+}
+
+/* finds the range of log files in the log dir, for the record */
+static void startup_scan_logs(void) {
+    const char *dir = bdb_settings.log_home != NULL ? bdb_settings.log_home : bdb_settings.env_home;
+    struct dirent *de;
+    DIR *dp;
+    char *end;
+    long n;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+    while ((de = readdir(dp)) != NULL) {
+        if (strncmp(de->d_name, "log.", 4) != 0)
+            continue;
+        n = strtol(de->d_name + 4, &end, 10);
+        if (end == de->d_name + 4 || *end != '\0')
+            continue;
+        if (startup.first_log < 0 || n < startup.first_log)
+            startup.first_log = n;
+        if (n > startup.last_log)
+            startup.last_log = n;
+    }
+    closedir(dp);
+}
+
+/* called around env->open(), which runs recovery */
+void startup_recovery_begin(void) {
+    startup_set_phase(STARTUP_RECOVERING);
+    pthread_mutex_lock(&startup_lock);
+    startup_scan_logs();
+    startup.recovery_started = time(NULL);
+    pthread_mutex_unlock(&startup_lock);
+    if (startup.last_log >= 0) {
+        fprintf(stderr, "recovery: log files %ld to %ld\n", startup.first_log, startup.last_log);
+    }
+}
+
+void startup_recovery_end(DB_ENV *dbenv) {
+    DB_LOG_STAT *lsp;
+
+    pthread_mutex_lock(&startup_lock);
+    startup.recovery_finished = time(NULL);
+    startup.recovery_percent = 100;
+    if (dbenv->log_stat(dbenv, &lsp, 0) == 0) {
+        startup.lsn_file = lsp->st_cur_file;
+        startup.lsn_offset = lsp->st_cur_offset;
+        free(lsp);
+    }
+    pthread_mutex_unlock(&startup_lock);
+    fprintf(stderr, "recovery: done in %ld seconds, log at %u/%u\n",
+            (long)(startup.recovery_finished - startup.recovery_started),
+            startup.lsn_file, startup.lsn_offset);
+}
+
+/* the env's feedback callback */
+void startup_feedback(DB_ENV *dbenv, int opcode, int percent) {
+    if (opcode != DB_RECOVER)
+        return;
+    pthread_mutex_lock(&startup_lock);
+    startup.recovery_percent = percent;
+    if (percent / 10 > startup.recovery_reported) {
+        startup.recovery_reported = percent / 10;
+        fprintf(stderr, "recovery: %d%%, %ld seconds\n", percent,
+                (long)(time(NULL) - startup.recovery_started));
+    }
+    pthread_mutex_unlock(&startup_lock);
+}
+
+/* called from the replication event callback */
+void startup_rep_event(u_int32_t which) {
+    pthread_mutex_lock(&startup_lock);
+    if (which == DB_EVENT_REP_STARTUPDONE)
+        startup.rep_startup_done = true;
+    startup.rep_events++;
+    pthread_cond_broadcast(&startup_cond);
+    pthread_mutex_unlock(&startup_lock);
+}
+
+static void startup_deadline(struct timespec *until, int secs) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    until->tv_sec = now.tv_sec + secs;
+    until->tv_nsec = now.tv_usec * 1000;
+}
+
+/*
+ * Waits for the replication role to be known, at most *secs* seconds.
+ * Returns false if it still isn't.
+ */
+bool startup_wait_role(int secs) {
+    struct timespec until;
+    bool known;
+
+    startup_deadline(&until, secs);
+    pthread_mutex_lock(&startup_lock);
+    while (bdb_settings.rep_whoami == MDB_UNKNOWN &&
+           pthread_cond_timedwait(&startup_cond, &startup_lock, &until) != ETIMEDOUT)
+        ;
+    known = bdb_settings.rep_whoami != MDB_UNKNOWN;
+    pthread_mutex_unlock(&startup_lock);
+    return known;
+}
+
+/* waits for the next replication event, at most *secs* seconds */
+void startup_wait_event(int secs) {
+    struct timespec until;
+    u_int64_t seen;
+
+    startup_deadline(&until, secs);
+    pthread_mutex_lock(&startup_lock);
+    seen = startup.rep_events;
+    while (startup.rep_events == seen &&
+           pthread_cond_timedwait(&startup_cond, &startup_lock, &until) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&startup_lock);
+}
+
+void stats_startup(char *temp) {
+    char *pos = temp;
+    enum startup_phase phase;
+
+    pthread_mutex_lock(&startup_lock);
+    phase = startup_phase_now();
+    pos += sprintf(pos, "STAT startup_phase %s\r\n", startup_phase_names[phase]);
+    pos += sprintf(pos, "STAT startup_ready %d\r\n", phase == STARTUP_READY);
+    pos += sprintf(pos, "STAT startup_writable %d\r\n",
+                   !settings.read_only_until_ready || phase == STARTUP_READY);
+    pos += sprintf(pos, "STAT startup_elapsed %ld\r\n",
+                   startup.started != 0 ? (long)(time(NULL) - startup.started) : 0L);
+    if (startup.recovery_started != 0) {
+        pos += sprintf(pos, "STAT recovery_percent %d\r\n", startup.recovery_percent);
+        if (startup.last_log >= 0)
+            pos += sprintf(pos, "STAT recovery_log_files %ld-%ld\r\n", startup.first_log, startup.last_log);
+        if (startup.recovery_finished != 0) {
+            pos += sprintf(pos, "STAT recovery_secs %ld\r\n",
+                           (long)(startup.recovery_finished - startup.recovery_started));
+            pos += sprintf(pos, "STAT recovery_lsn %u/%u\r\n", startup.lsn_file, startup.lsn_offset);
+        }
+    }
+    if (bdb_settings.is_replicated) {
+        pos += sprintf(pos, "STAT rep_role %s\r\n",
+                       bdb_settings.rep_whoami == MDB_MASTER ? "master" :
+                       bdb_settings.rep_whoami == MDB_CLIENT ? "client" : "unknown");
+        pos += sprintf(pos, "STAT rep_startup_done %d\r\n", startup.rep_startup_done);
+    }
+    pos += sprintf(pos, "END");
+    pthread_mutex_unlock(&startup_lock);
+}
+
+static void *startup_status_thread(void *arg) {
+    int sfd = (int)(long)arg, cfd;
+    char temp[1024];
+    size_t len, off;
+    ssize_t n;
+
+    for (;;) {
+        if ((cfd = accept(sfd, NULL, NULL)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept() on the status port");
+            break;
+        }
+        stats_startup(temp);
+        strcat(temp, "\r\n");
+        len = strlen(temp);
+        for (off = 0; off < len; off += n) {
+            if ((n = write(cfd, temp + off, len - off)) <= 0)
+                break;
+        }
+        close(cfd);
+    }
+    close(sfd);
+    return NULL;
+}
+
+/*
+ * Listens on *port* for status requests, from now on. Returns 0, or -1 if
+ * the port can't be had.
+ */
+int startup_status_listen(int port) {
+    struct addrinfo hints, *ai;
+    char port_buf[NI_MAXSERV];
+    pthread_t tid;
+    pthread_attr_t attr;
+    int sfd, flags = 1, error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE|AI_ADDRCONFIG;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_buf, NI_MAXSERV, "%d", port);
+    if ((error = getaddrinfo(settings.inter, port_buf, &hints, &ai)) != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return -1;
+    }
+    if ((sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+        perror("socket()");
+        freeaddrinfo(ai);
+        return -1;
+    }
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    if (bind(sfd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(sfd, 64) == -1) {
+        perror("bind() or listen() on the status port");
+        close(sfd);
+        freeaddrinfo(ai);
+        return -1;
+    }
+    freeaddrinfo(ai);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((errno = pthread_create(&tid, &attr, startup_status_thread, (void *)(long)sfd)) != 0) {
+        fprintf(stderr, "failed spawning status thread: %s\n", strerror(errno));
+        close(sfd);
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
@@ -36,7 +36,7 @@ void stats_bdb(char *temp){
                                                     bdb_version.minver, 
                                                     bdb_version.patch);
     /* get page size */
-    if((ret = dbp->get_pagesize(dbp, &bdb_settings.page_size)) == 0){
+    if((ret = bdb_ns[0].dbps[0]->get_pagesize(bdb_ns[0].dbps[0], &bdb_settings.page_size)) == 0){
         pos += sprintf(pos, "STAT page_size %u\r\n", bdb_settings.page_size);
     }
 
@@ -51,7 +51,7 @@ void stats_bdb(char *temp){
     }
     
     /* get database type */
-    if((ret = dbp->get_type(dbp, &bdb_settings.db_type)) == 0){
+    if((ret = bdb_ns[0].dbps[0]->get_type(bdb_ns[0].dbps[0], &bdb_settings.db_type)) == 0){
         if (bdb_settings.db_type == DB_BTREE){
             pos += sprintf(pos, "STAT db_type btree\r\n");
         }else if (bdb_settings.db_type == DB_HASH){
@@ -68,9 +68,42 @@ void stats_bdb(char *temp){
     pos += sprintf(pos, "STAT txn_nosync %d\r\n", bdb_settings.txn_nosync);
     pos += sprintf(pos, "STAT log_auto_remove %d\r\n", bdb_settings.log_auto_remove);
     pos += sprintf(pos, "STAT dldetect_val %d\r\n", bdb_settings.dldetect_val);
+    STATS_LOCK();
+    pos += sprintf(pos, "STAT deadlocks %llu\r\n", (unsigned long long)stats.deadlocks);
+    pos += sprintf(pos, "STAT deadlock_retries %llu\r\n", (unsigned long long)stats.deadlock_retries);
+    pos += sprintf(pos, "STAT deadlock_failures %llu\r\n", (unsigned long long)stats.deadlock_failures);
+    STATS_UNLOCK();
     pos += sprintf(pos, "STAT chkpoint_val %d\r\n", bdb_settings.chkpoint_val);
+    pos += sprintf(pos, "STAT chkpoint_kbyte %d\r\n", bdb_settings.chkpoint_kbyte);
+    pos += sprintf(pos, "STAT chkpoint_dirty_percent %d\r\n", bdb_settings.chkpoint_dirty_percent);
+    pos += sprintf(pos, "STAT chkpoint_rate %d\r\n", bdb_settings.chkpoint_rate);
+    pos += sprintf(pos, "STAT chkpoint_count %u\r\n", chkpoint_stats.count);
+    pos += sprintf(pos, "STAT chkpoint_last_reason %s\r\n", chkpoint_stats.last_reason);
+    pos += sprintf(pos, "STAT chkpoint_last_time %ld\r\n", (long)chkpoint_stats.last_time);
+    pos += sprintf(pos, "STAT chkpoint_last_msecs %u\r\n", chkpoint_stats.last_msecs);
+    pos += sprintf(pos, "STAT chkpoint_last_log_kbyte %u\r\n", chkpoint_stats.last_log_kbyte);
+    pos += sprintf(pos, "STAT chkpoint_last_dirty_percent %u\r\n", chkpoint_stats.last_dirty_percent);
+    pos += sprintf(pos, "STAT chkpoint_log_kbyte %u\r\n", chkpoint_stats.log_kbyte);
+    pos += sprintf(pos, "STAT chkpoint_dirty_percent_now %u\r\n", chkpoint_stats.dirty_percent);
+    pos += sprintf(pos, "STAT chkpoint_pages_written %llu\r\n", (unsigned long long)chkpoint_stats.pages_written);
     pos += sprintf(pos, "STAT memp_trickle_val %d\r\n", bdb_settings.memp_trickle_val);
     pos += sprintf(pos, "STAT memp_trickle_percent %d\r\n", bdb_settings.memp_trickle_percent);
+    pos += sprintf(pos, "STAT db_shards %d\r\n", bdb_ns[0].nshards);
+    pos += sprintf(pos, "STAT namespaces %d\r\n", bdb_nns);
+    pos += sprintf(pos, "END");
+}
+
+void stats_trickle(char *temp){
+    char *pos = temp;
+
+    pos += sprintf(pos, "STAT trickle_percent %d\r\n", trickle_stats.percent);
+    pos += sprintf(pos, "STAT trickle_interval %d\r\n", trickle_stats.interval);
+    pos += sprintf(pos, "STAT trickle_runs %u\r\n", trickle_stats.runs);
+    pos += sprintf(pos, "STAT trickle_pages_written %llu\r\n", (unsigned long long)trickle_stats.pages_written);
+    pos += sprintf(pos, "STAT dirty_evictions %llu\r\n", (unsigned long long)trickle_stats.dirty_evictions);
+    pos += sprintf(pos, "STAT dirty_evictions_last %u\r\n", trickle_stats.last_dirty_evictions);
+    pos += sprintf(pos, "STAT dirty_percent %u\r\n", trickle_stats.dirty_percent);
+    pos += sprintf(pos, "STAT hit_percent %u\r\n", trickle_stats.hit_percent);
     pos += sprintf(pos, "END");
 }
 
@@ -257,3 +290,38 @@ void stats_repms(char *temp){
         free(list);
     pos += sprintf(pos, "END");
 }
+
+/* gets/puts/deletes of every shard of *ns*, *temp* must hold 96 bytes a shard */
+void stats_shards(char *temp, struct bdb_ns *ns){
+    char *pos = temp;
+    int i;
+
+    for (i = 0; i < ns->nshards; i++){
+        pos += sprintf(pos, "STAT shard-%03d %"PRIu64"/%"PRIu64"/%"PRIu64"\r\n", i,
+                       __atomic_load_n(&ns->stats[i].gets, __ATOMIC_RELAXED),
+                       __atomic_load_n(&ns->stats[i].puts, __ATOMIC_RELAXED),
+                       __atomic_load_n(&ns->stats[i].deletes, __ATOMIC_RELAXED));
+    }
+    pos += sprintf(pos, "END");
+}
+
+/* file/type/pagesize/shards/dict_min_size/priority of every namespace */
+void stats_ns(char *temp){
+    static const char *priorities[] = {"unchanged", "verylow", "low", "default", "high", "veryhigh"};
+    char *pos = temp;
+    u_int32_t page_size;
+    DBTYPE db_type;
+    int i;
+
+    for (i = 0; i < bdb_nns; i++){
+        DB *db = bdb_ns[i].dbps[0];
+        if (db->get_pagesize(db, &page_size) != 0)
+            page_size = bdb_ns[i].page_size;
+        if (db->get_type(db, &db_type) != 0)
+            db_type = bdb_ns[i].db_type;
+        pos += sprintf(pos, "STAT ns-%s %s/%s/%u/%d/%d/%s\r\n", bdb_ns[i].name, bdb_ns[i].db_file,
+                       db_type == DB_HASH ? "hash" : "btree", page_size, bdb_ns[i].nshards,
+                       bdb_ns[i].dict_min_size, priorities[bdb_ns[i].priority]);
+    }
+    pos += sprintf(pos, "END");
+}
@@ -19,6 +19,7 @@
 
 #include "memcachedb.h"
 #include <stdio.h>
+#include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -34,28 +35,48 @@
 #ifdef USE_THREADS
 
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
-#define ITEMS_PER_ALLOC 64
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+/* Slots in each libevent thread's message ring, a power of two. */
+#define MSG_RING_SIZE 1024
 
-/* An item in the connection queue. */
-typedef struct conn_queue_item CQ_ITEM;
-struct conn_queue_item {
+/*
+ * A message for a libevent thread: either a new connection to handle, or,
+ * if func is set, a call to make on that thread.
+ */
+typedef struct thread_msg THREAD_MSG;
+struct thread_msg {
+    volatile unsigned int seq;  /* ring slot sequence, see msg_push() */
+    void    (*func)(void *arg);
+    void    *arg;
     int     sfd;
     int     init_state;
     int     event_flags;
     int     read_buffer_size;
     int     is_udp;
-    CQ_ITEM *next;
+    THREAD_MSG *next;           /* for the overflow list */
 };
 
-/* A connection queue. */
-typedef struct conn_queue CQ;
-struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
-};
+/*
+ * A bounded ring of messages. Any thread can push without taking a lock,
+ * only the owning libevent thread pops. Messages that find it full go on
+ * the overflow list instead, which does take a lock. The list is run in
+ * order after the ring, and while it isn't empty, every message goes on
+ * it, so none overtakes one posted before it.
+ */
+typedef struct {
+    THREAD_MSG slots[MSG_RING_SIZE];
+    volatile unsigned int head; /* next slot a producer claims */
+    unsigned int tail;          /* next slot the owner reads */
+    THREAD_MSG * volatile overflow;
+    THREAD_MSG *overflow_tail;  /* last on the list, for appending */
+    pthread_mutex_t overflow_lock;
+} MSG_RING;
 
 /* Lock for connection freelist */
 static pthread_mutex_t conn_lock;
@@ -63,31 +84,76 @@ static pthread_mutex_t conn_lock;
 /* Lock for item buffer freelist */
 static pthread_mutex_t ibuffer_lock;
 
+/*
+ * Item buffers a thread keeps to itself, so most allocations don't take
+ * ibuffer_lock. The shared freelist is the depot these refill from and
+ * spill into, a batch at a time, so a thread that frees what another one
+ * allocated doesn't pile buffers up.
+ */
+#define ITEM_CACHE_MAX 64
+#define ITEM_CACHE_BATCH 32
+
+typedef struct {
+    int     count;
+    item    *items[ITEM_CACHE_MAX];
+} ITEM_CACHE;
+
+static pthread_key_t item_cache_key;
+
+/* Lock for read buffer freelist */
+static pthread_mutex_t rbuf_lock;
+
+/*
+ * Read buffers a thread keeps to itself. Every idle conn gives its buffer
+ * back, so these go round at the request rate and are cached the same way
+ * as item buffers. Pinned workers keep away from the shared freelist, whose
+ * buffers may sit on another node: they malloc their own, first touched on
+ * their node, and free what their cache can't hold.
+ */
+#define RBUF_CACHE_MAX 32
+#define RBUF_CACHE_BATCH 16
+
+typedef struct {
+    int     count;
+    char    *bufs[RBUF_CACHE_MAX];
+} RBUF_CACHE;
+
+static pthread_key_t rbuf_cache_key;
+
 /* Lock for bdb */
 static pthread_mutex_t bdb_lock;
 
 /* Lock for global stats */
 static pthread_mutex_t stats_lock;
 
-/* Free list of CQ_ITEM structs */
-static CQ_ITEM *cqi_freelist;
-static pthread_mutex_t cqi_freelist_lock;
-
 /*
- * Each libevent instance has a wakeup pipe, which other threads
- * can use to signal that they've put a new connection on its queue.
+ * Each libevent instance has a wakeup eventfd (or a pipe, without eventfd),
+ * which other threads use to signal that they've put messages on its ring.
+ * It is only signalled when the thread isn't already due to wake up.
  */
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
-    struct event notify_event;  /* listen event for notify pipe */
-    int notify_receive_fd;      /* receiving end of notify pipe */
-    int notify_send_fd;         /* sending end of notify pipe */
-    CQ  new_conn_queue;         /* queue of new connections to handle */
+    struct event notify_event;  /* listen event for notify fd */
+    int notify_receive_fd;      /* receiving end of notify fd */
+    int notify_send_fd;         /* sending end of notify fd */
+    volatile int notify_pending; /* set once signalled, until woken up */
+    MSG_RING ring;              /* new connections and calls to handle */
 } LIBEVENT_THREAD;
 
 static LIBEVENT_THREAD *threads;
 
+/*
+ * Conns parked by the libevent threads, waiting for a storage thread to run
+ * their command. Linked through conn->job_next.
+ */
+static conn *job_head;
+static conn *job_tail;
+static pthread_mutex_t job_lock;
+static pthread_cond_t job_cond;
+static bool job_quit;           /* storage threads exit once the queue is empty */
+static pthread_t *storage_tids;
+
 /*
  * Number of threads that have finished setting themselves up.
  */
@@ -97,124 +163,82 @@ static pthread_cond_t init_cond;
 
 
 static void thread_libevent_process(int fd, short which, void *arg);
+static void thread_msgs_run(LIBEVENT_THREAD *me);
 
 /*
- * Initializes a connection queue.
- */
-static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
-    pthread_cond_init(&cq->cond, NULL);
-    cq->head = NULL;
-    cq->tail = NULL;
-}
-
-/*
- * Waits for work on a connection queue.
+ * Initializes a message ring.
  */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    while (NULL == cq->head)
-        pthread_cond_wait(&cq->cond, &cq->lock);
-    item = cq->head;
-    cq->head = item->next;
-    if (NULL == cq->head)
-        cq->tail = NULL;
-    pthread_mutex_unlock(&cq->lock);
-
-    return item;
+static void msg_ring_init(MSG_RING *ring) {
+    unsigned int i;
+
+    for (i = 0; i < MSG_RING_SIZE; i++)
+        ring->slots[i].seq = i;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->overflow = NULL;
+    ring->overflow_tail = NULL;
+    pthread_mutex_init(&ring->overflow_lock, NULL);
 }
 
 /*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
- */
-static CQ_ITEM *cq_peek(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
-    pthread_mutex_unlock(&cq->lock);
-
-    return item;
-}
-
-/*
- * Adds an item to a connection queue.
- */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
-
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    pthread_cond_signal(&cq->cond);
-    pthread_mutex_unlock(&cq->lock);
-}
-
-/*
- * Returns a fresh connection queue item.
+ * Copies a message into the ring. A slot is free for the producer that
+ * claims position pos when its seq is pos, and holds a message for the
+ * consumer when its seq is pos + 1.
+ *
+ * Returns false if the ring is full.
  */
-static CQ_ITEM *cqi_new() {
-    CQ_ITEM *item = NULL;
-    pthread_mutex_lock(&cqi_freelist_lock);
-    if (cqi_freelist) {
-        item = cqi_freelist;
-        cqi_freelist = item->next;
-    }
-    pthread_mutex_unlock(&cqi_freelist_lock);
-
-    if (NULL == item) {
-        int i;
-
-        /* Allocate a bunch of items at once to reduce fragmentation */
-        item = malloc(sizeof(CQ_ITEM) * ITEMS_PER_ALLOC);
-        if (NULL == item)
-            return NULL;
-
-        /*
-         * Link together all the new items except the first one
-         * (which we'll return to the caller) for placement on
-         * the freelist.
-         */
-        for (i = 2; i < ITEMS_PER_ALLOC; i++)
-            item[i - 1].next = &item[i];
-
-        pthread_mutex_lock(&cqi_freelist_lock);
-        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
-        cqi_freelist = &item[1];
-        pthread_mutex_unlock(&cqi_freelist_lock);
+static bool msg_push(MSG_RING *ring, const THREAD_MSG *msg) {
+    THREAD_MSG *slot;
+    unsigned int pos;
+    int dif;
+
+    for (;;) {
+        pos = ring->head;
+        slot = &ring->slots[pos & (MSG_RING_SIZE - 1)];
+        dif = (int)(slot->seq - pos);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&ring->head, pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            return false;
+        }
+        /* another producer got there first, try again */
     }
 
-    return item;
+    slot->func = msg->func;
+    slot->arg = msg->arg;
+    slot->sfd = msg->sfd;
+    slot->init_state = msg->init_state;
+    slot->event_flags = msg->event_flags;
+    slot->read_buffer_size = msg->read_buffer_size;
+    slot->is_udp = msg->is_udp;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+    return true;
 }
 
-
 /*
- * Frees a connection queue item (adds it to the freelist.)
+ * Takes the oldest message off the ring. Only the owning thread calls this.
+ *
+ * Returns false if the ring is empty.
  */
-static void cqi_free(CQ_ITEM *item) {
-    pthread_mutex_lock(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
-    pthread_mutex_unlock(&cqi_freelist_lock);
+static bool msg_pop(MSG_RING *ring, THREAD_MSG *msg) {
+    THREAD_MSG *slot = &ring->slots[ring->tail & (MSG_RING_SIZE - 1)];
+
+    if ((int)(slot->seq - (ring->tail + 1)) < 0)
+        return false;
+    __sync_synchronize();
+    *msg = *slot;
+    __sync_synchronize();
+    slot->seq = ring->tail + MSG_RING_SIZE;
+    ring->tail++;
+    return true;
 }
 
-
 /*
- * Creates a worker thread.
+ * Creates a worker thread, to be joined at shutdown.
  */
-static void create_worker(void *(*func)(void *), void *arg) {
+static pthread_t create_worker(void *(*func)(void *), void *arg) {
     pthread_t       thread;
     pthread_attr_t  attr;
     int             ret;
@@ -226,6 +250,7 @@ static void create_worker(void *(*func)(void *), void *arg) {
                 strerror(ret));
         exit(1);
     }
+    return thread;
 }
 
 
@@ -259,30 +284,181 @@ bool mt_conn_add_to_freelist(conn *c) {
 }
 
 /*
- * Pulls a item buffer from the freelist, if one is available.
+ * Returns the calling thread's item buffer cache, creating it if need be.
+ */
+static ITEM_CACHE *item_cache(void) {
+    ITEM_CACHE *cache = pthread_getspecific(item_cache_key);
+
+    if (NULL == cache) {
+        cache = calloc(1, sizeof(ITEM_CACHE));
+        if (NULL != cache && pthread_setspecific(item_cache_key, cache) != 0) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+/*
+ * Gives an exiting thread's cached buffers back to the freelist.
+ */
+static void item_cache_free(void *arg) {
+    ITEM_CACHE *cache = arg;
+    int i;
+
+    pthread_mutex_lock(&ibuffer_lock);
+    for (i = 0; i < cache->count; i++) {
+        if (do_item_add_to_freelist(cache->items[i]) != 0)
+            free(cache->items[i]);
+    }
+    pthread_mutex_unlock(&ibuffer_lock);
+    free(cache);
+}
+
+/*
+ * Pulls a item buffer from the thread's cache, refilling it from the
+ * freelist when it runs dry.
  */
 
 item *mt_item_from_freelist(void) {
+    ITEM_CACHE *cache = item_cache();
     item *it;
+
+    if (NULL != cache && cache->count > 0)
+        return cache->items[--cache->count];
+
     pthread_mutex_lock(&ibuffer_lock);
-    it = do_item_from_freelist();
+    if (NULL != cache)
+        cache->count = do_item_take_from_freelist(cache->items, ITEM_CACHE_BATCH);
+    if (NULL != cache && cache->count > 0)
+        it = cache->items[--cache->count];
+    else
+        it = do_item_from_freelist();
     pthread_mutex_unlock(&ibuffer_lock);
     return it;
 }
 
 /*
- * Adds a item buffer to the freelist.
+ * Adds a item buffer to the thread's cache, spilling the older half of it
+ * to the freelist when it is full.
  *
  * Returns 0 on success, 1 if the buffer couldn't be added.
  */
 int mt_item_add_to_freelist(item *it){
-    int result;
+    ITEM_CACHE *cache = item_cache();
+    int i, result;
+
+    if (NULL == cache) {
+        pthread_mutex_lock(&ibuffer_lock);
+        result = do_item_add_to_freelist(it);
+        pthread_mutex_unlock(&ibuffer_lock);
+        return result;
+    }
 
-    pthread_mutex_lock(&ibuffer_lock);
-    result = do_item_add_to_freelist(it);
-    pthread_mutex_unlock(&ibuffer_lock);
+    if (cache->count == ITEM_CACHE_MAX) {
+        pthread_mutex_lock(&ibuffer_lock);
+        for (i = 0; i < ITEM_CACHE_BATCH; i++) {
+            if (do_item_add_to_freelist(cache->items[i]) != 0)
+                free(cache->items[i]);
+        }
+        pthread_mutex_unlock(&ibuffer_lock);
+        memmove(cache->items, cache->items + ITEM_CACHE_BATCH,
+                sizeof(item *) * (ITEM_CACHE_MAX - ITEM_CACHE_BATCH));
+        cache->count -= ITEM_CACHE_BATCH;
+    }
 
-    return result;
+    cache->items[cache->count++] = it;
+    return 0;
+}
+
+/*
+ * Returns the calling thread's read buffer cache, creating it if need be.
+ */
+static RBUF_CACHE *rbuf_cache(void) {
+    RBUF_CACHE *cache = pthread_getspecific(rbuf_cache_key);
+
+    if (NULL == cache) {
+        cache = calloc(1, sizeof(RBUF_CACHE));
+        if (NULL != cache && pthread_setspecific(rbuf_cache_key, cache) != 0) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+/*
+ * Gives an exiting thread's cached read buffers back to the freelist.
+ */
+static void rbuf_cache_free(void *arg) {
+    RBUF_CACHE *cache = arg;
+    int i;
+
+    pthread_mutex_lock(&rbuf_lock);
+    for (i = 0; i < cache->count; i++) {
+        if (affinity_workers_pinned() || do_rbuf_add_to_freelist(cache->bufs[i]))
+            free(cache->bufs[i]);
+    }
+    pthread_mutex_unlock(&rbuf_lock);
+    free(cache);
+}
+
+/*
+ * Pulls a read buffer from the thread's cache, refilling it from the
+ * freelist when it runs dry.
+ */
+char *mt_rbuf_from_freelist(void) {
+    RBUF_CACHE *cache = rbuf_cache();
+    char *buf;
+
+    if (NULL != cache && cache->count > 0)
+        return cache->bufs[--cache->count];
+    if (NULL != cache && affinity_workers_pinned())
+        return (char *)malloc(DATA_BUFFER_SIZE);
+
+    pthread_mutex_lock(&rbuf_lock);
+    if (NULL != cache)
+        cache->count = do_rbuf_take_from_freelist(cache->bufs, RBUF_CACHE_BATCH);
+    if (NULL != cache && cache->count > 0)
+        buf = cache->bufs[--cache->count];
+    else
+        buf = do_rbuf_from_freelist();
+    pthread_mutex_unlock(&rbuf_lock);
+    return buf;
+}
+
+/*
+ * Adds a read buffer to the thread's cache, spilling the older half of it
+ * to the freelist when it is full.
+ *
+ * Returns 0 on success, 1 if the buffer couldn't be added.
+ */
+bool mt_rbuf_add_to_freelist(char *buf) {
+    RBUF_CACHE *cache = rbuf_cache();
+    bool result;
+    int i;
+
+    if (NULL == cache) {
+        pthread_mutex_lock(&rbuf_lock);
+        result = do_rbuf_add_to_freelist(buf);
+        pthread_mutex_unlock(&rbuf_lock);
+        return result;
+    }
+
+    if (cache->count == RBUF_CACHE_MAX) {
+        pthread_mutex_lock(&rbuf_lock);
+        for (i = 0; i < RBUF_CACHE_BATCH; i++) {
+            if (affinity_workers_pinned() || do_rbuf_add_to_freelist(cache->bufs[i]))
+                free(cache->bufs[i]);
+        }
+        pthread_mutex_unlock(&rbuf_lock);
+        memmove(cache->bufs, cache->bufs + RBUF_CACHE_BATCH,
+                sizeof(char *) * (RBUF_CACHE_MAX - RBUF_CACHE_BATCH));
+        cache->count -= RBUF_CACHE_BATCH;
+    }
+
+    cache->bufs[cache->count++] = buf;
+    return false;
 }
 
 
@@ -310,7 +486,11 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(1);
     }
 
-    cq_init(&me->new_conn_queue);
+    me->notify_pending = 0;
+    msg_ring_init(&me->ring);
+
+    if (settings.use_uring && uring_attach(me->base) != 0)
+        fprintf(stderr, "io_uring is not available, using libevent\n");
 }
 
 
@@ -320,6 +500,8 @@ static void setup_thread(LIBEVENT_THREAD *me) {
 static void *worker_libevent(void *arg) {
     LIBEVENT_THREAD *me = arg;
 
+    affinity_worker(me - threads);
+
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
@@ -335,39 +517,124 @@ static void *worker_libevent(void *arg) {
 
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Handles one message taken off a thread's ring.
+ */
+static void thread_msg_run(LIBEVENT_THREAD *me, THREAD_MSG *msg) {
+    conn *c;
+
+    if (msg->func != NULL) {
+        msg->func(msg->arg);
+        return;
+    }
+
+    c = conn_new(msg->sfd, msg->init_state, msg->event_flags,
+                 msg->read_buffer_size, msg->is_udp, me->base);
+    if (c == NULL) {
+        if (msg->is_udp) {
+            fprintf(stderr, "Can't listen for events on UDP socket\n");
+            exit(1);
+        } else {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "Can't listen for events on fd %d\n",
+                    msg->sfd);
+            }
+            close(msg->sfd);
+        }
+    }
+}
+
+/*
+ * Processes the messages on a thread's ring, new connections to handle and
+ * calls to make. This is called when the notify fd is signalled.
  */
 static void thread_libevent_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
-    CQ_ITEM *item;
-    char buf[1];
+    uint64_t buf;
 
-    if (read(fd, buf, 1) != 1)
+    if (read(fd, &buf, sizeof(buf)) <= 0)
         if (settings.verbose > 0)
             fprintf(stderr, "Can't read from libevent pipe\n");
 
-    item = cq_peek(&me->new_conn_queue);
-
-    if (NULL != item) {
-        conn *c = conn_new(item->sfd, item->init_state, item->event_flags,
-                           item->read_buffer_size, item->is_udp, me->base);
-        if (c == NULL) {
-            if (item->is_udp) {
-                fprintf(stderr, "Can't listen for events on UDP socket\n");
-                exit(1);
-            } else {
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "Can't listen for events on fd %d\n",
-                        item->sfd);
-                }
-                close(item->sfd);
-            }
+    /* rearm before looking, so nothing posted from now on goes unnoticed */
+    me->notify_pending = 0;
+    __sync_synchronize();
+
+    thread_msgs_run(me);
+}
+
+/*
+ * Handles every message on a thread's ring, and on its overflow list.
+ */
+static void thread_msgs_run(LIBEVENT_THREAD *me) {
+    THREAD_MSG msg, *list, *next;
+    unsigned int head;
+
+    while (msg_pop(&me->ring, &msg))
+        thread_msg_run(me, &msg);
+
+    if (me->ring.overflow != NULL) {
+        pthread_mutex_lock(&me->ring.overflow_lock);
+        list = me->ring.overflow;
+        me->ring.overflow = NULL;
+        me->ring.overflow_tail = NULL;
+        head = me->ring.head;
+        pthread_mutex_unlock(&me->ring.overflow_lock);
+
+        /* what was put on the ring before the list was taken goes first,
+           a slot still being written included */
+        while (me->ring.tail != head) {
+            if (msg_pop(&me->ring, &msg))
+                thread_msg_run(me, &msg);
+            else
+                sched_yield();
+        }
+
+        for (; list != NULL; list = next) {
+            next = list->next;
+            thread_msg_run(me, list);
+            free(list);
         }
-        cqi_free(item);
     }
 }
 
+/*
+ * Puts a message on a thread's ring, and wakes the thread up unless
+ * someone already has since it last looked.
+ */
+static void thread_post(LIBEVENT_THREAD *t, const THREAD_MSG *msg) {
+    /* behind what already overflowed, if anything has */
+    if (t->ring.overflow != NULL || !msg_push(&t->ring, msg)) {
+        THREAD_MSG *copy = malloc(sizeof(THREAD_MSG));
+        if (NULL == copy) {
+            fprintf(stderr, "Can't allocate thread message\n");
+            exit(1);
+        }
+        *copy = *msg;
+        copy->next = NULL;
+        pthread_mutex_lock(&t->ring.overflow_lock);
+        if (t->ring.overflow_tail != NULL)
+            t->ring.overflow_tail->next = copy;
+        else
+            t->ring.overflow = copy;
+        t->ring.overflow_tail = copy;
+        pthread_mutex_unlock(&t->ring.overflow_lock);
+    }
+
+    if (__sync_val_compare_and_swap(&t->notify_pending, 0, 1) != 0)
+        return;
+#ifdef HAVE_SYS_EVENTFD_H
+    {
+        uint64_t one = 1;
+        if (write(t->notify_send_fd, &one, sizeof(one)) != sizeof(one))
+            perror("Writing to thread notify pipe");
+    }
+#else
+    if (write(t->notify_send_fd, "", 1) != 1) {
+        perror("Writing to thread notify pipe");
+    }
+#endif
+}
+
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = -1;
 
@@ -378,23 +645,105 @@ static int last_thread = -1;
  */
 void dispatch_conn_new(int sfd, int init_state, int event_flags,
                        int read_buffer_size, int is_udp) {
-    CQ_ITEM *item = cqi_new();
+    THREAD_MSG msg;
     int thread = (last_thread + 1) % settings.num_threads;
 
     last_thread = thread;
 
-    item->sfd = sfd;
-    item->init_state = init_state;
-    item->event_flags = event_flags;
-    item->read_buffer_size = read_buffer_size;
-    item->is_udp = is_udp;
+    memset(&msg, 0, sizeof(msg));
+    msg.sfd = sfd;
+    msg.init_state = init_state;
+    msg.event_flags = event_flags;
+    msg.read_buffer_size = read_buffer_size;
+    msg.is_udp = is_udp;
 
-    cq_push(&threads[thread].new_conn_queue, item);
-    if (write(threads[thread].notify_send_fd, "", 1) != 1) {
-        perror("Writing to thread notify pipe");
+    thread_post(&threads[thread], &msg);
+}
+
+/*
+ * Has the libevent thread running *base* call func(arg) from its event
+ * loop. Any thread can call this.
+ */
+void dispatch_thread_call(struct event_base *base, void (*func)(void *), void *arg) {
+    THREAD_MSG msg;
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (threads[i].base == base)
+            break;
+    }
+    assert(i < settings.num_threads);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.func = func;
+    msg.arg = arg;
+
+    thread_post(&threads[i], &msg);
+}
+
+/* Has every libevent thread call func(its base) from its event loop. */
+void dispatch_thread_all(void (*func)(void *)) {
+    THREAD_MSG msg;
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        memset(&msg, 0, sizeof(msg));
+        msg.func = func;
+        msg.arg = threads[i].base;
+        thread_post(&threads[i], &msg);
     }
 }
 
+/*
+ * Queues a parked conn for the storage threads. Called on the libevent
+ * thread that owns the conn, which gets it back through its message ring.
+ */
+void dispatch_storage_job(conn *c) {
+    c->job_next = NULL;
+
+    pthread_mutex_lock(&job_lock);
+    if (NULL == job_tail)
+        job_head = c;
+    else
+        job_tail->job_next = c;
+    job_tail = c;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+static void storage_job_done(void *arg) {
+    conn_resume((conn *)arg);
+}
+
+/*
+ * Storage thread: runs parked conns' commands, so a slow db call only holds
+ * up the conn that made it rather than every conn on its libevent thread.
+ */
+static void *storage_worker(void *arg) {
+    conn *c;
+
+    affinity_storage();
+
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        while (NULL == job_head && !job_quit)
+            pthread_cond_wait(&job_cond, &job_lock);
+        if (NULL == job_head) {
+            pthread_mutex_unlock(&job_lock);
+            break;
+        }
+        c = job_head;
+        job_head = c->job_next;
+        if (NULL == job_head)
+            job_tail = NULL;
+        pthread_mutex_unlock(&job_lock);
+
+        conn_run_job(c);
+        dispatch_thread_call(c->event.ev_base, storage_job_done, c);
+    }
+    return NULL;
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -403,26 +752,42 @@ int mt_is_listen_thread() {
 }
 
 /*
- * Does arithmetic on a numeric item value.
+ * Does arithmetic on a numeric item value. A deadlock victim is backed
+ * off from and run again whole, without bdb_lock held meanwhile.
  */
-char *mt_add_delta(int incr, const int64_t delta, char *buf, char *key, size_t nkey) {
+char *mt_add_delta(struct bdb_ns *ns, int incr, const int64_t delta, char *buf, char *key, size_t nkey) {
     char *ret;
-
-    pthread_mutex_lock(&bdb_lock);
-    ret = do_add_delta(incr, delta, buf, key, nkey);
-    pthread_mutex_unlock(&bdb_lock);
+    bool deadlocked;
+    int attempt = 0;
+
+    do {
+        deadlocked = false;
+        pthread_mutex_lock(&bdb_lock);
+        bdb_retry_defer(&deadlocked);
+        ret = do_add_delta(ns, incr, delta, buf, key, nkey);
+        bdb_retry_defer(NULL);
+        pthread_mutex_unlock(&bdb_lock);
+    } while (deadlocked && bdb_backoff(&attempt));
     return ret;
 }
 
 /*
  * Stores an item in the bdb (high level, obeys set/add/replace semantics)
+ * Deadlock victims are handled as in mt_add_delta().
  */
-int mt_store_item(item *item, int comm) {
+int mt_store_item(struct bdb_ns *ns, item *item, int comm) {
     int ret;
-
-    pthread_mutex_lock(&bdb_lock);
-    ret = do_store_item(item, comm);
-    pthread_mutex_unlock(&bdb_lock);
+    bool deadlocked;
+    int attempt = 0;
+
+    do {
+        deadlocked = false;
+        pthread_mutex_lock(&bdb_lock);
+        bdb_retry_defer(&deadlocked);
+        ret = do_store_item(ns, item, comm);
+        bdb_retry_defer(NULL);
+        pthread_mutex_unlock(&bdb_lock);
+    } while (deadlocked && bdb_backoff(&attempt));
     return ret;
 }
 
@@ -447,16 +812,21 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
     pthread_mutex_init(&bdb_lock, NULL);
     pthread_mutex_init(&ibuffer_lock, NULL);
+    pthread_key_create(&item_cache_key, item_cache_free);
+    pthread_mutex_init(&rbuf_lock, NULL);
+    pthread_key_create(&rbuf_cache_key, rbuf_cache_free);
     pthread_mutex_init(&conn_lock, NULL);
     pthread_mutex_init(&stats_lock, NULL);
 
     pthread_mutex_init(&init_lock, NULL);
     pthread_cond_init(&init_cond, NULL);
 
-    pthread_mutex_init(&cqi_freelist_lock, NULL);
-    cqi_freelist = NULL;
+    pthread_mutex_init(&job_lock, NULL);
+    pthread_cond_init(&job_cond, NULL);
+    job_head = NULL;
+    job_tail = NULL;
 
-    threads = malloc(sizeof(LIBEVENT_THREAD) * nthreads);
+    threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
     if (! threads) {
         perror("Can't allocate thread descriptors");
         exit(1);
@@ -466,6 +836,16 @@ void thread_init(int nthreads, struct event_base *main_base) {
     threads[0].thread_id = pthread_self();
 
     for (i = 0; i < nthreads; i++) {
+#ifdef HAVE_SYS_EVENTFD_H
+        int efd = eventfd(0, 0);
+        if (efd == -1) {
+            perror("Can't create notify eventfd");
+            exit(1);
+        }
+
+        threads[i].notify_receive_fd = efd;
+        threads[i].notify_send_fd = efd;
+#else
         int fds[2];
         if (pipe(fds)) {
             perror("Can't create notify pipe");
@@ -474,13 +854,14 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
         threads[i].notify_receive_fd = fds[0];
         threads[i].notify_send_fd = fds[1];
+#endif
 
     setup_thread(&threads[i]);
     }
 
     /* Create threads after we've done all the libevent setup. */
     for (i = 1; i < nthreads; i++) {
-        create_worker(worker_libevent, &threads[i]);
+        threads[i].thread_id = create_worker(worker_libevent, &threads[i]);
     }
 
     /* Wait for all the threads to set themselves up before returning. */
@@ -490,6 +871,49 @@ void thread_init(int nthreads, struct event_base *main_base) {
         pthread_cond_wait(&init_cond, &init_lock);
     }
     pthread_mutex_unlock(&init_lock);
+
+    storage_tids = calloc(settings.num_storage_threads + 1, sizeof(pthread_t));
+    if (! storage_tids) {
+        perror("Can't allocate thread descriptors");
+        exit(1);
+    }
+    for (i = 0; i < settings.num_storage_threads; i++) {
+        storage_tids[i] = create_worker(storage_worker, NULL);
+    }
+}
+
+/* Closes the clients of a libevent thread, and ends its event loop. */
+static void thread_stop(void *arg) {
+    struct event_base *base = arg;
+
+    conn_close_thread(base);
+    event_base_loopexit(base, NULL);
+}
+
+/*
+ * Stops the threads, once the main event loop is over: the storage threads
+ * run what is queued and exit, then every libevent thread closes the
+ * clients it still has, on that thread, and exits. Called on the main
+ * thread, before the databases close under them.
+ */
+void thread_shutdown(void) {
+    int i;
+
+    pthread_mutex_lock(&job_lock);
+    job_quit = true;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    for (i = 0; i < settings.num_storage_threads; i++)
+        pthread_join(storage_tids[i], NULL);
+
+    for (i = 1; i < settings.num_threads; i++)
+        dispatch_thread_call(threads[i].base, thread_stop, threads[i].base);
+    for (i = 1; i < settings.num_threads; i++)
+        pthread_join(threads[i].thread_id, NULL);
+
+    /* the main thread's loop is over, hand it what the others sent it */
+    thread_msgs_run(&threads[0]);
+    conn_close_thread(threads[0].base);
 }
 
 #endif
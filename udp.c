@@ -0,0 +1,283 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  UDP requests that span several datagrams, and batched UDP socket I/O.
+ *
+ *  Each datagram starts with the 8 byte frame header: request id, sequence
+ *  number, datagram count, reserved. The datagrams of a bigger request are
+ *  held here, keyed by sender and request id, until the last one is in or
+ *  the request times out. Every libevent thread reads the same UDP socket,
+ *  so the table is shared.
+ *
+ *  Where the system has them, recvmmsg() fills a batch of buffers per
+ *  call, and sendmmsg() sends all datagrams of a reply in one.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define UDP_REASM_SLOTS 64      /* requests being put together at once */
+#define UDP_REASM_MAX_PARTS 64
+#define UDP_REASM_TIMEOUT 2     /* seconds to wait for the rest of a request */
+#define UDP_BATCH 8             /* datagrams per recvmmsg()/sendmmsg() */
+
+struct udp_reasm {
+    bool        in_use;
+    struct sockaddr addr;
+    socklen_t   addrlen;
+    int         id;
+    int         total;      /* datagrams in the request */
+    int         got;
+    int         size;       /* payload bytes so far */
+    time_t      started;
+    char        *parts[UDP_REASM_MAX_PARTS];
+    int         lens[UDP_REASM_MAX_PARTS];
+};
+
+static struct udp_reasm reasm[UDP_REASM_SLOTS];
+static pthread_mutex_t reasm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_RECVMMSG
+/* datagrams read ahead by one recvmmsg(), handed out one at a time */
+struct udp_batch {
+    int         n;
+    int         next;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr addrs[UDP_BATCH];
+    char        *bufs[UDP_BATCH];
+};
+#endif
+
+static void udp_reasm_drop(struct udp_reasm *r) {
+    int i;
+
+    for (i = 0; i < r->total; i++) {
+        free(r->parts[i]);
+        r->parts[i] = NULL;
+    }
+    r->in_use = false;
+}
+
+/*
+ * Files the datagram in c->rbuf, *len* bytes with its frame header, as part
+ * of a bigger request. Once all parts are in, the request is copied to
+ * c->rbuf in order, without headers.
+ *
+ * Returns the length of the request once it is complete, 0 while parts are
+ * missing, and -1 if it can't be put together: too big, or numbered wrong.
+ */
+int udp_reasm_add(conn *c, int len) {
+    unsigned char *hdr = (unsigned char *)c->rbuf;
+    int seq = hdr[2] * 256 + hdr[3];
+    int total = hdr[4] * 256 + hdr[5];
+    struct udp_reasm *r = NULL, *free_slot = NULL, *oldest = NULL;
+    time_t now = time(0);
+    char *part;
+    int i, size;
+
+    if (total < 2 || total > UDP_REASM_MAX_PARTS || seq >= total)
+        return -1;
+    len -= UDP_HEADER_SIZE;
+
+    pthread_mutex_lock(&reasm_lock);
+    for (i = 0; i < UDP_REASM_SLOTS; i++) {
+        struct udp_reasm *s = &reasm[i];
+
+        if (s->in_use && now - s->started > UDP_REASM_TIMEOUT)
+            udp_reasm_drop(s);
+        if (!s->in_use) {
+            if (free_slot == NULL)
+                free_slot = s;
+            continue;
+        }
+        if (s->id == c->request_id && s->addrlen == c->request_addr_size &&
+            memcmp(&s->addr, &c->request_addr, s->addrlen) == 0) {
+            r = s;
+            break;
+        }
+        if (oldest == NULL || s->started < oldest->started)
+            oldest = s;
+    }
+
+    if (r == NULL) {
+        /* a new request, in a free slot or else the oldest one's */
+        r = free_slot != NULL ? free_slot : oldest;
+        if (r->in_use)
+            udp_reasm_drop(r);
+        r->in_use = true;
+        r->id = c->request_id;
+        memcpy(&r->addr, &c->request_addr, sizeof(r->addr));
+        r->addrlen = c->request_addr_size;
+        r->total = total;
+        r->got = 0;
+        r->size = 0;
+        r->started = now;
+    }
+
+    if (r->total != total || r->size + len >= c->rsize) {
+        udp_reasm_drop(r);
+        pthread_mutex_unlock(&reasm_lock);
+        return -1;
+    }
+    if (r->parts[seq] != NULL) {
+        /* a duplicate */
+        pthread_mutex_unlock(&reasm_lock);
+        return 0;
+    }
+    if ((part = malloc(len > 0 ? len : 1)) == NULL) {
+        udp_reasm_drop(r);
+        pthread_mutex_unlock(&reasm_lock);
+        return -1;
+    }
+    memcpy(part, c->rbuf + UDP_HEADER_SIZE, len);
+    r->parts[seq] = part;
+    r->lens[seq] = len;
+    r->size += len;
+
+    if (++r->got < r->total) {
+        pthread_mutex_unlock(&reasm_lock);
+        return 0;
+    }
+
+    for (i = 0, size = 0; i < r->total; i++) {
+        memcpy(c->rbuf + size, r->parts[i], r->lens[i]);
+        size += r->lens[i];
+    }
+    udp_reasm_drop(r);
+    pthread_mutex_unlock(&reasm_lock);
+    return size;
+}
+
+/*
+ * Reads the next datagram into c->rbuf, and its sender into
+ * c->request_addr. With recvmmsg(), a batch is read at once and the buffers
+ * are swapped into rbuf one by one.
+ *
+ * Returns the datagram's length, or -1 with errno set (EAGAIN if there is
+ * none).
+ */
+int udp_recv(conn *c) {
+#ifdef HAVE_RECVMMSG
+    struct udp_batch *b = c->udp_batch;
+    char *buf;
+    int i, n;
+
+    if (b == NULL && !c->udp_unbatched) {
+        if ((b = calloc(1, sizeof(struct udp_batch))) != NULL) {
+            for (i = 0; i < UDP_BATCH; i++) {
+                if ((b->bufs[i] = malloc(c->rsize)) == NULL)
+                    break;
+            }
+            if (i < UDP_BATCH) {
+                while (i-- > 0)
+                    free(b->bufs[i]);
+                free(b);
+                b = NULL;
+            }
+        }
+        c->udp_batch = b;
+        c->udp_unbatched = (b == NULL);
+    }
+    if (b == NULL) {
+        c->request_addr_size = sizeof(c->request_addr);
+        return recvfrom(c->sfd, c->rbuf, c->rsize, 0,
+                        &c->request_addr, &c->request_addr_size);
+    }
+
+    if (b->next == b->n) {
+        for (i = 0; i < UDP_BATCH; i++) {
+            b->iov[i].iov_base = b->bufs[i];
+            b->iov[i].iov_len = c->rsize;
+            memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+            b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+            b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+            b->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        b->n = b->next = 0;
+        if ((n = recvmmsg(c->sfd, b->msgs, UDP_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+            return -1;
+        b->n = n;
+    }
+
+    i = b->next++;
+    buf = c->rbuf;
+    c->rbuf = b->bufs[i];
+    b->bufs[i] = buf;
+    memcpy(&c->request_addr, &b->addrs[i], sizeof(c->request_addr));
+    c->request_addr_size = b->msgs[i].msg_hdr.msg_namelen;
+    return b->msgs[i].msg_len;
+#else
+    c->request_addr_size = sizeof(c->request_addr);
+    return recvfrom(c->sfd, c->rbuf, c->rsize, 0,
+                    &c->request_addr, &c->request_addr_size);
+#endif
+}
+
+void udp_batch_free(conn *c) {
+#ifdef HAVE_RECVMMSG
+    struct udp_batch *b = c->udp_batch;
+    int i;
+
+    if (b == NULL)
+        return;
+    for (i = 0; i < UDP_BATCH; i++)
+        free(b->bufs[i]);
+    free(b);
+    c->udp_batch = NULL;
+#endif
+}
+
+/*
+ * Sends up to *n* datagrams, each a msghdr of *msgs*. The number of bytes
+ * sent is added to *bytes*.
+ *
+ * Returns how many datagrams went out, or -1 with errno set if none did.
+ */
+int udp_send(int sfd, struct msghdr *msgs, int n, size_t *bytes) {
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr mm[UDP_BATCH];
+    int i, sent;
+
+    if (n > UDP_BATCH)
+        n = UDP_BATCH;
+    for (i = 0; i < n; i++) {
+        mm[i].msg_hdr = msgs[i];
+        mm[i].msg_len = 0;
+    }
+    if ((sent = sendmmsg(sfd, mm, n, 0)) <= 0)
+        return -1;
+    for (i = 0; i < sent; i++)
+        *bytes += mm[i].msg_len;
+    return sent;
+#else
+    ssize_t res;
+    int sent;
+
+    for (sent = 0; sent < n && sent < UDP_BATCH; sent++) {
+        if ((res = sendmsg(sfd, &msgs[sent], 0)) <= 0)
+            break;
+        *bytes += res;
+    }
+    return sent > 0 ? sent : -1;
+#endif
+}
@@ -0,0 +1,740 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  io_uring backend for connection I/O.
+ *
+ *  Each libevent thread may own a ring. A conn on it has one multishot
+ *  receive in flight, which fills buffers from a ring of provided buffers
+ *  registered with the kernel; the conn reads from those instead of its
+ *  socket. Responses go out as sendmsg requests, and every request queued
+ *  during one pass of the event loop is submitted with a single
+ *  io_uring_enter(). Completions are signalled on an eventfd that libevent
+ *  watches, so the rest of the state machine is unchanged.
+ *
+ *  This talks to the kernel through the raw system calls. Threads whose
+ *  ring can't be set up, or whose kernel lacks multishot receive, keep
+ *  using libevent for everything.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define URING_BACKEND 1
+#endif
+#endif
+
+#ifdef URING_BACKEND
+
+#define URING_ENTRIES 1024      /* submission queue size */
+#define URING_NBUFS 1024        /* provided receive buffers, a power of two */
+#define URING_BUFSIZE DATA_BUFFER_SIZE
+#define URING_BGID 0
+#define URING_CONN_BUFS 8       /* most buffers one conn may sit on */
+
+/* what a completion is for, in the low byte of its user_data */
+#define UR_RECV 1
+#define UR_SEND 2
+#define UR_CANCEL 3
+
+struct uring_buf {
+    int     next;       /* next buffer queued on the same conn, or -1 */
+    unsigned short off; /* how much of it the conn has read */
+    unsigned short len;
+};
+
+struct uring {
+    int     fd;
+    struct event_base *base;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     /* queued by us, maybe not yet submitted */
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    int     efd;                /* eventfd the kernel signals completions on */
+    struct event efd_event;
+    bool    flush_scheduled;
+    bool    reaping;
+
+    struct io_uring_buf_ring *br;
+    char    *bufs;
+    unsigned short br_tail;
+    int     held;               /* buffers the kernel has handed us */
+    struct uring_buf meta[URING_NBUFS];
+
+    conn    *starved;           /* conns whose receive ran out of buffers */
+};
+
+static struct uring *urings[256];
+static int nurings = 0;
+
+/*
+ * Conns by fd, and a generation per fd that is bumped when its conn goes
+ * away, so late completions for it can be told apart from new ones.
+ */
+static conn **uring_conns;
+static uint32_t *uring_gens;
+static int uring_maxfd = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t uring_tag(conn *c, int op) {
+    return ((uint64_t)c->sfd << 32) | ((uint64_t)(uring_gens[c->sfd] & 0xffffff) << 8) | op;
+}
+
+/* hands a receive buffer back to the kernel */
+static void uring_buf_recycle(struct uring *u, int bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_NBUFS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUFSIZE);
+    b->len = URING_BUFSIZE;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    u->held--;
+}
+
+/* submits everything queued so far */
+static void uring_flush(struct uring *u) {
+    unsigned pending;
+    int ret;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    pending = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    while (pending > 0) {
+        ret = sys_io_uring_enter(u->fd, pending, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (settings.verbose > 0)
+                perror("io_uring_enter()");
+            break;
+        }
+        if (ret == 0)
+            break;
+        pending -= ret;
+    }
+}
+
+static void uring_flush_cb(const int fd, const short which, void *arg) {
+    struct uring *u = arg;
+
+    u->flush_scheduled = false;
+    uring_flush(u);
+}
+
+/*
+ * Returns a cleared submission queue entry, or NULL if the queue is full
+ * even after submitting. The entry is submitted once this pass of the event
+ * loop is done, together with whatever else gets queued meanwhile.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        uring_flush(u);
+        if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return NULL;
+    }
+
+    idx = u->sq_local_tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+
+    if (!u->flush_scheduled && !u->reaping) {
+        struct timeval tv = {0, 0};
+        if (event_base_once(u->base, -1, EV_TIMEOUT, uring_flush_cb, u, &tv) == 0)
+            u->flush_scheduled = true;
+        else
+            uring_flush(u);
+    }
+    return sqe;
+}
+
+/* stops a conn's receive or send; its completion comes back as -ECANCELED */
+static void uring_cancel(conn *c, int op) {
+    struct io_uring_sqe *sqe = uring_sqe(c->uring);
+
+    if (sqe == NULL) {
+        shutdown(c->sfd, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_tag(c, op);
+    sqe->user_data = uring_tag(c, UR_CANCEL);
+}
+
+static bool uring_arm(conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(c->uring);
+
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->sfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = uring_tag(c, UR_RECV);
+    c->uring_armed = true;
+    return true;
+}
+
+/* re-arms the conns that ran out of buffers, if any are free again */
+static void uring_feed_starved(struct uring *u) {
+    conn *c;
+
+    if (u->held >= URING_NBUFS)
+        return;
+    while ((c = u->starved) != NULL) {
+        if (!uring_arm(c))
+            break;
+        u->starved = c->uring_next;
+        c->uring_next = NULL;
+        c->uring_starved = false;
+    }
+}
+
+static void uring_starve(struct uring *u, conn *c) {
+    if (c->uring_starved)
+        return;
+    c->uring_starved = true;
+    c->uring_next = u->starved;
+    u->starved = c;
+}
+
+static void uring_unstarve(struct uring *u, conn *c) {
+    conn **pp;
+
+    if (!c->uring_starved)
+        return;
+    for (pp = &u->starved; *pp != NULL; pp = &(*pp)->uring_next) {
+        if (*pp == c) {
+            *pp = c->uring_next;
+            break;
+        }
+    }
+    c->uring_next = NULL;
+    c->uring_starved = false;
+}
+
+static void uring_complete_recv(struct uring *u, conn *c, int res, unsigned flags) {
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        u->held++;
+        u->meta[bid].next = -1;
+        u->meta[bid].off = 0;
+        u->meta[bid].len = res;
+        if (c->uring_rhead < 0)
+            c->uring_rhead = bid;
+        else
+            u->meta[c->uring_rtail].next = bid;
+        c->uring_rtail = bid;
+
+        /* a conn that doesn't read mustn't take the buffers of the rest,
+           so it stops receiving until it catches up */
+        if (++c->uring_rcount >= URING_CONN_BUFS && !c->uring_paused &&
+            (flags & IORING_CQE_F_MORE)) {
+            c->uring_paused = true;
+            uring_cancel(c, UR_RECV);
+        }
+    } else if (res == 0) {
+        c->uring_rerr = -1;
+    } else if (res != -ENOBUFS && res != -ECANCELED) {
+        c->uring_rerr = -res;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->uring_armed = false;
+        /* the conn may have read everything while the cancel was on its way */
+        if (c->uring_paused && c->uring_rcount < URING_CONN_BUFS / 2)
+            c->uring_paused = false;
+        if (c->uring_rerr == 0 && !c->uring_paused) {
+            if (res == -ENOBUFS || !uring_arm(c))
+                uring_starve(u, c);
+        }
+    }
+
+    /* wake the conn up, if it is waiting to read */
+    if (c->ev_flags & EV_READ)
+        conn_resume(c);
+}
+
+/*
+ * Reaps completions. This is called when the ring's eventfd is signalled.
+ */
+static void uring_complete(const int fd, const short which, void *arg) {
+    struct uring *u = arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    uint64_t ud, buf;
+    unsigned flags;
+    int res, cfd;
+    conn *c;
+
+    if (read(fd, &buf, sizeof(buf)) < 0 && errno != EAGAIN && settings.verbose > 0)
+        perror("read(io_uring eventfd)");
+
+    u->reaping = true;
+    for (;;) {
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            break;
+
+        cqe = &u->cqes[head & *u->cq_mask];
+        ud = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        cfd = (int)(ud >> 32);
+        c = (cfd < uring_maxfd) ? uring_conns[cfd] : NULL;
+        if (c == NULL || ((ud >> 8) & 0xffffff) != (uring_gens[cfd] & 0xffffff)) {
+            /* the conn is gone, but the buffer must still go back */
+            if ((ud & 0xff) == UR_RECV && (flags & IORING_CQE_F_BUFFER)) {
+                u->held++;
+                uring_buf_recycle(u, flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            continue;
+        }
+
+        /* closed while its send was in flight, see uring_conn_close() */
+        if (c->uring_closing) {
+            if ((ud & 0xff) == UR_RECV && (flags & IORING_CQE_F_BUFFER)) {
+                u->held++;
+                uring_buf_recycle(u, flags >> IORING_CQE_BUFFER_SHIFT);
+            } else if ((ud & 0xff) == UR_SEND) {
+                uring_gens[cfd]++;
+                uring_conns[cfd] = NULL;
+                c->uring = NULL;
+                c->uring_sending = false;
+                conn_close_done(c);
+            }
+            continue;
+        }
+
+        switch (ud & 0xff) {
+        case UR_RECV:
+            uring_complete_recv(u, c, res, flags);
+            break;
+        case UR_SEND:
+            conn_send_done(c, res);
+            break;
+        }
+    }
+    u->reaping = false;
+
+    uring_feed_starved(u);
+    uring_flush(u);
+}
+
+/*
+ * Checks that the kernel does multishot receives from provided buffers,
+ * on a socketpair, before any client depends on it.
+ */
+static bool uring_probe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int sv[2];
+    bool ok = false;
+    unsigned head, flags;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return false;
+
+    u->reaping = true;  /* submit by hand */
+    sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = 0;
+    u->reaping = false;
+
+    if (write(sv[1], "x", 1) == 1) {
+        __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+        if (sys_io_uring_enter(u->fd, 1, 1, IORING_ENTER_GETEVENTS) >= 0) {
+            head = *u->cq_head;
+            if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                cqe = &u->cqes[head & *u->cq_mask];
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) &&
+                     (cqe->flags & IORING_CQE_F_BUFFER);
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    u->held++;
+                    uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    /* closing both ends finishes the receive; reap whatever it posts */
+    close(sv[1]);
+    close(sv[0]);
+    while (ok && sys_io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) >= 0) {
+        head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+            continue;
+        cqe = &u->cqes[head & *u->cq_mask];
+        flags = cqe->flags;
+        if (flags & IORING_CQE_F_BUFFER) {
+            u->held++;
+            uring_buf_recycle(u, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (!(flags & IORING_CQE_F_MORE))
+            break;
+    }
+    return ok;
+}
+
+static void uring_free(struct uring *u) {
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->efd >= 0)
+        close(u->efd);
+    free(u->br);
+    free(u->bufs);
+    free(u);
+}
+
+/*
+ * Sets up a ring for the libevent thread running *base*. Called for each
+ * thread while they are being set up. Returns 0, or -1 if that thread has
+ * to do without.
+ */
+int uring_attach(struct event_base *base) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct uring *u;
+    size_t sring_sz, cring_sz;
+    char *sq_ptr, *cq_ptr;
+    int i;
+
+    if (nurings == sizeof(urings) / sizeof(urings[0]))
+        return -1;
+
+    if (uring_conns == NULL) {
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+            rl.rlim_cur = 65536;
+        uring_maxfd = (int)rl.rlim_cur;
+        uring_conns = calloc(uring_maxfd, sizeof(conn *));
+        uring_gens = calloc(uring_maxfd, sizeof(uint32_t));
+        if (uring_conns == NULL || uring_gens == NULL) {
+            fprintf(stderr, "failed to allocate the io_uring conn table\n");
+            free(uring_conns);
+            free(uring_gens);
+            uring_conns = NULL;
+            uring_gens = NULL;
+            return -1;
+        }
+    }
+
+    if ((u = calloc(1, sizeof(struct uring))) == NULL)
+        return -1;
+    u->base = base;
+    u->efd = -1;
+
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0) {
+        if (settings.verbose > 0)
+            perror("io_uring_setup()");
+        free(u);
+        return -1;
+    }
+
+    sring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cring_sz > sring_sz)
+            sring_sz = cring_sz;
+        cring_sz = sring_sz;
+    }
+    sq_ptr = mmap(NULL, sring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  u->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        uring_free(u);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            uring_free(u);
+            return -1;
+        }
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        uring_free(u);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    /* the receive buffers, and the ring that hands them to the kernel */
+    if (posix_memalign((void **)&u->br, getpagesize(),
+                       URING_NBUFS * sizeof(struct io_uring_buf)) != 0 ||
+        (u->bufs = malloc((size_t)URING_NBUFS * URING_BUFSIZE)) == NULL) {
+        fprintf(stderr, "failed to allocate io_uring buffers\n");
+        uring_free(u);
+        return -1;
+    }
+    memset(u->br, 0, URING_NBUFS * sizeof(struct io_uring_buf));
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        if (settings.verbose > 0)
+            perror("io_uring_register(PBUF_RING)");
+        uring_free(u);
+        return -1;
+    }
+    u->held = URING_NBUFS;
+    for (i = 0; i < URING_NBUFS; i++)
+        uring_buf_recycle(u, i);
+
+    if (!uring_probe(u)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "no multishot receive in this kernel, using libevent\n");
+        uring_free(u);
+        return -1;
+    }
+
+    if ((u->efd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+        sys_io_uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1) != 0) {
+        perror("io_uring eventfd");
+        uring_free(u);
+        return -1;
+    }
+    event_set(&u->efd_event, u->efd, EV_READ | EV_PERSIST, uring_complete, u);
+    event_base_set(base, &u->efd_event);
+    if (event_add(&u->efd_event, 0) == -1) {
+        fprintf(stderr, "Can't monitor io_uring eventfd\n");
+        uring_free(u);
+        return -1;
+    }
+
+    urings[nurings++] = u;
+    return 0;
+}
+
+/* how many libevent threads have a ring */
+int uring_count(void) {
+    return nurings;
+}
+
+/*
+ * Moves a new TCP conn's I/O to its thread's ring, if it has one. Returns
+ * false if the conn stays with libevent.
+ */
+bool uring_conn_attach(conn *c, struct event_base *base) {
+    struct uring *u = NULL;
+    int i;
+
+    for (i = 0; i < nurings; i++) {
+        if (urings[i]->base == base) {
+            u = urings[i];
+            break;
+        }
+    }
+    if (u == NULL || c->sfd >= uring_maxfd)
+        return false;
+
+    uring_conns[c->sfd] = c;
+    c->uring = u;
+    if (!uring_arm(c)) {
+        uring_conns[c->sfd] = NULL;
+        c->uring = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Detaches a conn that is about to be closed: its receive is cancelled and
+ * anything still to come for it will be dropped. Returns true if it has a
+ * send in flight, which reads from its buffers until the kernel is done
+ * with it: that is cancelled, and the conn is left to conn_close_done() on
+ * its completion, socket and all, so the fd isn't reused meanwhile.
+ */
+bool uring_conn_close(conn *c) {
+    struct uring *u = c->uring;
+    int bid, next;
+
+    if (u == NULL)
+        return false;
+
+    for (bid = c->uring_rhead; bid >= 0; bid = next) {
+        next = u->meta[bid].next;
+        uring_buf_recycle(u, bid);
+    }
+    c->uring_rhead = c->uring_rtail = -1;
+    c->uring_rcount = 0;
+    uring_unstarve(u, c);
+
+    if (c->uring_armed) {
+        uring_cancel(c, UR_RECV);
+        c->uring_armed = false;
+    }
+    if (c->uring_sending) {
+        uring_cancel(c, UR_SEND);
+        uring_flush(u);
+        c->uring_closing = true;
+        return true;
+    }
+    uring_flush(u);
+
+    uring_gens[c->sfd]++;
+    uring_conns[c->sfd] = NULL;
+    c->uring = NULL;
+    return false;
+}
+
+/*
+ * Reads what the conn's receive has collected, like read() on the socket:
+ * returns the bytes copied, 0 at end of stream, or -1 with errno set to
+ * EAGAIN if nothing has come in yet.
+ */
+ssize_t uring_recv(conn *c, void *buf, size_t len) {
+    struct uring *u = c->uring;
+    struct uring_buf *m;
+    size_t n, done = 0;
+    int bid;
+
+    while (done < len && (bid = c->uring_rhead) >= 0) {
+        m = &u->meta[bid];
+        n = m->len - m->off;
+        if (n > len - done)
+            n = len - done;
+        memcpy((char *)buf + done, u->bufs + (size_t)bid * URING_BUFSIZE + m->off, n);
+        m->off += n;
+        done += n;
+        if (m->off == m->len) {
+            c->uring_rhead = m->next;
+            if (c->uring_rhead < 0)
+                c->uring_rtail = -1;
+            c->uring_rcount--;
+            uring_buf_recycle(u, bid);
+        }
+    }
+
+    /* caught up: receive again, once the cancelled receive has ended */
+    if (c->uring_paused && !c->uring_armed && c->uring_rcount < URING_CONN_BUFS / 2) {
+        c->uring_paused = false;
+        if (c->uring_rerr == 0 && !uring_arm(c))
+            uring_starve(u, c);
+    }
+
+    if (done > 0) {
+        uring_feed_starved(u);
+        return done;
+    }
+
+    if (c->uring_rerr == -1)
+        return 0;
+    if (c->uring_rerr != 0) {
+        errno = c->uring_rerr;
+        return -1;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Queues a sendmsg of *m*; conn_send_done() gets the result. Returns false
+ * if the request couldn't be queued, and the caller should send it itself.
+ */
+bool uring_sendmsg(conn *c, struct msghdr *m) {
+    struct io_uring_sqe *sqe = uring_sqe(c->uring);
+
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->sfd;
+    sqe->addr = (uint64_t)(uintptr_t)m;
+    sqe->user_data = uring_tag(c, UR_SEND);
+    c->uring_sending = true;
+    return true;
+}
+
+#else /* !URING_BACKEND */
+
+int uring_attach(struct event_base *base) {
+    return -1;
+}
+
+int uring_count(void) {
+    return 0;
+}
+
+bool uring_conn_attach(conn *c, struct event_base *base) {
+    return false;
+}
+
+bool uring_conn_close(conn *c) {
+    return false;
+}
+
+ssize_t uring_recv(conn *c, void *buf, size_t len) {
+    errno = ENOSYS;
+    return -1;
+}
+
+bool uring_sendmsg(conn *c, struct msghdr *m) {
+    return false;
+}
+
+#endif /* !URING_BACKEND */
@@ -0,0 +1,437 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  Cache warm-up across restarts, from a manifest of the hottest keys.
+ *
+ *  Every get that hits counts its key in a small set-associative table.
+ *  A key that isn't in its set takes the coldest way only once that way's
+ *  count is worn down to 1, each miss wearing it down by one, so keys
+ *  read often stay and the rest pass through.
+ *
+ *  Every -w seconds, and on the way out, the table is written to
+ *  "<env home>/hotkeys", hottest first, one "<ns> <key>" a line, and its
+ *  counts are halved so the manifest follows what is hot now. At startup
+ *  a manifest left behind is read back by a few threads in parallel, to
+ *  fault the pages of those keys into the cache. It runs while serving,
+ *  or, with -J, the server waits for it, up to -J seconds, first.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <db.h>
+
+#define HOTKEYS_WAYS 4
+#define HOTKEYS_SETS 2048       /* 8192 keys */
+#define HOTKEYS_LOCKS 64
+#define HOTKEYS_FILE "hotkeys"
+#define WARMUP_THREADS 8
+
+struct hotkeys_entry {
+    u_int32_t   count;          /* 0 for an empty way */
+    u_int8_t    ns;
+    u_int8_t    nkey;
+    char        key[KEY_MAX_LENGTH];
+};
+
+struct warmup_key {
+    struct bdb_ns *ns;
+    size_t      nkey;
+    char        key[KEY_MAX_LENGTH];
+};
+
+enum warmup_state { WARMUP_IDLE, WARMUP_RUNNING, WARMUP_DONE, WARMUP_FAILED };
+
+static const char *warmup_state_names[] = {
+    "idle", "running", "done", "failed"
+};
+
+static struct hotkeys_entry *hotkeys = NULL;
+static pthread_mutex_t hotkeys_locks[HOTKEYS_LOCKS];
+static pthread_mutex_t hotkeys_save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    enum warmup_state state;
+    struct warmup_key *keys;
+    int nkeys;
+    int next_key;
+    int keys_done;
+    u_int64_t keys_found;
+    u_int64_t bytes;
+    time_t started;
+    time_t finished;
+    int error;
+    /* manifest */
+    u_int64_t saves;
+    int last_save_keys;
+    time_t last_save;
+} warmup;
+
+static pthread_mutex_t warmup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warmup_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t warmup_save_tid, warmup_tid;
+static bool warmup_save_started = false, warmup_started = false;
+
+static uint64_t hotkeys_hash(int ns, const char *key, size_t nkey) {
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)ns;
+
+    while (nkey-- > 0) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* counts a hit on *key* */
+void warmup_touch(struct bdb_ns *ns, const char *key, size_t nkey) {
+    struct hotkeys_entry *set, *e, *victim = NULL;
+    uint64_t hash;
+    int i, n;
+
+    if (hotkeys == NULL || nkey > KEY_MAX_LENGTH)
+        return;
+
+    n = ns - bdb_ns;
+    hash = hotkeys_hash(n, key, nkey) % HOTKEYS_SETS;
+    set = &hotkeys[hash * HOTKEYS_WAYS];
+
+    pthread_mutex_lock(&hotkeys_locks[hash % HOTKEYS_LOCKS]);
+    for (i = 0; i < HOTKEYS_WAYS; i++) {
+        e = &set[i];
+        if (e->count > 0 && e->ns == n && e->nkey == nkey && memcmp(e->key, key, nkey) == 0) {
+            if (e->count < UINT32_MAX)
+                e->count++;
+            pthread_mutex_unlock(&hotkeys_locks[hash % HOTKEYS_LOCKS]);
+            return;
+        }
+        if (victim == NULL || e->count < victim->count)
+            victim = e;
+    }
+    if (victim->count <= 1) {
+        victim->count = 1;
+        victim->ns = n;
+        victim->nkey = nkey;
+        memcpy(victim->key, key, nkey);
+    } else {
+        victim->count--;
+    }
+    pthread_mutex_unlock(&hotkeys_locks[hash % HOTKEYS_LOCKS]);
+}
+
+static int hotkeys_cmp(const void *a, const void *b) {
+    const struct hotkeys_entry *x = a, *y = b;
+
+    return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+/*
+ * Writes the manifest, hottest keys first, and halves the counts. Returns
+ * 0, or -1 if it can't be written.
+ */
+int warmup_save(void) {
+    struct hotkeys_entry *copy;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    FILE *fp;
+    int i, j, n = 0, ret = 0;
+
+    if (hotkeys == NULL)
+        return 0;
+    if ((copy = malloc(sizeof(struct hotkeys_entry) * HOTKEYS_SETS * HOTKEYS_WAYS)) == NULL)
+        return -1;
+
+    for (i = 0; i < HOTKEYS_SETS; i++) {
+        pthread_mutex_lock(&hotkeys_locks[i % HOTKEYS_LOCKS]);
+        for (j = 0; j < HOTKEYS_WAYS; j++) {
+            struct hotkeys_entry *e = &hotkeys[i * HOTKEYS_WAYS + j];
+            if (e->count == 0)
+                continue;
+            memcpy(&copy[n++], e, sizeof(struct hotkeys_entry));
+            /* a key read once and never again ages out */
+            e->count /= 2;
+        }
+        pthread_mutex_unlock(&hotkeys_locks[i % HOTKEYS_LOCKS]);
+    }
+    qsort(copy, n, sizeof(struct hotkeys_entry), hotkeys_cmp);
+
+    snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, HOTKEYS_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    pthread_mutex_lock(&hotkeys_save_lock);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        ret = -1;
+    } else {
+        for (i = 0; i < n; i++)
+            fprintf(fp, "%s %.*s\n", bdb_ns[copy[i].ns].name, copy[i].nkey, copy[i].key);
+        if (fclose(fp) != 0 || rename(tmp, path) != 0)
+            ret = -1;
+    }
+    pthread_mutex_unlock(&hotkeys_save_lock);
+    free(copy);
+
+    if (ret != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&warmup_lock);
+    warmup.saves++;
+    warmup.last_save_keys = n;
+    warmup.last_save = time(NULL);
+    pthread_mutex_unlock(&warmup_lock);
+    return 0;
+}
+
+static void *warmup_save_thread(void *arg) {
+    time_t last = time(NULL);
+
+    affinity_housekeeping();
+    while (!daemon_quit) {
+        sleep(1);
+        if (time(NULL) - last < bdb_settings.hotkeys_val)
+            continue;
+        warmup_save();
+        last = time(NULL);
+    }
+    return NULL;
+}
+
+/* reads the manifest into warmup.keys, keys of a namespace gone are left out */
+static int warmup_read(void) {
+    char path[PATH_MAX], line[NS_NAME_LENGTH + KEY_MAX_LENGTH + 8], *p;
+    struct warmup_key *keys;
+    struct bdb_ns *ns;
+    size_t nkey;
+    int size = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, HOTKEYS_FILE);
+    if ((fp = fopen(path, "r")) == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strchr(line, '\n')) == NULL)
+            continue;
+        *p = '\0';
+        if ((p = strchr(line, ' ')) == NULL)
+            continue;
+        if ((ns = bdb_ns_find(line, p - line)) == NULL)
+            continue;
+        nkey = strlen(p + 1);
+        if (nkey == 0 || nkey > KEY_MAX_LENGTH)
+            continue;
+
+        if (warmup.nkeys == size) {
+            size = size > 0 ? size * 2 : 1024;
+            if ((keys = realloc(warmup.keys, size * sizeof(struct warmup_key))) == NULL)
+                break;
+            warmup.keys = keys;
+        }
+        warmup.keys[warmup.nkeys].ns = ns;
+        warmup.keys[warmup.nkeys].nkey = nkey;
+        memcpy(warmup.keys[warmup.nkeys].key, p + 1, nkey);
+        warmup.nkeys++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void *warmup_worker(void *arg) {
+    struct warmup_key *wk;
+    struct bdb_ns *ns;
+    DB *db;
+    DBT dbkey, dbdata;
+    int ret, attempt;
+
+    affinity_storage();
+    for (;;) {
+        pthread_mutex_lock(&warmup_lock);
+        if (warmup.next_key == warmup.nkeys || daemon_quit) {
+            pthread_mutex_unlock(&warmup_lock);
+            break;
+        }
+        wk = &warmup.keys[warmup.next_key++];
+        pthread_mutex_unlock(&warmup_lock);
+
+        ns = wk->ns;
+        db = ns->dbps[bdb_shard(ns, wk->key, wk->nkey)];
+        attempt = 0;
+        do {
+            memset(&dbkey, 0, sizeof(dbkey));
+            memset(&dbdata, 0, sizeof(dbdata));
+            dbkey.data = wk->key;
+            dbkey.size = wk->nkey;
+            dbdata.flags = DB_DBT_MALLOC;
+            ret = db->get(db, NULL, &dbkey, &dbdata, 0);
+        } while (bdb_retry(ret, &attempt));
+        if (ret == 0)
+            free(dbdata.data);
+
+        pthread_mutex_lock(&warmup_lock);
+        warmup.keys_done++;
+        if (ret == 0) {
+            warmup.keys_found++;
+            warmup.bytes += dbdata.size;
+        } else if (ret != DB_NOTFOUND && warmup.error == 0) {
+            warmup.error = ret;
+        }
+        pthread_mutex_unlock(&warmup_lock);
+    }
+    return NULL;
+}
+
+static void *warmup_thread(void *arg) {
+    pthread_t tids[WARMUP_THREADS];
+    int i, nthreads;
+    enum warmup_state last;
+
+    affinity_housekeeping();
+    nthreads = warmup.nkeys < WARMUP_THREADS ? warmup.nkeys : WARMUP_THREADS;
+    for (i = 0; i < nthreads; i++) {
+        if ((errno = pthread_create(&tids[i], NULL, warmup_worker, NULL)) != 0) {
+            fprintf(stderr, "failed spawning warm-up thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+    nthreads = i;
+    if (nthreads == 0)
+        warmup_worker(NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_lock(&warmup_lock);
+    last = warmup.error == 0 ? WARMUP_DONE : WARMUP_FAILED;
+    warmup.state = last;
+    warmup.finished = time(NULL);
+    free(warmup.keys);
+    warmup.keys = NULL;
+    pthread_cond_broadcast(&warmup_cond);
+    pthread_mutex_unlock(&warmup_lock);
+
+    if (last == WARMUP_FAILED) {
+        fprintf(stderr, "warm-up: dbp->get: %s\n", db_strerror(warmup.error));
+    } else if (settings.verbose > 0) {
+        fprintf(stderr, "warm-up done, %llu of %d keys in %ld seconds\n",
+                (unsigned long long)warmup.keys_found, warmup.nkeys,
+                (long)(warmup.finished - warmup.started));
+    }
+    return NULL;
+}
+
+/*
+ * Starts counting hot keys, and warming the cache up from the manifest
+ * left by the last run, if any. Does nothing unless -w is given.
+ */
+void warmup_init(void) {
+    int i;
+
+    if (bdb_settings.hotkeys_val <= 0)
+        return;
+
+    for (i = 0; i < HOTKEYS_LOCKS; i++)
+        pthread_mutex_init(&hotkeys_locks[i], NULL);
+    hotkeys = calloc(HOTKEYS_SETS * HOTKEYS_WAYS, sizeof(struct hotkeys_entry));
+    if (hotkeys == NULL) {
+        fprintf(stderr, "failed to allocate the hot key table, warm-up disabled\n");
+        return;
+    }
+
+    if ((errno = pthread_create(&warmup_save_tid, NULL, warmup_save_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning hot key thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    warmup_save_started = true;
+
+    if (warmup_read() != 0) {
+        fprintf(stderr, "failed to read %s/%s: %s\n", bdb_settings.env_home,
+                HOTKEYS_FILE, strerror(errno));
+    }
+    if (warmup.nkeys > 0) {
+        warmup.state = WARMUP_RUNNING;
+        warmup.started = time(NULL);
+        if ((errno = pthread_create(&warmup_tid, NULL, warmup_thread, NULL)) != 0) {
+            fprintf(stderr, "failed spawning warm-up thread: %s\n", strerror(errno));
+            warmup.state = WARMUP_FAILED;
+            free(warmup.keys);
+            warmup.keys = NULL;
+        } else {
+            warmup_started = true;
+        }
+    }
+}
+
+/*
+ * Waits for the threads to see daemon_quit and be gone, then saves the
+ * hot keys one last time; before the db closes.
+ */
+void warmup_close(void) {
+    if (warmup_started) {
+        pthread_join(warmup_tid, NULL);
+        warmup_started = false;
+    }
+    if (warmup_save_started) {
+        pthread_join(warmup_save_tid, NULL);
+        warmup_save_started = false;
+    }
+    warmup_save();
+}
+
+/*
+ * Waits for the warm-up to finish, at most *secs* seconds. Returns false
+ * if it is still going.
+ */
+bool warmup_wait(int secs) {
+    struct timeval now;
+    struct timespec until;
+    bool done;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + secs;
+    until.tv_nsec = now.tv_usec * 1000;
+
+    pthread_mutex_lock(&warmup_lock);
+    while (warmup.state == WARMUP_RUNNING && !daemon_quit &&
+           pthread_cond_timedwait(&warmup_cond, &warmup_lock, &until) != ETIMEDOUT)
+        ;
+    done = warmup.state != WARMUP_RUNNING;
+    pthread_mutex_unlock(&warmup_lock);
+    return done;
+}
+
+bool warmup_running(void) {
+    bool running;
+
+    pthread_mutex_lock(&warmup_lock);
+    running = warmup.state == WARMUP_RUNNING;
+    pthread_mutex_unlock(&warmup_lock);
+    return running;
+}
+
+void stats_warmup(char *temp) {
+    char *pos = temp;
+    time_t until;
+
+    pthread_mutex_lock(&warmup_lock);
+    pos += sprintf(pos, "STAT warmup_state %s\r\n", warmup_state_names[warmup.state]);
+    if (warmup.state != WARMUP_IDLE) {
+        until = warmup.finished != 0 ? warmup.finished : time(NULL);
+        pos += sprintf(pos, "STAT warmup_keys %d/%d\r\n", warmup.keys_done, warmup.nkeys);
+        pos += sprintf(pos, "STAT warmup_keys_found %llu\r\n", (unsigned long long)warmup.keys_found);
+        pos += sprintf(pos, "STAT warmup_bytes %llu\r\n", (unsigned long long)warmup.bytes);
+        pos += sprintf(pos, "STAT warmup_elapsed %ld\r\n", (long)(until - warmup.started));
+    }
+    if (warmup.state == WARMUP_FAILED && warmup.error != 0)
+        pos += sprintf(pos, "STAT warmup_error %s\r\n", db_strerror(warmup.error));
+    pos += sprintf(pos, "STAT hotkeys_saves %llu\r\n", (unsigned long long)warmup.saves);
+    pos += sprintf(pos, "STAT hotkeys_last_save_keys %d\r\n", warmup.last_save_keys);
+    pos += sprintf(pos, "STAT hotkeys_last_save %ld\r\n", (long)warmup.last_save);
+    pos += sprintf(pos, "END");
+    pthread_mutex_unlock(&warmup_lock);
+}